@@ -0,0 +1,377 @@
+// End-to-end load generator for password_vault_server
+//
+// Closed loop: every thread sends its next request as soon as the last one
+// returns. Open loop: requests are scheduled at a fixed total rate and
+// latency is measured from the scheduled time, so a slow server can't hide
+// its queueing delay (no coordinated omission).
+//
+// Usage: vault_loadgen [--key value ...]       run and print a JSON report
+//        vault_loadgen --compare OLD.json NEW.json
+#include <httplib.h>
+#include <json.hpp>
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using json = nlohmann::json;
+using namespace std;
+using Clock = chrono::steady_clock;
+
+// Operations the generator can mix
+enum Op { OP_REGISTER, OP_LOGIN, OP_LIST, OP_ADD, OP_UPDATE, OP_DELETE, OP_SEARCH, OP_COUNT };
+static const char* OP_NAMES[OP_COUNT] = {"register", "login", "list", "add", "update", "delete", "search"};
+
+struct LoadConfig {
+    string host = "127.0.0.1";
+    int port = 8080;
+    int threads = 8;
+    int users = 8;                 // accounts shared by the threads
+    int seed_entries = 50;         // entries per user before the run
+    double duration_sec = 10;
+    double warmup_sec = 2;         // excluded from the report
+    double rate = 0;               // total req/s, 0 = closed loop
+    unsigned seed = 42;
+    string output;                 // report file, empty = stdout only
+    string label;                  // free text to tell builds apart
+    int mix[OP_COUNT] = {0, 2, 30, 20, 15, 10, 10}; // relative weights
+};
+
+struct Account {
+    string email;
+    string password;
+    string token;
+};
+
+// Per-thread results - merged at the end
+struct ThreadStats {
+    vector<double> latency_us[OP_COUNT];
+    uint64_t errors[OP_COUNT] = {};
+};
+
+static string runId() {
+    return to_string(chrono::duration_cast<chrono::milliseconds>(
+        chrono::system_clock::now().time_since_epoch()).count());
+}
+
+static httplib::Headers authHeaders(const Account& account) {
+    return {{"Authorization", account.token}};
+}
+
+static bool registerAndLogin(httplib::Client& cli, Account& account) {
+    json creds = {{"username", account.email}, {"password", account.password}};
+    auto reg = cli.Post("/api/register", creds.dump(), "application/json");
+    if(!reg || reg->status != 200) return false;
+
+    auto login = cli.Post("/api/login", creds.dump(), "application/json");
+    if(!login || login->status != 200) return false;
+    account.token = json::parse(login->body).value("sessionToken", "");
+    return !account.token.empty();
+}
+
+static json entryBody(mt19937& rng) {
+    uniform_int_distribution<int> dist(0, 999999);
+    int n = dist(rng);
+    return {
+        {"site", "site" + to_string(n % 5000) + ".example.com"},
+        {"username", "user" + to_string(n % 97) + "@example.com"},
+        {"password", "pw-" + to_string(n)},
+        {"category", (n % 3 == 0) ? "Work" : "Personal"},
+        {"notes", "load test entry"}
+    };
+}
+
+// Run one operation, return false on transport or non-2xx error
+static bool runOp(Op op, httplib::Client& cli, Account& account, vector<uint64_t>& ids,
+                  mt19937& rng, const string& run_id, uint64_t& counter) {
+    switch(op) {
+        case OP_REGISTER: {
+            json creds = {{"username", "lg-" + run_id + "-r" + to_string(counter++) + "@example.com"},
+                          {"password", "loadgen"}};
+            auto res = cli.Post("/api/register", creds.dump(), "application/json");
+            return res && res->status == 200;
+        }
+        case OP_LOGIN: {
+            json creds = {{"username", account.email}, {"password", account.password}};
+            auto res = cli.Post("/api/login", creds.dump(), "application/json");
+            return res && res->status == 200;
+        }
+        case OP_LIST: {
+            auto res = cli.Get("/api/passwords", authHeaders(account));
+            return res && res->status == 200;
+        }
+        case OP_ADD: {
+            auto res = cli.Post("/api/passwords", authHeaders(account), entryBody(rng).dump(), "application/json");
+            if(!res || res->status != 200) return false;
+            ids.push_back(stoull(json::parse(res->body).value("id", "0")));
+            return true;
+        }
+        case OP_UPDATE: {
+            uint64_t id = ids[uniform_int_distribution<size_t>(0, ids.size() - 1)(rng)];
+            auto res = cli.Put("/api/passwords/" + to_string(id), authHeaders(account),
+                               entryBody(rng).dump(), "application/json");
+            return res && res->status == 200;
+        }
+        case OP_DELETE: {
+            size_t pick = uniform_int_distribution<size_t>(0, ids.size() - 1)(rng);
+            uint64_t id = ids[pick];
+            ids[pick] = ids.back();
+            ids.pop_back();
+            // Explicit Content-Length: 0 - without it httplib's server waits
+            // out its read timeout peeking for a body on DELETE
+            httplib::Headers headers = authHeaders(account);
+            headers.emplace("Content-Length", "0");
+            auto res = cli.Delete("/api/passwords/" + to_string(id), headers);
+            return res && res->status == 200;
+        }
+        case OP_SEARCH: {
+            // Autocomplete - the seeded sites are site<n>.example.com
+            string prefix = "site" + to_string(uniform_int_distribution<int>(0, 99)(rng));
+            auto res = cli.Get("/api/passwords/search?prefix=" + prefix, authHeaders(account));
+            return res && res->status == 200;
+        }
+        default:
+            return false;
+    }
+}
+
+static void worker(int index, const LoadConfig& config, vector<Account>& accounts,
+                   vector<vector<uint64_t>>& ids_by_user, Clock::time_point start,
+                   Clock::time_point measure_from, Clock::time_point end,
+                   const string& run_id, ThreadStats& stats) {
+    httplib::Client cli(config.host, config.port);
+    cli.set_keep_alive(true);
+    cli.set_tcp_nodelay(true);
+    cli.set_read_timeout(30, 0);
+
+    mt19937 rng(config.seed + index);
+    discrete_distribution<int> pick_op(std::begin(config.mix), std::end(config.mix));
+
+    // Each user belongs to exactly one thread so id lists need no locking
+    vector<int> my_users;
+    for(int u = index; u < config.users; u += config.threads) my_users.push_back(u);
+
+    double interval_sec = config.rate > 0 ? config.threads / config.rate : 0;
+    uint64_t counter = 0;
+    uint64_t n = 0;
+
+    while(true) {
+        Clock::time_point intended = Clock::now();
+        if(config.rate > 0) {
+            intended = start + chrono::duration_cast<Clock::duration>(
+                chrono::duration<double>(interval_sec * n++));
+            if(intended >= end) break;
+            this_thread::sleep_until(intended);
+        } else if(intended >= end) {
+            break;
+        }
+
+        int user = my_users[counter % my_users.size()];
+        Op op = static_cast<Op>(pick_op(rng));
+        vector<uint64_t>& ids = ids_by_user[user];
+        if((op == OP_UPDATE || op == OP_DELETE) && ids.empty()) op = OP_ADD;
+
+        bool ok = runOp(op, cli, accounts[user], ids, rng, run_id + "-" + to_string(index), counter);
+        Clock::time_point done = Clock::now();
+        counter++;
+
+        if(intended < measure_from) continue;
+        stats.latency_us[op].push_back(chrono::duration<double, micro>(done - intended).count());
+        if(!ok) stats.errors[op]++;
+    }
+}
+
+static double percentile(const vector<double>& sorted, double p) {
+    if(sorted.empty()) return 0;
+    size_t idx = static_cast<size_t>(p * (sorted.size() - 1) + 0.5);
+    return sorted[min(idx, sorted.size() - 1)];
+}
+
+static json summarize(vector<double>& samples, uint64_t errors, double seconds) {
+    sort(samples.begin(), samples.end());
+    double sum = 0;
+    for(double s : samples) sum += s;
+
+    json j;
+    j["count"] = samples.size();
+    j["errors"] = errors;
+    j["throughput_rps"] = seconds > 0 ? samples.size() / seconds : 0;
+    j["mean_us"] = samples.empty() ? 0 : sum / samples.size();
+    j["p50_us"] = percentile(samples, 0.50);
+    j["p99_us"] = percentile(samples, 0.99);
+    j["p999_us"] = percentile(samples, 0.999);
+    j["max_us"] = samples.empty() ? 0 : samples.back();
+    return j;
+}
+
+// Print relative change per operation between two reports
+static int compareReports(const string& old_path, const string& new_path) {
+    ifstream old_file(old_path), new_file(new_path);
+    if(!old_file || !new_file) {
+        cerr << "Failed to open report files" << endl;
+        return 1;
+    }
+    json old_report = json::parse(old_file);
+    json new_report = json::parse(new_file);
+
+    auto delta = [](double before, double after) {
+        return before > 0 ? (after - before) / before * 100.0 : 0.0;
+    };
+
+    json result = json::object();
+    vector<string> names = {"total"};
+    for(const char* name : OP_NAMES) names.push_back(name);
+
+    for(const auto& name : names) {
+        const json& a = name == "total" ? old_report["total"] : old_report["ops"].value(name, json());
+        const json& b = name == "total" ? new_report["total"] : new_report["ops"].value(name, json());
+        if(a.is_null() || b.is_null()) continue;
+
+        json row;
+        for(const char* metric : {"throughput_rps", "p50_us", "p99_us", "p999_us"}) {
+            row[metric] = {{"old", a[metric]}, {"new", b[metric]},
+                           {"change_pct", delta(a[metric], b[metric])}};
+        }
+        result[name] = row;
+    }
+    cout << result.dump(2) << endl;
+    return 0;
+}
+
+static void usage() {
+    cout << "Usage: vault_loadgen [--key value ...]\n"
+         << "  --host H --port P          server (default 127.0.0.1:8080)\n"
+         << "  --threads N                client threads / connections (default 8)\n"
+         << "  --users N                  accounts to create (default 8)\n"
+         << "  --seed-entries N           entries per account before the run (default 50)\n"
+         << "  --duration S --warmup S    seconds (default 10, 2)\n"
+         << "  --rate R                   open loop at R req/s total; 0 = closed loop\n"
+         << "  --mix op=w,...             weights for register,login,list,add,update,delete,search\n"
+         << "  --seed N --label TEXT --output FILE\n"
+         << "  --compare OLD.json NEW.json\n";
+}
+
+int main(int argc, char* argv[]) {
+    LoadConfig config;
+
+    for(int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if(arg == "--help" || arg == "-h") { usage(); return 0; }
+        if(arg == "--compare" && i + 2 < argc) return compareReports(argv[i + 1], argv[i + 2]);
+        if(i + 1 >= argc) { usage(); return 1; }
+        string value = argv[++i];
+
+        if(arg == "--host") config.host = value;
+        else if(arg == "--port") config.port = stoi(value);
+        else if(arg == "--threads") config.threads = max(1, stoi(value));
+        else if(arg == "--users") config.users = max(1, stoi(value));
+        else if(arg == "--seed-entries") config.seed_entries = stoi(value);
+        else if(arg == "--duration") config.duration_sec = stod(value);
+        else if(arg == "--warmup") config.warmup_sec = stod(value);
+        else if(arg == "--rate") config.rate = stod(value);
+        else if(arg == "--seed") config.seed = stoul(value);
+        else if(arg == "--label") config.label = value;
+        else if(arg == "--output") config.output = value;
+        else if(arg == "--mix") {
+            for(int& w : config.mix) w = 0;
+            stringstream ss(value);
+            string item;
+            while(getline(ss, item, ',')) {
+                size_t eq = item.find('=');
+                string name = item.substr(0, eq);
+                int weight = eq == string::npos ? 1 : stoi(item.substr(eq + 1));
+                auto it = find_if(begin(OP_NAMES), end(OP_NAMES), [&](const char* n) { return name == n; });
+                if(it == end(OP_NAMES)) { cerr << "Unknown op in mix: " << name << endl; return 1; }
+                config.mix[it - begin(OP_NAMES)] = weight;
+            }
+        } else {
+            usage();
+            return 1;
+        }
+    }
+
+    // Every thread needs at least one account of its own
+    config.users = max(config.users, config.threads);
+
+    // Setup: accounts and seed data (not measured)
+    string run_id = runId();
+    vector<Account> accounts(config.users);
+    vector<vector<uint64_t>> ids_by_user(config.users);
+    {
+        httplib::Client cli(config.host, config.port);
+        cli.set_keep_alive(true);
+        cli.set_tcp_nodelay(true);
+        mt19937 rng(config.seed);
+        for(int u = 0; u < config.users; u++) {
+            accounts[u].email = "lg-" + run_id + "-" + to_string(u) + "@example.com";
+            accounts[u].password = "loadgen-" + to_string(u);
+            if(!registerAndLogin(cli, accounts[u])) {
+                cerr << "Setup failed: cannot register/login " << accounts[u].email
+                     << " at " << config.host << ":" << config.port << endl;
+                return 1;
+            }
+            for(int e = 0; e < config.seed_entries; e++) {
+                auto res = cli.Post("/api/passwords", authHeaders(accounts[u]), entryBody(rng).dump(), "application/json");
+                if(res && res->status == 200) {
+                    ids_by_user[u].push_back(stoull(json::parse(res->body).value("id", "0")));
+                }
+            }
+        }
+    }
+
+    // Run
+    vector<ThreadStats> stats(config.threads);
+    vector<thread> threads;
+    Clock::time_point start = Clock::now();
+    Clock::time_point measure_from = start + chrono::duration_cast<Clock::duration>(chrono::duration<double>(config.warmup_sec));
+    Clock::time_point end = measure_from + chrono::duration_cast<Clock::duration>(chrono::duration<double>(config.duration_sec));
+
+    for(int t = 0; t < config.threads; t++) {
+        threads.emplace_back(worker, t, cref(config), ref(accounts), ref(ids_by_user),
+                             start, measure_from, end, cref(run_id), ref(stats[t]));
+    }
+    for(auto& t : threads) t.join();
+    double measured = chrono::duration<double>(Clock::now() - measure_from).count();
+
+    // Report
+    json report;
+    report["label"] = config.label;
+    report["mode"] = config.rate > 0 ? "open" : "closed";
+    report["config"] = {
+        {"host", config.host}, {"port", config.port}, {"threads", config.threads},
+        {"users", config.users}, {"seed_entries", config.seed_entries},
+        {"duration_sec", config.duration_sec}, {"warmup_sec", config.warmup_sec},
+        {"rate", config.rate}, {"seed", config.seed}
+    };
+    for(int op = 0; op < OP_COUNT; op++) report["config"]["mix"][OP_NAMES[op]] = config.mix[op];
+    report["measured_sec"] = measured;
+
+    vector<double> all;
+    uint64_t all_errors = 0;
+    for(int op = 0; op < OP_COUNT; op++) {
+        vector<double> samples;
+        uint64_t errors = 0;
+        for(auto& s : stats) {
+            samples.insert(samples.end(), s.latency_us[op].begin(), s.latency_us[op].end());
+            errors += s.errors[op];
+        }
+        if(samples.empty()) continue;
+        all.insert(all.end(), samples.begin(), samples.end());
+        all_errors += errors;
+        report["ops"][OP_NAMES[op]] = summarize(samples, errors, measured);
+    }
+    report["total"] = summarize(all, all_errors, measured);
+
+    cout << report.dump(2) << endl;
+    if(!config.output.empty()) {
+        ofstream out(config.output);
+        out << report.dump(2) << endl;
+    }
+    return all_errors > 0 ? 2 : 0;
+}
@@ -0,0 +1,410 @@
+// Microbenchmarks for the storage and crypto hot paths
+//
+// One JSON object per line: ops/s, ns/op, heap allocations per op and, on
+// Linux, read/write syscalls and block I/O per op (from /proc/self/io and
+// getrusage). Inputs come from a fixed seed so runs are comparable.
+//
+// Usage: vault_bench [--max-records N] [--filter SUBSTR] [--dir PATH] [--min-time SEC]
+#include "btree.hpp"
+#include "auth.hpp"
+#include "crypto.hpp"
+#include "breach_corpus.hpp"
+#include <json.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <new>
+#include <random>
+#include <string>
+#include <vector>
+#ifdef __linux__
+#include <sys/resource.h>
+#endif
+
+using json = nlohmann::json;
+using namespace std;
+
+// Count every heap allocation in the process
+static atomic<uint64_t> allocation_count{0};
+
+void* operator new(size_t size) {
+    allocation_count.fetch_add(1, memory_order_relaxed);
+    if(void* p = malloc(size ? size : 1)) return p;
+    throw bad_alloc();
+}
+void operator delete(void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+
+// Process-wide counters sampled around each benchmark
+struct Counters {
+    uint64_t allocations = 0;
+    uint64_t read_syscalls = 0;
+    uint64_t write_syscalls = 0;
+    uint64_t blocks_in = 0;
+    uint64_t blocks_out = 0;
+    uint64_t minor_faults = 0;
+    uint64_t major_faults = 0;
+
+    static Counters sample() {
+        Counters c;
+        c.allocations = allocation_count.load(memory_order_relaxed);
+#ifdef __linux__
+        ifstream io("/proc/self/io");
+        string key;
+        uint64_t value;
+        while(io >> key >> value) {
+            if(key == "syscr:") c.read_syscalls = value;
+            else if(key == "syscw:") c.write_syscalls = value;
+        }
+        rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        c.blocks_in = usage.ru_inblock;
+        c.blocks_out = usage.ru_oublock;
+        c.minor_faults = usage.ru_minflt;
+        c.major_faults = usage.ru_majflt;
+#endif
+        return c;
+    }
+};
+
+struct BenchOptions {
+    uint64_t max_records = 100000;
+    string filter;
+    string dir = "bench_data";
+    double min_time = 0.3;       // seconds per case (at least one op)
+};
+
+static BenchOptions options;
+
+static bool wanted(const string& name) {
+    return options.filter.empty() || name.find(options.filter) != string::npos;
+}
+
+// Keeps results alive so the optimizer can't drop the benchmarked call
+static volatile uintptr_t sink;
+
+template<typename T>
+static void keep(const T& value) {
+    sink = reinterpret_cast<uintptr_t>(&value);
+}
+
+// Print one JSON line from counters taken around ops operations
+static void report(const string& name, const json& params, uint64_t ops, double elapsed,
+                   const Counters& before, const Counters& after) {
+    double n = static_cast<double>(ops);
+    json result;
+    result["bench"] = name;
+    result["params"] = params;
+    result["ops"] = ops;
+    result["ops_per_sec"] = n / elapsed;
+    result["ns_per_op"] = elapsed * 1e9 / n;
+    result["allocs_per_op"] = (after.allocations - before.allocations) / n;
+    result["read_syscalls_per_op"] = (after.read_syscalls - before.read_syscalls) / n;
+    result["write_syscalls_per_op"] = (after.write_syscalls - before.write_syscalls) / n;
+    result["blocks_in_per_op"] = (after.blocks_in - before.blocks_in) / n;
+    result["blocks_out_per_op"] = (after.blocks_out - before.blocks_out) / n;
+    result["minor_faults_per_op"] = (after.minor_faults - before.minor_faults) / n;
+    result["major_faults_per_op"] = (after.major_faults - before.major_faults) / n;
+    cout << result.dump() << endl;
+}
+
+// Run op(i) until min_time elapses or max_ops is hit
+static void measure(const string& name, const json& params, uint64_t max_ops,
+                    const function<void(uint64_t)>& op) {
+    if(!wanted(name)) return;
+
+    Counters before = Counters::sample();
+    auto start = chrono::steady_clock::now();
+    uint64_t ops = 0;
+    while(ops < max_ops) {
+        op(ops++);
+        // Check the clock every few ops so it doesn't dominate cheap ones
+        if((ops & 15) == 0) {
+            double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            if(elapsed >= options.min_time) break;
+        }
+    }
+    double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    Counters after = Counters::sample();
+
+    report(name, params, ops, elapsed, before, after);
+}
+
+static VaultRecord makeRecord(mt19937_64& rng, uint64_t user_id) {
+    VaultRecord r;
+    r.record_id = 0;
+    r.user_id = user_id;
+    r.site_name = "site" + to_string(rng() % 1000000) + ".example.com";
+    r.username = "user" + to_string(rng() % 1000) + "@example.com";
+    r.encrypted_password = string(64, 'a' + rng() % 26);
+    r.iv = string(32, '0');
+    r.notes = "benchmark";
+    r.category = "Work";
+    r.created_at = 0;
+    r.modified_at = 0;
+    return r;
+}
+
+// BTree at one size: build it, then time each operation on top of it
+static void benchBTree(uint64_t records) {
+    filesystem::remove_all(options.dir);
+    filesystem::create_directories(options.dir);
+    string file = options.dir + "/vault.dat";
+    json params = {{"records", records}};
+
+    mt19937_64 rng(records);
+    vector<string> sites;
+    sites.reserve(records);
+    {
+        BTree tree(file);
+        // Load phase is the insert benchmark: all inserts are timed, not sampled
+        auto start = chrono::steady_clock::now();
+        Counters before = Counters::sample();
+        for(uint64_t i = 0; i < records; i++) {
+            VaultRecord r = makeRecord(rng, 1 + i % 16);
+            sites.push_back(r.site_name);
+            tree.insert(r);
+        }
+        Counters after = Counters::sample();
+        double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+        if(wanted("btree_insert")) {
+            report("btree_insert", params, records, elapsed, before, after);
+        }
+
+        measure("btree_search", params, records, [&](uint64_t i) {
+            uint64_t j = (i * 7919) % records;
+            keep(tree.search(1 + j % 16, sites[j]));
+        });
+
+        // Index-only: descend node pages, no records touched
+        measure("btree_lookup", params, records, [&](uint64_t i) {
+            uint64_t j = (i * 7919) % records;
+            keep(tree.lookupRecordIds(1 + j % 16, sites[j]));
+        });
+        
+        // Id index: one offset lookup and one record parse
+        VaultRecord found;
+        measure("btree_get", params, records, [&](uint64_t i) {
+            tree.get(1 + (i * 7919) % records, found);
+            keep(found);
+        });
+        
+        // Autocomplete: first page of 10 under a 4-character prefix
+        measure("btree_prefix_scan", params, records, [&](uint64_t i) {
+            size_t n = 0;
+            uint64_t j = (i * 7919) % records;
+            tree.scanPrefix(1 + j % 16, sites[j].substr(0, 4), "", 0, [&](string_view, uint64_t) {
+                return ++n < 10;
+            });
+            keep(n);
+        });
+        
+        measure("btree_user_scan", params, records, [&](uint64_t i) {
+            keep(tree.getAllRecordsForUser(1 + i % 16));
+        });
+
+        measure("btree_update", params, records, [&](uint64_t i) {
+            VaultRecord r = makeRecord(rng, 1);
+            tree.update(1 + (i * 7919) % records, r);
+        });
+
+        // Remove from the top of the id range so every op finds its record
+        measure("btree_remove", params, records / 2, [&](uint64_t i) {
+            tree.remove(records - i);
+        });
+    }
+    filesystem::remove_all(options.dir);
+}
+
+// Same records as benchBTree's load phase, through the bottom-up bulk loader
+static void benchBulkLoad(uint64_t records) {
+    filesystem::remove_all(options.dir);
+    filesystem::create_directories(options.dir);
+    json params = {{"records", records}, {"fill_factor", DEFAULT_FILL_FACTOR}};
+    
+    mt19937_64 rng(records);
+    vector<VaultRecord> batch;
+    batch.reserve(records);
+    for(uint64_t i = 0; i < records; i++) {
+        batch.push_back(makeRecord(rng, 1 + i % 16));
+    }
+    
+    {
+        BTree tree(options.dir + "/vault.dat");
+        auto start = chrono::steady_clock::now();
+        Counters before = Counters::sample();
+        tree.insertBatch(batch);
+        Counters after = Counters::sample();
+        double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        report("btree_bulk_load", params, records, elapsed, before, after);
+    }
+    filesystem::remove_all(options.dir);
+}
+
+// HashMap has a fixed 1009-bucket table, so load factor = entries / 1009
+static void benchHashMap(double load_factor) {
+    const uint64_t table_size = 1009;
+    uint64_t entries = static_cast<uint64_t>(load_factor * table_size);
+    json params = {{"load_factor", load_factor}, {"entries", entries}};
+
+    vector<string> keys;
+    for(uint64_t i = 0; i < entries; i++) {
+        keys.push_back("user" + to_string(i) + "@example.com");
+    }
+
+    HashMap<string, uint64_t>* map = new HashMap<string, uint64_t>();
+    for(uint64_t i = 0; i < entries; i++) map->put(keys[i], i);
+
+    measure("hashmap_get_hit", params, UINT64_MAX, [&](uint64_t i) {
+        sink = reinterpret_cast<uintptr_t>(map->get(keys[(i * 7919) % entries]));
+    });
+
+    string missing = "nobody@example.com";
+    measure("hashmap_get_miss", params, UINT64_MAX, [&](uint64_t) {
+        sink = reinterpret_cast<uintptr_t>(map->get(missing));
+    });
+
+    // Update in place - keeps the load factor fixed
+    measure("hashmap_put_existing", params, UINT64_MAX, [&](uint64_t i) {
+        map->put(keys[(i * 7919) % entries], i);
+    });
+    delete map;
+
+    // Fresh inserts up to the load factor
+    HashMap<string, uint64_t>* fresh = new HashMap<string, uint64_t>();
+    measure("hashmap_put_new", params, entries, [&](uint64_t i) {
+        fresh->put(keys[i], i);
+    });
+    delete fresh;
+}
+
+static void benchCrypto() {
+    string salt = Crypto::generateSalt();
+    string key = Crypto::deriveKey("benchmark password", salt);
+    string iv = Crypto::generateIV();
+    string plaintext = "correct horse battery staple";
+    string ciphertext = Crypto::encryptAES256(plaintext, key, iv);
+    vector<uint8_t> bytes = Crypto::generateRandomBytes(32);
+    string hex = Crypto::bytesToHex(bytes);
+
+    measure("crypto_derive_key", {{"iterations", 100000}}, UINT64_MAX, [&](uint64_t) {
+        keep(Crypto::deriveKey("benchmark password", salt));
+    });
+    measure("crypto_encrypt", {{"bytes", plaintext.size()}}, UINT64_MAX, [&](uint64_t) {
+        keep(Crypto::encryptAES256(plaintext, key, iv));
+    });
+    measure("crypto_decrypt", {{"bytes", plaintext.size()}}, UINT64_MAX, [&](uint64_t) {
+        keep(Crypto::decryptAES256(ciphertext, key, iv));
+    });
+    measure("crypto_bytes_to_hex", {{"bytes", 32}}, UINT64_MAX, [&](uint64_t) {
+        keep(Crypto::bytesToHex(bytes));
+    });
+    measure("crypto_hex_to_bytes", {{"bytes", 32}}, UINT64_MAX, [&](uint64_t) {
+        keep(Crypto::hexToBytes(hex));
+    });
+}
+
+// Breach corpus of random hashes: conversion from HIBP text, then lookups
+static void benchBreachCorpus(uint64_t hashes) {
+    if(!wanted("breach_convert") && !wanted("breach_lookup")) return;
+    filesystem::remove_all(options.dir);
+    filesystem::create_directories(options.dir);
+    json params = {{"hashes", hashes}};
+    
+    mt19937_64 rng(hashes);
+    vector<string> sorted;
+    sorted.reserve(hashes);
+    for(uint64_t i = 0; i < hashes; i++) {
+        vector<uint8_t> hash(SHA1_BYTES);
+        for(auto& b : hash) b = static_cast<uint8_t>(rng());
+        sorted.push_back(Crypto::bytesToHex(hash));
+    }
+    sort(sorted.begin(), sorted.end());
+    string text_path = options.dir + "/breach.txt";
+    string corpus_path = options.dir + "/breach.bin";
+    {
+        ofstream text(text_path);
+        for(uint64_t i = 0; i < hashes; i++) {
+            text << sorted[i] << ':' << (i % 97 + 1) << '\n';
+        }
+    }
+    
+    {
+        ifstream text(text_path);
+        Counters before = Counters::sample();
+        auto start = chrono::steady_clock::now();
+        BreachCorpus::convert(text, corpus_path);
+        double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        Counters after = Counters::sample();
+        if(wanted("breach_convert")) report("breach_convert", params, hashes, elapsed, before, after);
+    }
+    
+    BreachCorpus corpus;
+    corpus.open(corpus_path);
+    vector<vector<uint8_t>> present;
+    for(uint64_t i = 0; i < 4096; i++) {
+        present.push_back(Crypto::hexToBytes(sorted[(i * 7919) % hashes]));
+    }
+    vector<vector<uint8_t>> absent;
+    for(uint64_t i = 0; i < 4096; i++) {
+        vector<uint8_t> hash(SHA1_BYTES);
+        for(auto& b : hash) b = static_cast<uint8_t>(rng());
+        absent.push_back(hash);
+    }
+    sorted.clear();
+    sorted.shrink_to_fit();
+    
+    measure("breach_lookup_hit", params, UINT64_MAX, [&](uint64_t i) {
+        sink = corpus.contains(present[i % present.size()].data());
+    });
+    measure("breach_lookup_miss", params, UINT64_MAX, [&](uint64_t i) {
+        sink = corpus.contains(absent[i % absent.size()].data());
+    });
+    // What a write pays: SHA-1 of the password plus the lookup
+    measure("breach_lookup_password", params, UINT64_MAX, [&](uint64_t) {
+        sink = corpus.containsPassword("correct horse battery staple");
+    });
+    filesystem::remove_all(options.dir);
+}
+
+int main(int argc, char* argv[]) {
+    for(int i = 1; i + 1 < argc; i += 2) {
+        string arg = argv[i];
+        if(arg == "--max-records") options.max_records = stoull(argv[i + 1]);
+        else if(arg == "--filter") options.filter = argv[i + 1];
+        else if(arg == "--dir") options.dir = argv[i + 1];
+        else if(arg == "--min-time") options.min_time = stod(argv[i + 1]);
+        else {
+            cerr << "Usage: vault_bench [--max-records N] [--filter SUBSTR] [--dir PATH] [--min-time SEC]" << endl;
+            return 1;
+        }
+    }
+
+    for(uint64_t records = 1000; records <= options.max_records; records *= 10) {
+        if(wanted("btree_insert") || wanted("btree_search") || wanted("btree_lookup") || wanted("btree_get") || wanted("btree_prefix_scan") ||
+           wanted("btree_user_scan") || wanted("btree_update") || wanted("btree_remove")) {
+            benchBTree(records);
+        }
+        if(wanted("btree_bulk_load")) {
+            benchBulkLoad(records);
+        }
+    }
+
+    for(double lf : {0.5, 1.0, 2.0, 4.0, 8.0, 16.0}) {
+        benchHashMap(lf);
+    }
+
+    for(uint64_t hashes = 10000; hashes <= options.max_records * 10; hashes *= 10) {
+        benchBreachCorpus(hashes);
+    }
+
+    benchCrypto();
+    return 0;
+}
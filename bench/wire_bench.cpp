@@ -0,0 +1,107 @@
+// Compare response encoders: nlohmann json DOM vs Wire direct writers
+// Usage: vault_wire_bench [records] [rounds]
+#include <json.hpp>
+#include "wire.hpp"
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <functional>
+
+using json = nlohmann::json;
+using namespace std;
+
+// Same shape as the server's old DOM path
+static string encodeDom(const vector<VaultRecord>& records, WireFormat format) {
+    json pwd_array = json::array();
+    for(const auto& pwd : records) {
+        json pwd_obj;
+        pwd_obj["id"] = to_string(pwd.record_id);
+        pwd_obj["site"] = pwd.site_name;
+        pwd_obj["username"] = pwd.username;
+        pwd_obj["password"] = pwd.encrypted_password;
+        pwd_obj["category"] = pwd.category;
+        pwd_obj["notes"] = pwd.notes;
+        pwd_array.push_back(pwd_obj);
+    }
+    json response;
+    response["success"] = true;
+    response["passwords"] = pwd_array;
+
+    if(format == WireFormat::MsgPack) {
+        vector<uint8_t> bytes = json::to_msgpack(response);
+        return string(bytes.begin(), bytes.end());
+    }
+    if(format == WireFormat::Cbor) {
+        vector<uint8_t> bytes = json::to_cbor(response);
+        return string(bytes.begin(), bytes.end());
+    }
+    return response.dump();
+}
+
+// Same shape via Wire, no DOM
+static string encodeDirect(const vector<VaultRecord>& records, WireFormat format) {
+    string out;
+    if(format == WireFormat::Json) {
+        out = "{\"success\":true,\"passwords\":[";
+        for(size_t i = 0; i < records.size(); i++) {
+            if(i > 0) out += ',';
+            Wire::appendRecord(format, records[i], out);
+        }
+        out += "]}";
+        return out;
+    }
+    Wire::appendMapHeader(format, 2, out);
+    Wire::appendString(format, "success", out);
+    Wire::appendBool(format, true, out);
+    Wire::appendString(format, "passwords", out);
+    Wire::appendArrayHeader(format, records.size(), out);
+    for(const auto& record : records) {
+        Wire::appendRecord(format, record, out);
+    }
+    return out;
+}
+
+static void run(const string& name, const vector<VaultRecord>& records, int rounds,
+                const function<string()>& encode) {
+    size_t bytes = encode().size();  // warm up
+    auto start = chrono::steady_clock::now();
+    for(int i = 0; i < rounds; i++) {
+        bytes = encode().size();
+    }
+    double secs = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    json result;
+    result["encoder"] = name;
+    result["records"] = records.size();
+    result["bytes"] = bytes;
+    result["ns_per_record"] = secs * 1e9 / (double(rounds) * records.size());
+    result["mb_per_s"] = double(bytes) * rounds / secs / 1e6;
+    cout << result.dump() << endl;
+}
+
+int main(int argc, char* argv[]) {
+    size_t count = argc > 1 ? stoul(argv[1]) : 10000;
+    int rounds = argc > 2 ? stoi(argv[2]) : 20;
+
+    vector<VaultRecord> records(count);
+    for(size_t i = 0; i < count; i++) {
+        VaultRecord& r = records[i];
+        r.record_id = i + 1;
+        r.user_id = 1;
+        r.site_name = "site-" + to_string(i) + ".example.com";
+        r.username = "user" + to_string(i % 97) + "@example.com";
+        r.encrypted_password = "P@ss\"word-" + to_string(i * 7919);
+        r.category = (i % 3 == 0) ? "Work" : "Personal";
+        r.notes = "note line\nwith escapes";
+    }
+
+    const WireFormat formats[] = {WireFormat::Json, WireFormat::MsgPack, WireFormat::Cbor};
+    const char* names[] = {"json", "msgpack", "cbor"};
+    for(int f = 0; f < 3; f++) {
+        WireFormat format = formats[f];
+        run(string("dom_") + names[f], records, rounds, [&]() { return encodeDom(records, format); });
+        run(string("wire_") + names[f], records, rounds, [&]() { return encodeDirect(records, format); });
+    }
+    return 0;
+}
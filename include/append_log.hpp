@@ -0,0 +1,33 @@
+#ifndef APPEND_LOG_HPP
+#define APPEND_LOG_HPP
+
+#include <string>
+#include <functional>
+#include <cstdint>
+
+using namespace std;
+
+// Append-only file of fixed-size entries - the on-disk side of the
+// sidecar indexes (change log, fingerprints), which replay it into
+// memory on open. Callers encode entries themselves.
+// A crash mid-append leaves a torn entry at the tail; replay cuts it off
+// so later appends line up again. A rewrite goes to a temp file and is
+// renamed over the old one, so a crash leaves one or the other
+class AppendLog {
+private:
+    string filename;
+    size_t entry_size;
+    string what;            // for error messages
+
+public:
+    AppendLog(const string& filename, size_t entry_size, const string& what);
+
+    // Every whole entry in the file, oldest first - returns how many
+    uint64_t replay(const function<void(const char* entry)>& visit);
+
+    // Whole entries, back to back
+    void append(const string& entries);
+    void rewrite(const string& entries);
+};
+
+#endif
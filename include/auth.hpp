@@ -4,6 +4,8 @@
 #include <string>
 #include <vector>
 #include <cstdint>
+#include <mutex>
+#include <ostream>
 
 using namespace std;
 
@@ -176,10 +178,12 @@ private:
     HashMap<string, Session> sessions;       // lookup by token
     uint64_t next_user_id;
     string users_file;
+    mutex users_mutex;      // registration vs backup snapshots
     
     // File I/O functions
     void loadUsers();
     void saveUsers();
+    void writeUsers(ostream& file);
     
 public:
     AuthManager(const string& users_file);
@@ -202,6 +206,12 @@ public:
     // helpers
     User* getUserByEmail(const string& email);
     User* getUserById(uint64_t user_id);
+    
+    // users.dat as it would be written now
+    string snapshotUsers();
+    
+    // Store an account exactly as given (replicas) - same id, hash and key
+    void putUser(const User& user);
 };
 
 #endif
@@ -0,0 +1,40 @@
+#ifndef BACKUP_HPP
+#define BACKUP_HPP
+
+#include <string>
+#include <istream>
+#include <functional>
+#include <unordered_map>
+#include <cstdint>
+
+using namespace std;
+
+// Backup archive - every store of a data directory at one instant, in one stream
+// Layout (native byte order, like the vault files):
+//   magic "VBK1"
+//   sections  - name length (uint32), name, byte count (uint64), bytes
+//   "end"     - an empty section; an archive without it was cut short
+class BackupArchive {
+public:
+    // Gets the archive a chunk at a time, false stops it (client gone)
+    using Writer = function<bool(const char*, size_t)>;
+
+    // Called on each chunk before it goes out, with its offset in the section
+    using Patch = function<void(uint64_t offset, char* data, size_t size)>;
+
+    static bool writeHeader(const Writer& write);
+
+    // length bytes from in - zeros if the file came up short
+    static bool writeSection(const Writer& write, const string& name, istream& in,
+                             uint64_t length, const Patch& patch = nullptr);
+    static bool writeSection(const Writer& write, const string& name, const string& data);
+    static bool writeEnd(const Writer& write);
+
+    // Unpack sections into their files (section name -> path). Everything
+    // goes to side files first and is renamed into place once the whole
+    // archive has checked out, so a bad archive leaves the old files alone.
+    // Throws runtime_error; returns the bytes restored
+    static uint64_t restore(const string& archive_path, const unordered_map<string, string>& targets);
+};
+
+#endif
@@ -0,0 +1,56 @@
+#ifndef BOUNDED_QUEUE_HPP
+#define BOUNDED_QUEUE_HPP
+
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <cstddef>
+
+using namespace std;
+
+// Blocking FIFO with a fixed capacity - links pipeline stages so a fast
+// producer waits for a slow consumer instead of piling up memory
+template<typename T>
+class BoundedQueue {
+private:
+    deque<T> items;
+    size_t capacity;
+    bool closed;
+    mutex queue_mutex;
+    condition_variable not_full;
+    condition_variable not_empty;
+
+public:
+    explicit BoundedQueue(size_t capacity) : capacity(capacity), closed(false) {}
+
+    // Waits for room - false if the queue was closed meanwhile
+    bool push(T item) {
+        unique_lock<mutex> lock(queue_mutex);
+        not_full.wait(lock, [this] { return closed || items.size() < capacity; });
+        if(closed) return false;
+        items.push_back(move(item));
+        not_empty.notify_one();
+        return true;
+    }
+
+    // Waits for an item - false once the queue is closed and drained
+    bool pop(T& item) {
+        unique_lock<mutex> lock(queue_mutex);
+        not_empty.wait(lock, [this] { return closed || !items.empty(); });
+        if(items.empty()) return false;
+        item = move(items.front());
+        items.pop_front();
+        not_full.notify_one();
+        return true;
+    }
+
+    // No more pushes; pops drain what's left
+    void close() {
+        lock_guard<mutex> lock(queue_mutex);
+        closed = true;
+        not_full.notify_all();
+        not_empty.notify_all();
+    }
+};
+
+#endif
@@ -0,0 +1,47 @@
+#ifndef BREACH_CORPUS_HPP
+#define BREACH_CORPUS_HPP
+
+#include "mapped_file.hpp"
+#include <string>
+#include <istream>
+#include <memory>
+#include <cstdint>
+
+using namespace std;
+
+constexpr size_t SHA1_BYTES = 20;
+
+// Offline set of breached password SHA-1s, memory-mapped
+// File layout (native byte order, see breach_corpus.cpp):
+//   header   - magic, hash count
+//   buckets  - 65537 uint64, index of the first hash per 16-bit prefix
+//   hashes   - 20 bytes each, sorted
+// A lookup reads two bucket entries and interpolates inside the bucket,
+// so it touches a couple of pages whatever the corpus size
+class BreachCorpus {
+private:
+    unique_ptr<MappedFile> file;
+    uint64_t count;
+
+    uint64_t bucketStart(size_t bucket) const;
+    const uint8_t* hashAt(uint64_t i) const;
+
+public:
+    BreachCorpus();
+
+    // Map a converted corpus - throws runtime_error if it isn't one
+    void open(const string& path);
+
+    bool loaded() const { return file != nullptr; }
+    uint64_t size() const { return count; }
+
+    // sha1 is SHA1_BYTES raw bytes
+    bool contains(const uint8_t* sha1) const;
+    bool containsPassword(const string& password) const;
+
+    // HIBP text ("SHA1HEX:count" per line, ordered by hash) to the binary
+    // format, streaming - returns the number of distinct hashes written
+    static uint64_t convert(istream& in, const string& out_path);
+};
+
+#endif
@@ -4,6 +4,15 @@
 #include <string>
 #include <vector>
 #include <cstdint>
+#include <functional>
+#include <string_view>
+#include <set>
+#include <map>
+#include <unordered_map>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include "mapped_file.hpp"
 
 using namespace std;
 
@@ -21,21 +30,162 @@ struct VaultRecord {
     uint64_t modified_at;
 };
 
-// B-Tree node (4KB on disk)
+// A record read in place from the mapped records file
+// Strings point into the mapping - only valid until the next write to the tree
+struct VaultRecordView {
+    uint64_t record_id;
+    uint64_t user_id;
+    string_view site_name;
+    string_view username;
+    string_view encrypted_password;
+    string_view iv;
+    string_view notes;
+    string_view category;
+    uint64_t created_at;
+    uint64_t modified_at;
+    
+    // Copy into an owning record (reuses record's string buffers)
+    void copyTo(VaultRecord& record) const;
+    VaultRecord toRecord() const;
+};
+
+// Node pages on disk (slotted layout, see btree.cpp)
+constexpr size_t NODE_PAGE_SIZE = 4096;
+constexpr size_t MAX_KEY_BYTES = 256;   // longer site names are indexed by their first 256 bytes
+
+// Bulk loads pack pages to this fraction, leaving room for later inserts
+constexpr double DEFAULT_FILL_FACTOR = 0.9;
+
+// One index entry - a (user, site name) key and the record it points to
+struct IndexEntry {
+    string key;
+    uint64_t record_id;
+};
+
+// B-Tree node, decoded from one page
+// Fanout isn't fixed - a node holds as many keys as fit in its page
 struct BTreeNode {
     bool is_leaf;
-    int num_keys;
-    string keys[40];            // up to 40 site names
-    uint64_t children[41];      // up to 41 child nodes
-    uint64_t record_ids[40];    // points to records
+    vector<string> keys;            // (user, site name) keys, sorted
+    vector<uint64_t> record_ids;    // points to records, one per key
+    vector<uint64_t> children;      // keys.size() + 1 child nodes when internal
     uint64_t node_id;
     
-    BTreeNode() : is_leaf(true), num_keys(0), node_id(0) {
-        for(int i = 0; i < 41; i++) children[i] = 0;
-        for(int i = 0; i < 40; i++) record_ids[i] = 0;
+    BTreeNode() : is_leaf(true), node_id(0) {}
+    
+    size_t numKeys() const { return keys.size(); }
+};
+
+// Read-only view of a node page, straight out of the mapping
+// Keys are compared in place; nothing is copied until a node has to change.
+// Only valid until the next write to the tree
+class NodeView {
+private:
+    const char* page;
+    uint64_t node_id;
+    bool leaf;
+    uint16_t num_keys;
+    uint16_t prefix_len;
+    size_t slots_at;            // page offsets of each section
+    size_t record_ids_at;
+    size_t children_at;
+    
+public:
+    NodeView(const char* page, uint64_t node_id);
+    
+    bool isLeaf() const { return leaf; }
+    size_t numKeys() const { return num_keys; }
+    uint64_t nodeId() const { return node_id; }
+    
+    string_view prefix() const;
+    string_view suffix(size_t i) const;
+    uint64_t recordId(size_t i) const;
+    uint64_t child(size_t i) const;
+    
+    // <0, 0, >0 like string::compare, key i against key
+    int compare(size_t i, string_view key) const;
+    
+    // First key >= key / first key > key
+    size_t lowerBound(string_view key) const;
+    size_t upperBound(string_view key) const;
+    
+    // Copy into an owning node for modification
+    void materialize(BTreeNode& node) const;
+};
+
+// Secondary index key - a user's records in modification order
+struct ModifiedKey {
+    uint64_t user_id;
+    uint64_t modified_at;
+    uint64_t record_id;     // tie break for records changed in the same second
+    
+    bool operator<(const ModifiedKey& other) const {
+        if(user_id != other.user_id) return user_id < other.user_id;
+        if(modified_at != other.modified_at) return modified_at < other.modified_at;
+        return record_id < other.record_id;
     }
 };
 
+// One of a user's categories and how many live records are in it
+struct CategoryCount {
+    string name;
+    uint64_t count;
+};
+
+// A user's categories interned to small ids, each with its live records
+// Ids stay put while the vault is open - an emptied category keeps its slot
+struct CategoryDictionary {
+    vector<string> names;                       // category id -> name
+    unordered_map<string, uint32_t> ids;        // name -> category id
+    vector<vector<uint64_t>> record_ids;        // category id -> live record ids, ascending
+};
+
+// How much of the vault's files is reclaimable
+struct StorageStats {
+    uint64_t record_file_bytes = 0;
+    uint64_t dead_record_bytes = 0;     // deleted or superseded record versions
+    uint64_t node_file_bytes = 0;
+    uint64_t free_node_bytes = 0;       // pages on the freelist
+    
+    // Reclaimable share of both files, 0..1
+    double fragmentation() const;
+};
+
+// Progress of one compaction, carried between the BTree compaction calls
+struct CompactionState {
+    struct Moved {
+        uint64_t old_offset;
+        uint64_t new_offset;
+        uint64_t length;
+        uint64_t record_id;     // set by finishCompaction, 0 if killed meanwhile
+    };
+    
+    ofstream records_out;
+    uint64_t source_end = 0;        // copy the old records file up to here
+    uint64_t read_offset = 0;
+    uint64_t written = 0;
+    uint64_t dead_written = 0;      // killed after being copied
+    vector<Moved> moved;
+    uint64_t new_root_id = 0;
+    uint64_t new_node_count = 0;
+};
+
+// vault.dat and its records file as they were when a backup started
+// Writers save a range here just before overwriting it in place (first
+// write wins), so the backup can copy the live files and lay these over
+// what it read. Anything appended past the start sizes isn't copied
+struct FileSnapshot {
+    uint64_t node_file_bytes = 0;
+    uint64_t record_file_bytes = 0;
+    
+    mutex images_mutex;
+    map<uint64_t, string> node_images;      // offset -> bytes as they were
+    map<uint64_t, string> record_images;
+    
+    // Put the original bytes back into data, read from offset of one file
+    void overlay(bool records, uint64_t offset, char* data, size_t length);
+};
+
 // B-Tree for storing passwords on disk
 class BTree {
 private:
@@ -43,35 +193,165 @@ private:
     uint64_t root_id;
     uint64_t next_node_id;
     uint64_t next_record_id;
+    set<uint64_t> free_nodes;   // pages stamped free, reused lowest first
+    uint64_t dead_record_bytes; // record versions marked dead, awaiting compaction
+    vector<uint64_t> record_offsets;    // id index: record_id -> offset of its live copy
+    unordered_map<uint64_t, vector<uint64_t>> user_record_ids;  // user_id -> live record ids, ascending
+    unordered_map<uint64_t, CategoryDictionary> user_categories;    // user_id -> categories in use
+    set<ModifiedKey> modified_index;    // (user_id, modified_at, record_id) of every live record
+    MappedFile node_map;        // vault.dat, random access
+    MappedFile record_map;      // vault.dat.records, scanned front to back
+    shared_ptr<FileSnapshot> snapshot;  // set while a backup is copying
+    
+    // Save bytes about to be overwritten, if a backup needs them
+    void preserve(bool records, uint64_t offset, uint64_t length);
+    void preserveNodeFile();
     
     // Helper functions for disk I/O
     void saveMetadata();
+    NodeView viewNode(uint64_t node_id) const;
     BTreeNode readNode(uint64_t node_id);
     void writeNode(const BTreeNode& node);
+    void writePage(uint64_t node_id, const char* page);
     void writeRecord(const VaultRecord& record);
-    vector<VaultRecord> readAllRecords();
+    void writeRecords(const vector<VaultRecord>& records);
+    bool parseRecord(uint64_t& offset, VaultRecordView& view) const;
+    bool findRecord(uint64_t record_id, uint64_t& offset, uint64_t& length, VaultRecordView& view) const;
+    void killRecord(uint64_t offset, uint64_t length);
+    void loadRecordIndex();
+    uint64_t recordOffset(uint64_t record_id) const;
+    void setRecordOffset(uint64_t record_id, uint64_t offset);
+    void addUserRecord(uint64_t user_id, uint64_t record_id);
+    void dropUserRecord(uint64_t user_id, uint64_t record_id);
+    void addCategoryRecord(uint64_t user_id, string_view category, uint64_t record_id);
+    void dropCategoryRecord(uint64_t user_id, string_view category, uint64_t record_id);
+    void appendNewRecords(vector<VaultRecord>& records);
+    void replaceRecord(const VaultRecord& record, uint64_t offset, uint64_t length, const VaultRecordView& current);
+    
+    // Separator pushed up to the parent when a node splits
+    struct Split {
+        string key;
+        uint64_t record_id;
+        uint64_t right_id;
+    };
+    
+    // What a removal did to the node it ran on
+    enum class RemoveResult {
+        NotFound,
+        Removed,
+        Underflow,      // node is below MIN_FILL_BYTES, parent must rebalance
+        Split           // node outgrew its page (longer separator), parent takes split
+    };
     
     // B-Tree operations
-    void splitChild(BTreeNode& parent, int index);
-    void insertNonFull(BTreeNode& node, const VaultRecord& record);
+    bool insertInto(uint64_t node_id, const string& key, uint64_t record_id, Split& split);
+    bool writeOrSplit(BTreeNode& node, Split& split);
+    static void divideNode(BTreeNode& node, BTreeNode& right, Split& split);
+    void splitNode(BTreeNode& node, Split& split);
+    void insertKey(const string& key, uint64_t record_id);
+    bool hasPagedRoot();
+    bool indexMatchesRecords() const;
+    void bulkLoad(vector<IndexEntry>& entries, double fill_factor);
+    void writeIndexFile(const string& path, vector<IndexEntry>& entries, double fill_factor,
+                        uint64_t& new_root_id, uint64_t& node_count);
+    void loadFreeList();
+    uint64_t allocateNode();
+    void freeNode(uint64_t node_id);
+    
+    void maxEntry(uint64_t node_id, string& key, uint64_t& record_id) const;
+    void rebalance(BTreeNode& parent, size_t i);
+    RemoveResult finishRemove(BTreeNode& node, Split& split);
+    void applyChildResult(BTreeNode& node, size_t i, RemoveResult result, Split& child_split);
+    RemoveResult removeFrom(uint64_t node_id, const string& key, uint64_t record_id, Split& split);
+    bool removeKey(const string& key, uint64_t record_id);
+    void collectMatches(uint64_t node_id, string_view key, vector<uint64_t>& record_ids) const;
+    bool walkFrom(uint64_t node_id, string_view from, const function<bool(string_view, uint64_t)>& visit) const;
     
 public:
     BTree(const string& filename);
     
-    // Add new password
-    bool insert(const VaultRecord& record);
+    // Add new password, returns the id it was given
+    uint64_t insert(const VaultRecord& record);
     
-    // Find passwords by site name
-    vector<VaultRecord> search(const string& site_name);
+    // Add many passwords at once (imports) - one append for the records.
+    // Into an empty tree the index is bulk loaded, otherwise keys are
+    // inserted one by one. Sets each record's id and timestamps
+    void insertBatch(vector<VaultRecord>& records);
+    
+    // Rebuild the whole index bottom-up from the records file
+    void rebuildIndex(double fill_factor = DEFAULT_FILL_FACTOR);
+    
+    // One password by id, through the id index
+    bool get(uint64_t record_id, VaultRecord& record) const;
+    
+    // Same, fields pointing into the mapped file
+    bool getView(uint64_t record_id, VaultRecordView& view) const;
+    
+    // Find a user's passwords by site name
+    vector<VaultRecord> search(uint64_t user_id, const string& site_name);
+    
+    // Record ids a user has indexed under a site name - walks node pages in place
+    // Keys fold ASCII case, so this can include other spellings of the name
+    vector<uint64_t> lookupRecordIds(uint64_t user_id, const string& site_name) const;
+    
+    // A user's index entries whose site name starts with prefix (ASCII case
+    // folded), in (key, record_id) order, resuming after (after_key, after_id)
+    // if after_id isn't 0. Stop early by returning false
+    void scanPrefix(uint64_t user_id, const string& prefix, const string& after_key, uint64_t after_id,
+                    const function<bool(string_view key, uint64_t record_id)>& visit) const;
+    
+    // Up to limit of a user's record ids greater than after_id, ascending
+    // New records always get a higher id, so pages never shift under inserts
+    vector<uint64_t> userRecordIds(uint64_t user_id, uint64_t after_id, size_t limit) const;
+    
+    // Same for the records in one category (exact name)
+    vector<uint64_t> categoryRecordIds(uint64_t user_id, const string& category,
+                                       uint64_t after_id, size_t limit) const;
+    
+    // A user's non-empty categories with record counts, by name
+    vector<CategoryCount> userCategories(uint64_t user_id) const;
+    
+    // Up to limit of a user's records, most recently modified first,
+    // resuming after (before_time, before_id) if before_id isn't 0
+    vector<ModifiedKey> recentRecords(uint64_t user_id, uint64_t before_time, uint64_t before_id,
+                                      size_t limit) const;
     
     // Get all passwords for one user
     vector<VaultRecord> getAllRecordsForUser(uint64_t user_id);
     
-    // Update a password
-    bool update(uint64_t record_id, const VaultRecord& record);
+    // Stream every record through visit without copying - fields point
+    // into the mapped file. Stop early by returning false
+    void scanRecordViews(const function<bool(const VaultRecordView&)>& visit);
+    
+    // Update a password - stored gets the version written, if given
+    bool update(uint64_t record_id, const VaultRecord& record, VaultRecord* stored = nullptr);
     
     // Delete a password
     bool remove(uint64_t record_id);
+    
+    // Store records exactly as given - ids and timestamps included -
+    // adding each or replacing its live version. New ones go out in one
+    // append. For replicas replaying the primary's writes
+    void put(const vector<VaultRecord>& records);
+    
+    StorageStats storageStats() const;
+    
+    // Online compaction, driven by Compactor:
+    //   beginCompaction, copyLiveRecords in chunks (shared lock is enough),
+    //   finishCompaction with writers held off, swapCompaction under the
+    //   exclusive lock. abortCompaction throws the side files away.
+    void beginCompaction(CompactionState& state);
+    bool copyLiveRecords(CompactionState& state, uint64_t max_bytes);
+    void finishCompaction(CompactionState& state, double fill_factor = DEFAULT_FILL_FACTOR);
+    void swapCompaction(CompactionState& state);
+    void abortCompaction(CompactionState& state);
+    
+    // Hot backup: beginSnapshot fixes the file sizes and starts saving
+    // overwritten bytes, endSnapshot stops. Hold writers off around both.
+    // One at a time - beginSnapshot throws if a backup is already running
+    shared_ptr<FileSnapshot> beginSnapshot();
+    void endSnapshot();
+    bool snapshotActive() const { return snapshot != nullptr; }
 };
 
 #endif
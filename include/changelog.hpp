@@ -0,0 +1,90 @@
+#ifndef CHANGELOG_HPP
+#define CHANGELOG_HPP
+
+#include "auth.hpp"
+#include "append_log.hpp"
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <cstdint>
+
+using namespace std;
+
+// What happened to a record
+enum class ChangeOp : uint8_t {
+    Insert = 1,
+    Update = 2,
+    Delete = 3,     // tombstone - record is gone
+    Horizon = 4     // not a change: the user's tombstones up to seq were dropped
+};
+
+// How long a tombstone is kept - a client that syncs at least this often
+// never needs a full resync
+const uint64_t DEFAULT_TOMBSTONE_RETENTION = 90 * 24 * 3600;
+
+// One entry in the change feed
+struct ChangeEntry {
+    uint64_t seq;           // strictly increasing within one shard's log
+    uint64_t user_id;
+    uint64_t record_id;
+    uint64_t modified_at;   // VaultRecord.modified_at (delete time for tombstones)
+    ChangeOp op;
+};
+
+// Result of a delta query - newest entry per record only
+struct ChangeSet {
+    uint64_t latest_seq;            // client sends this back as since=
+    bool expired;                   // since is past the horizon - client needs a full resync
+    vector<ChangeEntry> upserts;    // inserted or updated, oldest first
+    vector<ChangeEntry> tombstones; // deleted
+};
+
+// Sequence-numbered change feed - one per vault shard, so seqs only
+// order changes within that shard and mean nothing across users of others
+// Append-only file on disk, indexed per user in memory so a delta
+// query only looks at that user's entries newer than since
+class ChangeLog {
+private:
+    struct UserLog {
+        vector<ChangeEntry> entries;                // sorted by seq
+        unordered_map<uint64_t, uint64_t> latest;   // record_id -> newest seq
+        uint64_t horizon = 0;                       // tombstones up to here may be gone
+        size_t deletes = 0;                         // tombstones added since the last compact
+    };
+
+    AppendLog file;
+    uint64_t last_seq;
+    uint64_t tombstone_retention;                   // seconds
+    HashMap<uint64_t, UserLog> logs;                // lookup by user_id
+
+    // File I/O functions
+    void load();
+    void appendEntries(const vector<ChangeEntry>& entries);
+
+    UserLog& userLog(uint64_t user_id);
+    void index(const ChangeEntry& entry);
+    void compact(UserLog& log);
+
+public:
+    // Tombstones older than tombstone_retention seconds are dropped, and
+    // the user's horizon moves past them
+    ChangeLog(const string& filename, uint64_t tombstone_retention = DEFAULT_TOMBSTONE_RETENTION);
+
+    // Log a change and return its sequence number
+    uint64_t record(uint64_t user_id, uint64_t record_id, ChangeOp op, uint64_t modified_at);
+    // Same for many records at once - one file append
+    void recordBatch(uint64_t user_id, const vector<uint64_t>& record_ids, ChangeOp op, uint64_t modified_at);
+
+    // Entries already numbered by another server's log (a replica replaying
+    // its primary's), stored with their seqs. Ones at or below latestSeq are
+    // already here, so replaying them again is a no-op
+    void replay(const vector<ChangeEntry>& entries);
+
+    // Everything that happened to this user's records after since - or
+    // expired if a tombstone after since has already been dropped
+    ChangeSet changesSince(uint64_t user_id, uint64_t since);
+
+    uint64_t latestSeq() const { return last_seq; }
+};
+
+#endif
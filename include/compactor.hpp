@@ -0,0 +1,76 @@
+#ifndef COMPACTOR_HPP
+#define COMPACTOR_HPP
+
+#include "btree.hpp"
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+
+using namespace std;
+
+struct CompactionSettings {
+    double threshold = 0.3;                     // fragmentation that triggers a run
+    uint64_t min_dead_bytes = 1024 * 1024;      // don't bother below this
+    uint64_t rate_bytes_per_sec = 8 * 1024 * 1024;   // copy throttle, 0 = unthrottled
+    uint64_t check_interval_sec = 60;           // 0 = never runs on its own
+    double fill_factor = DEFAULT_FILL_FACTOR;
+};
+
+struct CompactionStatus {
+    bool running = false;
+    uint64_t bytes_copied = 0;      // progress through the current run
+    uint64_t bytes_to_copy = 0;
+    uint64_t runs = 0;
+    uint64_t last_reclaimed_bytes = 0;
+    uint64_t total_reclaimed_bytes = 0;
+};
+
+// Background vacuum for a BTree
+// Copies live records to a side file a chunk at a time under the shared
+// lock, so reads and writes carry on between chunks. Only the final
+// catch-up holds writers off (write_gate), and only the file swap takes
+// the exclusive lock.
+class Compactor {
+private:
+    BTree& btree;
+    shared_mutex& vault_mutex;
+    mutex& write_gate;          // every writer takes this before vault_mutex
+    CompactionSettings settings;
+    
+    thread worker;
+    mutex state_mutex;
+    condition_variable wake;
+    bool stopping;
+    bool requested;
+    
+    atomic<bool> running;
+    atomic<uint64_t> bytes_copied;
+    atomic<uint64_t> bytes_to_copy;
+    atomic<uint64_t> runs;
+    atomic<uint64_t> last_reclaimed;
+    atomic<uint64_t> total_reclaimed;
+    
+    void loop();
+    bool due();
+    void compact();
+    
+public:
+    Compactor(BTree& btree, shared_mutex& vault_mutex, mutex& write_gate);
+    ~Compactor();
+    
+    Compactor(const Compactor&) = delete;
+    Compactor& operator=(const Compactor&) = delete;
+    
+    void start(const CompactionSettings& settings);
+    void stop();
+    
+    // Run once now, whatever the fragmentation
+    void request();
+    
+    CompactionStatus status() const;
+};
+
+#endif
@@ -0,0 +1,71 @@
+#ifndef CONFIG_HPP
+#define CONFIG_HPP
+
+#include <string>
+#include <cstdint>
+#include <ctime>
+
+using namespace std;
+
+// Runtime settings for password_vault_server
+// Defaults match what the server used to hard-code
+struct ServerConfig {
+    string host = "0.0.0.0";
+    int port = 8080;
+    string data_dir = "data";
+
+    size_t worker_threads = 0;          // 0 = httplib default (cores - 1, at least 8)
+    size_t max_queued_requests = 0;     // 0 = unbounded
+    int listen_backlog = 5;
+    bool tcp_nodelay = true;            // off = Nagle + delayed ACK stalls small responses ~40ms
+
+    size_t keep_alive_max_count = 100;  // requests per connection
+    time_t keep_alive_timeout_sec = 5;
+    time_t read_timeout_sec = 5;
+    time_t write_timeout_sec = 5;
+
+    size_t max_payload_bytes = 8 * 1024 * 1024;
+
+    // Users are split across this many independent vault files, each with
+    // its own lock. Fixed once the data directory exists
+    size_t vault_shards = 0;                        // 0 = whatever data_dir has, 1 for a new one
+
+    // Background compaction of vault.dat and its records file
+    unsigned compaction_threshold_percent = 30;     // dead share of the files that triggers a run
+    size_t compaction_rate = 8 * 1024 * 1024;       // bytes/s copied, 0 = unthrottled
+    time_t compaction_interval_sec = 60;            // between checks, 0 = off
+
+    size_t record_cache_bytes = 32 * 1024 * 1024;   // per-user record cache, 0 = off
+    size_t search_index_bytes = 16 * 1024 * 1024;   // per-user trigram indexes, LRU beyond this
+
+    string breach_corpus;                           // converted breach corpus file, empty = off
+
+    string admin_token;                             // secret for /api/admin/*, empty = off
+    string restore_from;                            // backup archive unpacked into data_dir at startup
+
+    // Replication - a primary keeps a log of recent writes, replicas follow it
+    size_t replication_backlog = 0;                 // writes kept for replicas to poll, 0 = not a primary
+    string replicate_from;                          // primary's host:port, empty = not a replica
+    time_t replica_max_lag_sec = 10;                // replica refuses reads staler than this, 0 = never
+
+    string vaultFile() const { return data_dir + "/vault.dat"; }
+    string usersFile() const { return data_dir + "/users.dat"; }
+};
+
+// Builds a ServerConfig from a config file and command line
+// Precedence: defaults < --config file < other command line options
+class ConfigLoader {
+public:
+    // Throws runtime_error on unknown keys or bad values
+    static ServerConfig load(int argc, char* argv[]);
+
+    // Apply "key = value" lines, # starts a comment
+    static void applyFile(ServerConfig& config, const string& path);
+
+    // Apply one setting by name (same names in file and as --name on the command line)
+    static void apply(ServerConfig& config, const string& key, const string& value);
+
+    static string usage();
+};
+
+#endif
@@ -43,6 +43,12 @@ public:
     // TODO: OpenSSL EVP functions
     static string decryptAES256(const string& ciphertext, const string& key, const string& iv);
     
+    // HMAC-SHA256 of data under a hex key, hex out
+    static string hmacSHA256(const string& key, const string& data);
+    
+    // Plain SHA-1, hex out - only for matching breach corpora, never for storage
+    static string sha1Hex(const string& data);
+    
     // Helper: bytes to hex string
     static string bytesToHex(const vector<uint8_t>& bytes);
     
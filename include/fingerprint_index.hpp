@@ -0,0 +1,51 @@
+#ifndef FINGERPRINT_INDEX_HPP
+#define FINGERPRINT_INDEX_HPP
+
+#include "auth.hpp"
+#include "append_log.hpp"
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <cstdint>
+
+using namespace std;
+
+// Bytes kept of each HMAC - plenty to tell passwords apart within one vault
+constexpr size_t FINGERPRINT_BYTES = 16;
+
+// Keyed fingerprint of every record's plaintext password
+// Append-only file next to the vault (latest entry per record wins, an
+// all-zero fingerprint is a tombstone), indexed per user in memory, so
+// the reuse audit is a group-by with nothing to decrypt
+class FingerprintIndex {
+private:
+    struct UserPrints {
+        uint64_t user_id;
+        unordered_map<uint64_t, string> by_record;     // record_id -> fingerprint
+    };
+
+    AppendLog file;
+    HashMap<uint64_t, UserPrints> users;    // lookup by user_id
+    vector<uint64_t> user_ids;              // everyone in users, for rewrite
+
+    // File I/O functions
+    void load();
+    void appendEntries(uint64_t user_id, const vector<pair<uint64_t, string>>& entries);
+    void rewrite();
+
+    UserPrints& userPrints(uint64_t user_id);
+
+public:
+    FingerprintIndex(const string& filename);
+
+    // fingerprint is FINGERPRINT_BYTES raw bytes
+    void set(uint64_t user_id, uint64_t record_id, const string& fingerprint);
+    void setBatch(uint64_t user_id, const vector<pair<uint64_t, string>>& entries);   // record_id, fingerprint
+    void erase(uint64_t user_id, uint64_t record_id);
+    bool contains(uint64_t user_id, uint64_t record_id);
+
+    // Records that share a fingerprint, two or more per group, ids ascending
+    vector<vector<uint64_t>> duplicates(uint64_t user_id);
+};
+
+#endif
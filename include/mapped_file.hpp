@@ -0,0 +1,66 @@
+#ifndef MAPPED_FILE_HPP
+#define MAPPED_FILE_HPP
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+using namespace std;
+
+// Access pattern hint passed on to madvise
+enum class MapAccess {
+    Normal,
+    Sequential,     // full scans - read ahead aggressively, drop pages behind
+    Random          // point lookups - no read ahead
+};
+
+// Read-only memory mapping of a file
+// Writes still go through fstream - a shared mapping sees them through the
+// page cache. The mapping reserves more address space than the file needs,
+// so appends only have to call refresh() to make the new bytes readable;
+// a new mapping is only made when the file outgrows the reservation.
+//
+// Not thread safe on its own: refresh()/reopen() must not run while another
+// thread reads data() (BTree only calls them with the vault write lock held)
+class MappedFile {
+private:
+    string path;
+    MapAccess access;
+    int fd;
+    uint64_t inode;         // detects the file being replaced by rename
+    char* base;
+    size_t reserved;        // bytes of address space mapped
+    size_t length;          // bytes readable (file size at last refresh)
+#ifdef _WIN32
+    vector<char> buffer;    // no mmap - keep a private copy instead
+#endif
+
+    void map(size_t file_size);
+    void unmap();
+    void close();
+
+public:
+    MappedFile(const string& path, MapAccess access = MapAccess::Normal);
+    ~MappedFile();
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    // Pick up growth or truncation after a write, or a file created since
+    void refresh();
+
+    // Map the path again from scratch (file was replaced by rename)
+    void reopen();
+
+    // Hint for a byte range, or the whole mapping if length is 0
+    void advise(MapAccess hint, size_t offset = 0, size_t range = 0);
+
+    const char* data() const { return base; }
+    size_t size() const { return length; }
+    bool contains(uint64_t offset, size_t bytes) const {
+        return offset <= length && bytes <= length - offset;
+    }
+};
+
+#endif
@@ -0,0 +1,143 @@
+#ifndef RECORD_CACHE_HPP
+#define RECORD_CACHE_HPP
+
+#include "btree.hpp"
+#include "auth.hpp"
+#include <iterator>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <cstdint>
+
+using namespace std;
+
+struct RecordCacheStats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+    uint64_t users = 0;             // vaults currently cached
+    uint64_t bytes = 0;
+    uint64_t budget_bytes = 0;
+
+    double hitRatio() const {
+        uint64_t lookups = hits + misses;
+        return lookups == 0 ? 0.0 : static_cast<double>(hits) / lookups;
+    }
+};
+
+// One cached vault - a user's records in id order, in chunks of up to
+// CHUNK_RECORDS. Never changed once built: a write makes a new version
+// that shares every chunk it didn't touch, so it copies one chunk and the
+// chunk list, not the whole vault
+class CachedVault {
+public:
+    using Chunk = shared_ptr<const vector<VaultRecord>>;
+    static const size_t CHUNK_RECORDS = 64;
+
+    class const_iterator {
+    private:
+        const vector<Chunk>* chunks;
+        size_t chunk;
+        size_t pos;
+
+    public:
+        using iterator_category = forward_iterator_tag;
+        using value_type = VaultRecord;
+        using difference_type = ptrdiff_t;
+        using pointer = const VaultRecord*;
+        using reference = const VaultRecord&;
+
+        const_iterator(const vector<Chunk>* chunks, size_t chunk) : chunks(chunks), chunk(chunk), pos(0) {}
+
+        reference operator*() const { return (*(*chunks)[chunk])[pos]; }
+        pointer operator->() const { return &**this; }
+        const_iterator& operator++() {
+            if(++pos == (*chunks)[chunk]->size()) {
+                chunk++;
+                pos = 0;
+            }
+            return *this;
+        }
+        const_iterator operator++(int) { const_iterator old = *this; ++*this; return old; }
+        bool operator==(const const_iterator& other) const { return chunk == other.chunk && pos == other.pos; }
+        bool operator!=(const const_iterator& other) const { return !(*this == other); }
+    };
+
+private:
+    vector<Chunk> chunks;       // never empty ones
+    size_t count = 0;
+
+    // Chunk record_id belongs in - the first whose last id is >= it, else the last
+    size_t chunkFor(uint64_t record_id) const;
+
+public:
+    CachedVault() = default;
+    explicit CachedVault(vector<VaultRecord> records);     // must be in id order
+
+    size_t size() const { return count; }
+    const_iterator begin() const { return const_iterator(&chunks, 0); }
+    const_iterator end() const { return const_iterator(&chunks, chunks.size()); }
+
+    const VaultRecord* find(uint64_t record_id) const;
+    vector<VaultRecord> toVector() const;
+
+    // New versions - this one is left as it is
+    CachedVault with(const VaultRecord& record) const;     // added, or replacing the same id
+    CachedVault without(uint64_t record_id) const;
+};
+
+// LRU cache of each active user's vault records, as stored (still encrypted)
+// Entries are immutable snapshots - readers keep a shared_ptr and walk it
+// without holding any lock, writers swap in a new version.
+// Bounded by an estimate of the bytes the records take, 0 = disabled.
+class RecordCache {
+public:
+    using Snapshot = shared_ptr<const CachedVault>;
+
+private:
+    struct Entry {
+        Snapshot records;
+        size_t bytes;
+        list<uint64_t>::iterator lru_pos;
+    };
+
+    mutable mutex cache_mutex;
+    HashMap<uint64_t, Entry> entries;   // lookup by user_id
+    list<uint64_t> lru;                 // most recently used first
+    size_t budget;
+    size_t total_bytes;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+
+    static size_t recordBytes(const VaultRecord& record);
+    void store(uint64_t user_id, Snapshot records, size_t bytes);
+    void drop(uint64_t user_id, Entry* entry);
+    void evict();
+
+public:
+    static const size_t DEFAULT_BUDGET = 32 * 1024 * 1024;
+
+    RecordCache(size_t budget_bytes = DEFAULT_BUDGET);
+
+    RecordCache(const RecordCache&) = delete;
+    RecordCache& operator=(const RecordCache&) = delete;
+
+    void setBudget(size_t budget_bytes);
+
+    // User's records in id order, or nullptr on a miss
+    Snapshot get(uint64_t user_id);
+
+    // Cache a user's records (in id order) after reading them from disk
+    Snapshot put(uint64_t user_id, vector<VaultRecord> records);
+
+    // Write-through - no-ops when the user isn't cached
+    void upsert(uint64_t user_id, const VaultRecord& record);    // new or rewritten
+    void erase(uint64_t user_id, uint64_t record_id);
+    void invalidate(uint64_t user_id);
+
+    RecordCacheStats stats() const;
+};
+
+#endif
@@ -0,0 +1,76 @@
+#ifndef REPLICA_HPP
+#define REPLICA_HPP
+
+#include "storage.hpp"
+#include <string>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <cstdint>
+
+using namespace std;
+
+// How far behind the primary a replica is, for /api/health
+struct ReplicaStatus {
+    string primary;
+    bool connected;
+    bool resync_needed;         // fell out of the primary's log - restart to reseed
+    uint64_t applied_seq;
+    uint64_t primary_seq;       // head of the primary's log at the last poll
+    double lag_seconds;         // since the replica last held everything the primary had, -1 = never
+};
+
+// Follows a primary's replication log (GET /api/replication/log) on a
+// background thread and replays it into the local vault. Polls are long
+// polls, so an idle primary costs one request a second and a write
+// reaches the replica as soon as it's made
+class ReplicaFollower {
+private:
+    shared_ptr<StorageManager> storage;
+    string primary;
+    string host;
+    int port;
+    string admin_token;
+    string name;                // how the primary lists this replica
+
+    mutable mutex status_mutex;
+    condition_variable stop_signal;
+    bool stopping;
+    string epoch;
+    uint64_t applied_seq;
+    uint64_t primary_seq;
+    bool connected;
+    bool resync_needed;
+    bool caught_up;
+    chrono::steady_clock::time_point caught_up_at;
+    deque<pair<uint64_t, chrono::steady_clock::time_point>> heads;  // heads seen, not yet applied
+    thread follower;
+
+    void run();
+    bool pause(chrono::milliseconds delay);     // false if stopped meanwhile
+
+public:
+    // primary is host:port; admin_token is the primary's
+    ReplicaFollower(shared_ptr<StorageManager> storage, const string& primary,
+                    const string& admin_token, const string& name);
+    ~ReplicaFollower();
+
+    // Resume from the saved position - run bootstrap first
+    void start();
+    ReplicaStatus status() const;
+
+    // Held everything the primary had no more than max_lag_sec ago
+    bool withinLag(time_t max_lag_sec) const;
+
+    // Seed the data files from a backup of the primary, unless the saved
+    // position is still in its log (or the primary can't be reached to
+    // tell). Before a StorageManager opens the files. True if it reseeded.
+    // Throws runtime_error
+    static bool bootstrap(const string& primary, const string& admin_token,
+                          const string& vault_file, const string& users_file);
+};
+
+#endif
@@ -0,0 +1,90 @@
+#ifndef REPLICATION_HPP
+#define REPLICATION_HPP
+
+#include "btree.hpp"
+#include "auth.hpp"
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <cstdint>
+#include <ctime>
+
+using namespace std;
+
+// What a replicated write did
+enum class ReplicationOp : uint8_t {
+    Insert = 1,
+    Update = 2,
+    Delete = 3,
+    User = 4        // new account
+};
+
+// One write on the primary, as a replica replays it
+struct ReplicationEntry {
+    uint64_t seq = 0;           // replication log position, not the change log's
+    ReplicationOp op = ReplicationOp::Insert;
+    uint64_t changed_at = 0;    // what the primary's change log was given
+    uint64_t change_seq = 0;    // and the seq it numbered the change with (not User)
+    VaultRecord record{};       // Insert/Update: the version stored, still encrypted
+                                // Delete: just record_id and user_id
+    string fingerprint;         // Insert/Update, empty if the primary had none
+    User user{};                // User
+};
+
+// A replica the primary has heard from
+struct ReplicaInfo {
+    string name;
+    uint64_t acked_seq;         // the since= of its last poll - everything up to it is applied
+    time_t last_seen;
+};
+
+// The primary's recent writes, in order, for replicas to poll
+// Memory only: holds the last capacity entries, and a replica that falls
+// further behind than that - or polls across a primary restart, which
+// changes the epoch - has to start over from a backup
+class ReplicationLog {
+private:
+    string log_epoch;               // random per process
+    size_t capacity;
+    deque<ReplicationEntry> entries;
+    uint64_t last_seq;
+    map<string, ReplicaInfo> replicas;
+    mutable mutex log_mutex;
+    condition_variable appended;
+
+public:
+    explicit ReplicationLog(size_t capacity = 0);
+
+    // 0 = off: nothing is kept and every poll needs a resync
+    void setCapacity(size_t entries);
+    bool enabled() const;
+
+    // Numbers the entries and wakes waiting polls
+    void append(vector<ReplicationEntry>& batch);
+
+    // Up to max entries after since, waiting up to wait for one if there
+    // are none yet. False if since isn't in the log any more (or never was)
+    bool since(uint64_t since, size_t max, chrono::milliseconds wait, vector<ReplicationEntry>& out);
+
+    const string& epoch() const { return log_epoch; }
+    uint64_t lastSeq() const;
+    size_t size() const;
+
+    // Polls double as acks - since= says what the replica has applied
+    void noteReplica(const string& name, uint64_t acked_seq);
+    vector<ReplicaInfo> replicaList() const;
+
+    // Wire format for a poll reply (native byte order, like the vault files):
+    //   head seq (uint64), then per entry its seq, op, changed_at, the
+    //   change seq (record ops) and the op's fields, strings as length
+    //   (uint64) + bytes
+    static void encode(uint64_t head_seq, const vector<ReplicationEntry>& entries, string& out);
+    // Throws runtime_error on a truncated or garbled body
+    static vector<ReplicationEntry> decode(const string& data, uint64_t& head_seq);
+};
+
+#endif
@@ -3,19 +3,115 @@
 
 #include "btree.hpp"
 #include "auth.hpp"
+#include "backup.hpp"
+#include "changelog.hpp"
+#include "compactor.hpp"
+#include "record_cache.hpp"
+#include "trigram_index.hpp"
+#include "fingerprint_index.hpp"
+#include "breach_corpus.hpp"
+#include "replication.hpp"
 #include <string>
 #include <vector>
+#include <shared_mutex>
+#include <mutex>
+#include <memory>
 
 using namespace std;
 
-// Main storage - ties together auth and btree
+// Delta sync result
+struct VaultChanges {
+    uint64_t seq;                   // pass back as since= on the next sync
+    bool full;                      // true = records is the whole vault, replace local copy
+    vector<VaultRecord> records;    // inserted or updated (decrypted)
+    vector<uint64_t> deleted_ids;
+};
+
+// One page of a listing - pass next_cursor back for the next page
+struct VaultPage {
+    vector<VaultRecord> records;    // decrypted
+    string next_cursor;             // empty on the last page
+};
+
+// A new entry before encryption, as imports hand it over
+struct VaultEntryInput {
+    string site_name;
+    string username;
+    string password;
+    string notes;
+    string category;
+};
+
+// An entry encrypted and fingerprinted, ready to be written
+struct PreparedEntry {
+    VaultRecord record;
+    string fingerprint;
+    bool breached;                  // password is in the breach corpus
+};
+
+// What addVaultEntry wrote
+struct VaultWrite {
+    uint64_t record_id;
+    bool breached;                  // password is in the breach corpus
+};
+
+// Records sharing one password, found by the reuse audit
+struct ReuseGroup {
+    vector<VaultRecord> records;    // password and iv left empty
+};
+
+// Listing order for getVaultPage
+enum class VaultOrder {
+    ById,           // oldest entry first, stable under inserts
+    ByModified      // most recently changed first
+};
+
+// Most shards a vault can be split into
+const size_t MAX_VAULT_SHARDS = 256;
+
+// One slice of the vault: a BTree with its own change log, fingerprints,
+// locks and compactor. Every user's records live in exactly one shard, so
+// shards never look at each other - writers to different shards don't
+// wait on each other, and compaction or a scan only covers one shard's files
+struct VaultShard {
+    BTree btree;
+    ChangeLog change_log;
+    FingerprintIndex fingerprints;  // keyed hash of each password, for the reuse audit
+    shared_mutex vault_mutex;   // readers share, writers exclusive
+    mutex write_gate;           // writers take this first - lets compaction hold them off
+    Compactor compactor;        // last, so its thread stops before the rest goes away
+    
+    explicit VaultShard(const string& vault_file);
+};
+
+// Main storage - ties together auth and the vault shards
 class StorageManager {
 private:
-    BTree btree;
+    string vault_file;          // shard 0's file - the others are named after it
+    string users_file;
     AuthManager auth_manager;
+    RecordCache record_cache;   // hot users' records, kept in step by every write
+    TrigramIndex search_index;  // for users who have searched, likewise
+    BreachCorpus breach_corpus;     // read-only once loaded at startup
+    ReplicationLog replication_log; // recent writes for replicas, when this is a primary
+    vector<unique_ptr<VaultShard>> shards;
+    
+    // The shard holding a user's records
+    size_t shardIndex(uint64_t user_id) const;
+    VaultShard& shardFor(uint64_t user_id);
+    
+    // User's records from the cache, loading them on a miss - hold the shard's vault_mutex
+    RecordCache::Snapshot userRecords(uint64_t user_id);
+    bool ownsRecord(uint64_t user_id, uint64_t record_id);
+    
+    // Queue a write for replicas - hold the shard's vault_mutex so they see writes in order
+    void replicate(ReplicationOp op, const VaultRecord& record, const string& fingerprint,
+                   uint64_t changed_at, uint64_t change_seq);
     
 public:
-    StorageManager(const string& vault_file, const string& users_file);
+    // shard_count 0 opens whatever the data directory has (one shard for a
+    // new one). Throws runtime_error if it holds a different number
+    StorageManager(const string& vault_file, const string& users_file, size_t shard_count = 0);
     
     // user stuff
     uint64_t registerUser(const string& email, const string& password, const string& recovery_phrase);
@@ -23,18 +119,99 @@ public:
     bool logoutUser(const string& token);
     uint64_t validateSession(const string& token);
     
-    // vault stuff
-    // TODO: encrypt passwords and save to btree
-    uint64_t addVaultEntry(uint64_t user_id, const string& site_name, 
+    // vault stuff - adds and updates also check the password against the
+    // breach corpus (never breached when none is loaded)
+    VaultWrite addVaultEntry(uint64_t user_id, const string& site_name, 
                           const string& username, const string& password,
                           const string& notes, const string& category);
     
-    vector<VaultRecord> getUserVault(uint64_t user_id);
-    vector<VaultRecord> searchVaultEntry(uint64_t user_id, const string& site_name);
+    bool getVaultEntry(uint64_t user_id, uint64_t record_id, VaultRecord& record);
+    void forEachVaultEntry(uint64_t user_id, const function<bool(const VaultRecord&)>& visit);
+    
+    // one page of the vault, optionally just one category
+    // throws invalid_argument on a cursor this didn't hand out
+    VaultPage getVaultPage(uint64_t user_id, size_t limit, const string& cursor,
+                           const string& category = "", VaultOrder order = VaultOrder::ById);
+    
+    // categories in use with their record counts
+    vector<CategoryCount> getCategories(uint64_t user_id);
+    
+    // site names starting with prefix (ASCII case-insensitive), in name order
+    // throws invalid_argument on a cursor this didn't hand out
+    VaultPage searchVaultPrefix(uint64_t user_id, const string& prefix, size_t limit, const string& cursor);
+    
+    // substring and typo-tolerant search over site, username and category,
+    // best matches first
+    vector<VaultRecord> searchVault(uint64_t user_id, const string& query, size_t limit);
     bool updateVaultEntry(uint64_t user_id, uint64_t record_id, 
                          const string& site_name, const string& username,
-                         const string& password, const string& notes, const string& category);
+                         const string& password, const string& notes, const string& category,
+                         bool& breached);
     bool deleteVaultEntry(uint64_t user_id, uint64_t record_id);
+    
+    // passwords used by more than one entry, from fingerprints - only
+    // entries saved before fingerprints existed are ever decrypted
+    vector<ReuseGroup> auditReuse(uint64_t user_id);
+    
+    // offline breach corpus - load before serving requests
+    void loadBreachCorpus(const string& path);
+    bool hasBreachCorpus() const;
+    uint64_t breachCorpusSize() const;
+    
+    // entries whose password is in the breach corpus (password and iv left empty)
+    vector<VaultRecord> auditBreached(uint64_t user_id);
+    
+    // bulk transfer stages (see vault_transfer.hpp): prepareEntry and
+    // decryptEntries are pure CPU and safe from any thread, the others
+    // take the vault lock once per batch
+    PreparedEntry prepareEntry(uint64_t user_id, const VaultEntryInput& input);
+    void addPreparedEntries(uint64_t user_id, vector<PreparedEntry>& entries);
+    vector<VaultRecord> readVaultBatch(uint64_t user_id, uint64_t after_id, size_t limit);
+    void decryptEntries(uint64_t user_id, vector<VaultRecord>& records);     // throws if one can't be decrypted
+    
+    // delta sync - what changed since the client's last seq
+    VaultChanges getVaultChanges(uint64_t user_id, uint64_t since);
+    
+    // background compaction of the vault files, one compactor per shard
+    // (stats and status are totals over the shards)
+    void startCompaction(const CompactionSettings& settings);
+    StorageStats getStorageStats();
+    CompactionStatus getCompactionStatus() const;
+    size_t shardCount() const { return shards.size(); }
+    
+    // per-user record cache, 0 bytes turns it off
+    void setRecordCacheBudget(size_t bytes);
+    RecordCacheStats getRecordCacheStats() const;
+    
+    // per-user search indexes, LRU within the budget
+    void setSearchIndexBudget(size_t bytes);
+    TrigramIndexStats getSearchIndexStats() const;
+    
+    // hot backup - streams an archive of every store (see backup.hpp) as of
+    // the moment it starts while reads and writes carry on. False if write
+    // gave up. Throws runtime_error if another backup is running
+    bool writeBackup(const BackupArchive::Writer& write);
+    bool backupRunning();
+    
+    // Unpack an archive over the data files - before a StorageManager opens them
+    static uint64_t restoreBackup(const string& archive_path, const string& vault_file, const string& users_file);
+    
+    // replication, primary side: how many recent writes are kept for
+    // replicas to poll (0 = off). Set before serving requests
+    void setReplicationBacklog(size_t entries);
+    ReplicationLog& replicationLog() { return replication_log; }
+    
+    // replica side: replay entries from the primary's log of epoch, then
+    // save how far this replica has got
+    void applyReplicated(const string& epoch, const vector<ReplicationEntry>& entries);
+    
+    const string& vaultFile() const { return vault_file; }
+    
+    // Saved replica position (vault.dat.replica) - false if there isn't one
+    static bool readReplicaPosition(const string& vault_file, string& epoch, uint64_t& seq);
+    
+    // Shard n's vault file: vault_file itself for shard 0, vault-n.dat beside it for the rest
+    static string shardFile(const string& vault_file, size_t shard);
 };
 
 #endif
@@ -0,0 +1,106 @@
+#ifndef TRIGRAM_INDEX_HPP
+#define TRIGRAM_INDEX_HPP
+
+#include "btree.hpp"
+#include "auth.hpp"
+#include "record_cache.hpp"
+#include <string>
+#include <string_view>
+#include <vector>
+#include <unordered_map>
+#include <list>
+#include <mutex>
+#include <cstdint>
+
+using namespace std;
+
+// Sorted record ids, stored as varint deltas - a few bytes per id
+class PostingList {
+private:
+    string bytes;
+    uint64_t last_id;
+    uint32_t count;
+
+public:
+    PostingList() : last_id(0), count(0) {}
+
+    void add(uint64_t record_id);       // cheap when record_id is the largest so far
+    void remove(uint64_t record_id);
+    void decode(vector<uint64_t>& out) const;
+
+    size_t size() const { return count; }
+    size_t byteSize() const { return bytes.size(); }
+};
+
+struct TrigramIndexStats {
+    uint64_t users = 0;             // indexes currently kept
+    uint64_t bytes = 0;
+    uint64_t budget_bytes = 0;
+    uint64_t evictions = 0;
+};
+
+// Per-user trigram inverted index over site_name, username and category
+// Trigrams are taken per field, ASCII case folded. Only kept for users
+// who have searched - build() on first use, then add/remove keep it
+// current (no-ops for users without one).
+// LRU bounded by an estimate of the postings' bytes, like RecordCache,
+// except the most recently used index is always kept so a search can
+// run right after building it.
+class TrigramIndex {
+public:
+    // A record and how many of the query's trigrams it has
+    struct Match {
+        uint64_t record_id;
+        uint32_t shared;
+    };
+
+private:
+    struct UserIndex {
+        unordered_map<uint32_t, PostingList> postings;     // trigram -> records
+        size_t bytes = 0;
+        list<uint64_t>::iterator lru_pos;
+    };
+
+    mutable mutex index_mutex;
+    HashMap<uint64_t, UserIndex> users;     // lookup by user_id
+    list<uint64_t> lru;                     // most recently used first
+    size_t budget;
+    size_t total_bytes;
+    uint64_t evictions;
+
+    static void recordTrigrams(const VaultRecord& record, vector<uint32_t>& out);
+    static void addPosting(UserIndex& index, uint32_t gram, uint64_t record_id);
+
+    // Both with index_mutex held
+    void touch(UserIndex& index);
+    void evict();
+
+public:
+    static const size_t DEFAULT_BUDGET = 16 * 1024 * 1024;
+
+    TrigramIndex(size_t budget_bytes = DEFAULT_BUDGET);
+
+    TrigramIndex(const TrigramIndex&) = delete;
+    TrigramIndex& operator=(const TrigramIndex&) = delete;
+
+    void setBudget(size_t budget_bytes);
+
+    // Distinct trigrams of text, folded and sorted
+    static vector<uint32_t> trigrams(string_view text);
+
+    bool covers(uint64_t user_id) const;
+    void build(uint64_t user_id, const CachedVault& records);
+    void add(uint64_t user_id, const VaultRecord& record);
+    void remove(uint64_t user_id, const VaultRecord& record);
+
+    // Records with every one of the query's trigrams - substring candidates
+    // False if the user has no index (never built, or evicted since)
+    bool intersect(uint64_t user_id, const vector<uint32_t>& query, vector<uint64_t>& result);
+
+    // Records with at least min_shared of them - fuzzy candidates
+    bool overlap(uint64_t user_id, const vector<uint32_t>& query, uint32_t min_shared, vector<Match>& matches);
+
+    TrigramIndexStats stats() const;
+};
+
+#endif
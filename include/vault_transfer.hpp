@@ -0,0 +1,110 @@
+#ifndef VAULT_TRANSFER_HPP
+#define VAULT_TRANSFER_HPP
+
+#include "storage.hpp"
+#include "bounded_queue.hpp"
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <exception>
+#include <mutex>
+#include <cstdint>
+
+using namespace std;
+
+// Bulk formats for import and export
+enum class TransferFormat {
+    Csv,    // header row site,username,password,category,notes (RFC 4180 quoting)
+    Json    // array of {"site","username","password","category","notes"}
+};
+
+struct ImportResult {
+    uint64_t imported;
+    uint64_t skipped;       // rows missing a site, username or password
+    uint64_t breached;      // imported entries whose password is in the breach corpus
+};
+
+// Streaming import, three stages linked by bounded queues:
+//   feed()   - parses whatever bytes arrived, on the caller's thread
+//   workers  - encrypt and fingerprint batches in parallel
+//   writer   - one addPreparedEntries per batch, in arrival order
+// A full queue blocks the stage before it, so a fast upload waits for the
+// disk instead of piling up in memory
+class VaultImporter {
+private:
+    struct Batch {
+        uint64_t seq;
+        vector<VaultEntryInput> inputs;
+        vector<PreparedEntry> prepared;
+    };
+
+    StorageManager& storage;
+    uint64_t user_id;
+    TransferFormat format;
+
+    BoundedQueue<Batch> parsed;
+    BoundedQueue<Batch> encrypted;
+    vector<thread> workers;
+    thread writer;
+
+    Batch pending;
+    uint64_t next_seq;
+    uint64_t skipped;
+    atomic<uint64_t> imported;
+    atomic<uint64_t> breached;
+    atomic<bool> failed;
+    bool finished;
+
+    // First failure from a worker or the writer, rethrown by finish()
+    mutex error_mutex;
+    exception_ptr error;
+
+    // Parser state - carried between feed() calls
+    uint64_t line_no;
+    vector<string> row;
+    string field;
+    bool in_quotes;
+    bool quote_pending;     // saw a quote inside quotes: escaped "" or the end
+    bool field_started;
+    vector<string> header;
+    int json_depth;
+    bool json_in_string;
+    bool json_escape;
+    bool json_opened;
+    bool json_closed;
+    string object;
+
+    void feedCsv(const char* data, size_t size);
+    void endCsvField();
+    void endCsvRow();
+    void feedJson(const char* data, size_t size);
+    void endJsonObject();
+
+    void addEntry(VaultEntryInput input);
+    void flushBatch();
+    void fail(exception_ptr e);
+    void runWorker();
+    void runWriter();
+    void stop();
+
+public:
+    // workers = 0 uses one per hardware thread
+    VaultImporter(StorageManager& storage, uint64_t user_id, TransferFormat format, size_t workers = 0);
+    ~VaultImporter();
+
+    // Throws invalid_argument on malformed input
+    void feed(const char* data, size_t size);
+
+    // Parse the tail, wait for every batch to be written
+    ImportResult finish();
+};
+
+// Streams a user's vault through reader -> parallel decrypt -> serializer.
+// write gets chunks in order and returns false to stop early (client gone),
+// which exportVault passes back
+bool exportVault(StorageManager& storage, uint64_t user_id, TransferFormat format,
+                 const function<bool(const string&)>& write, size_t workers = 0);
+
+#endif
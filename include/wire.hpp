@@ -0,0 +1,48 @@
+#ifndef WIRE_HPP
+#define WIRE_HPP
+
+#include "btree.hpp"
+#include <string>
+#include <cstdint>
+
+using namespace std;
+
+// Formats the API can speak
+enum class WireFormat {
+    Json,
+    MsgPack,
+    Cbor
+};
+
+// Encoders for API responses
+// Writes straight from VaultRecord into the output buffer - no json DOM
+class Wire {
+public:
+    // Pick response format from the Accept header (JSON if nothing matches)
+    static WireFormat negotiate(const string& accept);
+
+    // Format of a request body from its Content-Type
+    static WireFormat fromContentType(const string& content_type);
+
+    static const char* contentType(WireFormat format);
+
+    // Vault entry with the same fields as the JSON API
+    static void appendRecord(WireFormat format, const VaultRecord& record, string& out);
+
+    // Building blocks (binary formats only - JSON is written by hand)
+    static void appendMapHeader(WireFormat format, uint64_t count, string& out);
+    static void appendArrayHeader(WireFormat format, uint64_t count, string& out);
+    static void appendString(WireFormat format, const string& value, string& out);
+    static void appendUInt(WireFormat format, uint64_t value, string& out);
+    static void appendBool(WireFormat format, bool value, string& out);
+    static void appendNull(WireFormat format, string& out);
+
+    // CBOR only: array of unknown length, closed by appendBreak
+    static void appendIndefiniteArray(string& out);
+    static void appendBreak(string& out);
+
+    // Quoted and escaped JSON string
+    static void appendJsonString(const string& value, string& out);
+};
+
+#endif
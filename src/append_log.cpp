@@ -0,0 +1,73 @@
+#include "append_log.hpp"
+#include <fstream>
+#include <filesystem>
+#include <stdexcept>
+#include <cstdio>
+
+using namespace std;
+
+// Entries read per file read on replay
+static const size_t REPLAY_BATCH = 4096;
+
+AppendLog::AppendLog(const string& filename, size_t entry_size, const string& what)
+    : filename(filename), entry_size(entry_size), what(what) {
+}
+
+uint64_t AppendLog::replay(const function<void(const char* entry)>& visit) {
+    ifstream file(filename, ios::binary);
+    if(!file.is_open()) return 0;  // File doesn't exist yet
+
+    uint64_t count = 0;
+    string buffer(entry_size * REPLAY_BATCH, '\0');
+    while(file) {
+        file.read(&buffer[0], buffer.size());
+        size_t whole = static_cast<size_t>(file.gcount()) / entry_size;
+        for(size_t i = 0; i < whole; i++) {
+            visit(buffer.data() + i * entry_size);
+        }
+        count += whole;
+    }
+    file.close();
+
+    // Torn write at the tail - drop it, or the next append would be misaligned
+    uint64_t length = count * entry_size;
+    error_code ec;
+    if(filesystem::file_size(filename, ec) > length && !ec) {
+        filesystem::resize_file(filename, length, ec);
+        if(ec) {
+            throw runtime_error("Failed to truncate " + what + " " + filename + ": " + ec.message());
+        }
+    }
+    return count;
+}
+
+void AppendLog::append(const string& entries) {
+    ofstream file(filename, ios::binary | ios::app);
+    if(!file.is_open()) {
+        throw runtime_error("Failed to open " + what + " for writing");
+    }
+    file.write(entries.data(), entries.size());
+    file.flush();
+    if(!file) {
+        throw runtime_error("Failed to write " + what + " " + filename);
+    }
+}
+
+void AppendLog::rewrite(const string& entries) {
+    string tmp_file = filename + ".tmp";
+    {
+        ofstream file(tmp_file, ios::binary | ios::trunc);
+        if(!file.is_open()) {
+            throw runtime_error("Failed to open " + what + " for writing");
+        }
+        file.write(entries.data(), entries.size());
+        file.flush();
+        if(!file) {
+            throw runtime_error("Failed to write " + what + " " + tmp_file);
+        }
+    }
+    // rename replaces the old file atomically - a crash leaves one or the other
+    if(std::rename(tmp_file.c_str(), filename.c_str()) != 0) {
+        throw runtime_error("Failed to replace " + what + " " + filename);
+    }
+}
@@ -4,6 +4,7 @@
 #include <ctime>
 #include <sstream>
 #include <random>
+#include <algorithm>
 
 using namespace std;
 
@@ -90,6 +91,20 @@ void AuthManager::saveUsers() {
         throw runtime_error("Failed to open users file for writing");
     }
     
+    writeUsers(file);
+    file.close();
+}
+
+// The users file contents, for a backup - consistent with any registration
+string AuthManager::snapshotUsers() {
+    lock_guard<mutex> lock(users_mutex);
+    ostringstream out(ios::binary);
+    writeUsers(out);
+    return out.str();
+}
+
+// Users file format, to any stream
+void AuthManager::writeUsers(ostream& file) {
     vector<User> all_users = users_by_id.getAllValues();
     uint64_t user_count = all_users.size();
     
@@ -128,8 +143,6 @@ void AuthManager::saveUsers() {
         // Write created_at
         file.write(reinterpret_cast<const char*>(&user.created_at), sizeof(user.created_at));
     }
-    
-    file.close();
 }
 
 // Register new user
@@ -149,6 +162,7 @@ uint64_t AuthManager::registerUser(const string& email, const string& password,
     user.created_at = time(nullptr);
     
     // Store in both hash tables
+    lock_guard<mutex> lock(users_mutex);
     users_by_email.put(user.email, user);
     users_by_id.put(user.user_id, user);
     
@@ -158,6 +172,15 @@ uint64_t AuthManager::registerUser(const string& email, const string& password,
     return user.user_id;
 }
 
+// Store a replicated account - safe to repeat
+void AuthManager::putUser(const User& user) {
+    lock_guard<mutex> lock(users_mutex);
+    users_by_email.put(user.email, user);
+    users_by_id.put(user.user_id, user);
+    next_user_id = max(next_user_id, user.user_id + 1);
+    saveUsers();
+}
+
 // Login user
 string AuthManager::login(const string& email, const string& password) {
     User* user = users_by_email.get(email);
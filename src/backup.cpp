@@ -0,0 +1,139 @@
+#include "backup.hpp"
+#include <fstream>
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+#include <filesystem>
+
+using namespace std;
+
+static const uint32_t ARCHIVE_MAGIC = 0x314B4256;   // "VBK1"
+static const string END_SECTION = "end";
+static const size_t COPY_CHUNK = 1024 * 1024;
+static const uint32_t MAX_NAME_BYTES = 256;
+
+static bool writeSectionHeader(const BackupArchive::Writer& write, const string& name, uint64_t length) {
+    string header;
+    uint32_t name_len = static_cast<uint32_t>(name.size());
+    header.append(reinterpret_cast<const char*>(&name_len), sizeof(name_len));
+    header += name;
+    header.append(reinterpret_cast<const char*>(&length), sizeof(length));
+    return write(header.data(), header.size());
+}
+
+bool BackupArchive::writeHeader(const Writer& write) {
+    return write(reinterpret_cast<const char*>(&ARCHIVE_MAGIC), sizeof(ARCHIVE_MAGIC));
+}
+
+bool BackupArchive::writeSection(const Writer& write, const string& name, istream& in,
+                                 uint64_t length, const Patch& patch) {
+    if(!writeSectionHeader(write, name, length)) return false;
+
+    vector<char> buffer(COPY_CHUNK);
+    for(uint64_t offset = 0; offset < length; ) {
+        size_t size = static_cast<size_t>(min<uint64_t>(COPY_CHUNK, length - offset));
+        fill(buffer.begin(), buffer.begin() + size, 0);
+        in.read(buffer.data(), size);
+        in.clear();     // a short read leaves zeros - patch fills in what was there
+        if(patch) patch(offset, buffer.data(), size);
+        if(!write(buffer.data(), size)) return false;
+        offset += size;
+    }
+    return true;
+}
+
+bool BackupArchive::writeSection(const Writer& write, const string& name, const string& data) {
+    return writeSectionHeader(write, name, data.size()) && write(data.data(), data.size());
+}
+
+bool BackupArchive::writeEnd(const Writer& write) {
+    return writeSectionHeader(write, END_SECTION, 0);
+}
+
+uint64_t BackupArchive::restore(const string& archive_path, const unordered_map<string, string>& targets) {
+    ifstream in(archive_path, ios::binary);
+    if(!in.is_open()) {
+        throw runtime_error("Failed to open backup: " + archive_path);
+    }
+
+    uint32_t magic = 0;
+    in.read(reinterpret_cast<char*>(&magic), sizeof(magic));
+    if(!in || magic != ARCHIVE_MAGIC) {
+        throw runtime_error("Not a vault backup: " + archive_path);
+    }
+
+    vector<string> written;     // side files so far
+    auto discard = [&written] {
+        for(const auto& path : written) {
+            error_code ec;
+            filesystem::remove(path, ec);
+        }
+    };
+
+    uint64_t restored = 0;
+    bool complete = false;
+    vector<char> buffer(COPY_CHUNK);
+    try {
+        while(!complete) {
+            uint32_t name_len = 0;
+            uint64_t length = 0;
+            in.read(reinterpret_cast<char*>(&name_len), sizeof(name_len));
+            if(!in || name_len > MAX_NAME_BYTES) {
+                throw runtime_error("Backup is truncated or corrupt");
+            }
+            string name(name_len, '\0');
+            in.read(&name[0], name_len);
+            in.read(reinterpret_cast<char*>(&length), sizeof(length));
+            if(!in) {
+                throw runtime_error("Backup is truncated or corrupt");
+            }
+
+            if(name == END_SECTION) {
+                complete = true;
+                break;
+            }
+            auto target = targets.find(name);
+            if(target == targets.end()) {
+                throw runtime_error("Unknown section in backup: " + name);
+            }
+
+            string side_path = target->second + ".restore";
+            ofstream out(side_path, ios::binary | ios::trunc);
+            if(!out.is_open()) {
+                throw runtime_error("Failed to open " + side_path + " for writing");
+            }
+            written.push_back(side_path);
+
+            for(uint64_t left = length; left > 0; ) {
+                size_t size = static_cast<size_t>(min<uint64_t>(COPY_CHUNK, left));
+                in.read(buffer.data(), size);
+                if(!in) {
+                    throw runtime_error("Backup is truncated in section " + name);
+                }
+                out.write(buffer.data(), size);
+                left -= size;
+            }
+            out.close();
+            if(!out) {
+                throw runtime_error("Failed to write " + side_path);
+            }
+            restored += length;
+        }
+    } catch(...) {
+        discard();
+        throw;
+    }
+
+    // Whole archive is good - swap the files in. Stores missing from the
+    // archive start empty, like a fresh data directory
+    for(const auto& target : targets) {
+        string side_path = target.second + ".restore";
+        if(find(written.begin(), written.end(), side_path) != written.end()) {
+            filesystem::rename(side_path, target.second);
+        } else {
+            error_code ec;
+            filesystem::remove(target.second, ec);
+        }
+    }
+    return restored;
+}
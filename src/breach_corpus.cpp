@@ -0,0 +1,189 @@
+#include "breach_corpus.hpp"
+#include "crypto.hpp"
+#include <fstream>
+#include <vector>
+#include <cstring>
+#include <stdexcept>
+#include <filesystem>
+
+using namespace std;
+
+static const uint32_t CORPUS_MAGIC = 0x31434256;   // "VBC1"
+static const size_t BUCKETS = 1 << 16;              // by the first two hash bytes
+static const uint64_t HEADER_SIZE = 16;             // magic, reserved, count
+static const uint64_t TABLE_SIZE = (BUCKETS + 1) * sizeof(uint64_t);
+static const uint64_t INTERPOLATION_ROUNDS = 4;     // then plain binary search
+
+// Bytes 2..9 of a hash as a number - what interpolation works on
+static uint64_t interpolationKey(const uint8_t* hash) {
+    uint64_t key = 0;
+    for(size_t i = 2; i < 10; i++) {
+        key = (key << 8) | hash[i];
+    }
+    return key;
+}
+
+static int hexValue(char c) {
+    if(c >= '0' && c <= '9') return c - '0';
+    if(c >= 'A' && c <= 'F') return c - 'A' + 10;
+    if(c >= 'a' && c <= 'f') return c - 'a' + 10;
+    return -1;
+}
+
+BreachCorpus::BreachCorpus() : count(0) {
+}
+
+void BreachCorpus::open(const string& path) {
+    if(!filesystem::exists(path)) {
+        throw runtime_error("Breach corpus not found: " + path);
+    }
+    auto mapped = make_unique<MappedFile>(path, MapAccess::Random);
+
+    uint32_t magic = 0;
+    uint64_t hashes = 0;
+    if(mapped->size() < HEADER_SIZE + TABLE_SIZE) {
+        throw runtime_error("Not a breach corpus: " + path);
+    }
+    memcpy(&magic, mapped->data(), sizeof(magic));
+    memcpy(&hashes, mapped->data() + 8, sizeof(hashes));
+    if(magic != CORPUS_MAGIC || mapped->size() != HEADER_SIZE + TABLE_SIZE + hashes * SHA1_BYTES) {
+        throw runtime_error("Not a breach corpus: " + path);
+    }
+
+    file = move(mapped);
+    count = hashes;
+    if(bucketStart(BUCKETS) != count) {
+        file.reset();
+        count = 0;
+        throw runtime_error("Corrupt breach corpus: " + path);
+    }
+}
+
+uint64_t BreachCorpus::bucketStart(size_t bucket) const {
+    uint64_t start;
+    memcpy(&start, file->data() + HEADER_SIZE + bucket * sizeof(uint64_t), sizeof(start));
+    return start;
+}
+
+const uint8_t* BreachCorpus::hashAt(uint64_t i) const {
+    return reinterpret_cast<const uint8_t*>(file->data() + HEADER_SIZE + TABLE_SIZE + i * SHA1_BYTES);
+}
+
+// Bucket from the prefix, then interpolation - SHA-1s are uniform, so a
+// guess from the key's position between the ends lands a few entries off.
+// A few rounds of that, binary search for whatever is left
+bool BreachCorpus::contains(const uint8_t* sha1) const {
+    if(!file) return false;
+
+    size_t bucket = (static_cast<size_t>(sha1[0]) << 8) | sha1[1];
+    uint64_t lo = bucketStart(bucket);
+    uint64_t hi = bucketStart(bucket + 1);
+    uint64_t target = interpolationKey(sha1);
+
+    for(uint64_t round = 0; round < INTERPOLATION_ROUNDS && hi - lo > 16; round++) {
+        uint64_t first = interpolationKey(hashAt(lo));
+        uint64_t last = interpolationKey(hashAt(hi - 1));
+        if(target < first || target > last) return false;
+
+        long double fraction = static_cast<long double>(target - first) /
+                               (static_cast<long double>(last - first) + 1);
+        uint64_t guess = lo + static_cast<uint64_t>(fraction * (hi - 1 - lo));
+        int cmp = memcmp(hashAt(guess), sha1, SHA1_BYTES);
+        if(cmp == 0) return true;
+        if(cmp < 0) {
+            lo = guess + 1;
+        } else {
+            hi = guess;
+        }
+    }
+
+    while(lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        int cmp = memcmp(hashAt(mid), sha1, SHA1_BYTES);
+        if(cmp == 0) return true;
+        if(cmp < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return false;
+}
+
+bool BreachCorpus::containsPassword(const string& password) const {
+    if(!file) return false;
+    vector<uint8_t> sha1 = Crypto::hexToBytes(Crypto::sha1Hex(password));
+    return contains(sha1.data());
+}
+
+// One pass: hashes go straight to the file as they're read, per-prefix
+// counts are kept on the side and the bucket table is filled in at the end.
+// Needs the input in hash order, like the HIBP "ordered by hash" download
+uint64_t BreachCorpus::convert(istream& in, const string& out_path) {
+    string tmp_path = out_path + ".tmp";
+    ofstream out(tmp_path, ios::binary | ios::trunc);
+    if(!out.is_open()) {
+        throw runtime_error("Failed to open " + tmp_path + " for writing");
+    }
+
+    vector<char> placeholder(HEADER_SIZE + TABLE_SIZE, 0);
+    out.write(placeholder.data(), placeholder.size());
+
+    vector<uint64_t> bucket_counts(BUCKETS, 0);
+    uint8_t previous[SHA1_BYTES];
+    uint8_t hash[SHA1_BYTES];
+    uint64_t written = 0;
+    uint64_t line_no = 0;
+    string line;
+    while(getline(in, line)) {
+        line_no++;
+        if(!line.empty() && line.back() == '\r') line.pop_back();
+        if(line.empty()) continue;
+
+        size_t colon = line.find(':');
+        size_t hex_len = colon == string::npos ? line.size() : colon;
+        bool valid = hex_len == SHA1_BYTES * 2;
+        for(size_t i = 0; valid && i < SHA1_BYTES; i++) {
+            int high = hexValue(line[2 * i]);
+            int low = hexValue(line[2 * i + 1]);
+            valid = high >= 0 && low >= 0;
+            hash[i] = static_cast<uint8_t>((high << 4) | low);
+        }
+        if(!valid) {
+            throw runtime_error("Line " + to_string(line_no) + ": expected a SHA-1 in hex");
+        }
+
+        if(written > 0) {
+            int cmp = memcmp(previous, hash, SHA1_BYTES);
+            if(cmp == 0) continue;
+            if(cmp > 0) {
+                throw runtime_error("Line " + to_string(line_no) + ": input isn't sorted by hash");
+            }
+        }
+
+        out.write(reinterpret_cast<const char*>(hash), SHA1_BYTES);
+        bucket_counts[(static_cast<size_t>(hash[0]) << 8) | hash[1]]++;
+        memcpy(previous, hash, SHA1_BYTES);
+        written++;
+    }
+
+    // Header and bucket table over the placeholder
+    vector<uint64_t> starts(BUCKETS + 1, 0);
+    for(size_t b = 0; b < BUCKETS; b++) {
+        starts[b + 1] = starts[b] + bucket_counts[b];
+    }
+    uint32_t magic = CORPUS_MAGIC;
+    uint32_t reserved = 0;
+    out.seekp(0);
+    out.write(reinterpret_cast<const char*>(&magic), sizeof(magic));
+    out.write(reinterpret_cast<const char*>(&reserved), sizeof(reserved));
+    out.write(reinterpret_cast<const char*>(&written), sizeof(written));
+    out.write(reinterpret_cast<const char*>(starts.data()), TABLE_SIZE);
+    out.close();
+    if(!out) {
+        throw runtime_error("Failed to write " + tmp_path);
+    }
+
+    filesystem::rename(tmp_path, out_path);
+    return written;
+}
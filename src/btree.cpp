@@ -3,23 +3,333 @@
 #include <cstring>
 #include <ctime>
 #include <algorithm>
+#include <filesystem>
+#include <unordered_map>
 
 using namespace std;
 
+// Metadata at the front of vault.dat: root_id, next_node_id, next_record_id
+static const uint64_t METADATA_SIZE = 24;
+
+// Node page layout - all integers little-endian, unaligned:
+//   0  uint32  PAGE_MAGIC (the old fixed 40-key layout has no magic),
+//              or FREE_MAGIC for a page on the freelist
+//   4  uint8   is_leaf
+//   6  uint16  num_keys
+//   8  uint16  prefix_len - bytes every key in the node starts with
+//  12          prefix bytes
+//              slot array: num_keys x {uint16 offset, uint16 length} of each key's suffix
+//              record_ids: num_keys x uint64
+//              children:   (num_keys + 1) x uint64, internal nodes only
+//              ... free space ...
+//              key suffixes, packed down from the end of the page
+// "VNP1" trees were never cleaned up on delete and still index dead
+// records, "VNP2" keys aren't case folded and "VNP3" keys aren't per
+// user, so all of them are rebuilt on open like the old layout
+static const uint32_t PAGE_MAGIC = 0x34504e56;  // "VNP4"
+static const uint32_t FREE_MAGIC = 0x45455246;  // "FREE"
+static const size_t MIN_FILL_BYTES = NODE_PAGE_SIZE / 4;   // below this a node borrows or merges
+
+// Record ids start at 1 - a record whose id is 0 was deleted or superseded
+static const uint64_t DEAD_RECORD_ID = 0;
+static const uint64_t NO_RECORD_OFFSET = UINT64_MAX;   // id index: no live copy
+static const size_t PAGE_HEADER_SIZE = 12;
+static const size_t SLOT_SIZE = 4;
+
+static uint64_t nodeOffset(uint64_t node_id) {
+    return METADATA_SIZE + node_id * NODE_PAGE_SIZE;
+}
+
+// Index key for a user's site name - the user id, big endian so keys
+// sort by user first, then the name (see MAX_KEY_BYTES). Each user's
+// entries are one contiguous run, so lookups and prefix scans never
+// walk past other users' records.
+// ASCII case is folded so prefix scans match "git" to "GitHub"; exact
+// lookups still compare the record's real name
+static const size_t USER_KEY_BYTES = sizeof(uint64_t);
+
+static string indexKey(uint64_t user_id, string_view site_name) {
+    string key(USER_KEY_BYTES, '\0');
+    for(size_t i = 0; i < USER_KEY_BYTES; i++) {
+        key[i] = static_cast<char>(user_id >> (8 * (USER_KEY_BYTES - 1 - i)));
+    }
+    key.append(site_name.substr(0, MAX_KEY_BYTES));
+    for(size_t i = USER_KEY_BYTES; i < key.size(); i++) {
+        char& c = key[i];
+        if(c >= 'A' && c <= 'Z') c = static_cast<char>(c - 'A' + 'a');
+    }
+    return key;
+}
+
+static size_t sharedLength(const string& a, const string& b) {
+    size_t len = 0;
+    size_t limit = min(a.size(), b.size());
+    while(len < limit && a[len] == b[len]) len++;
+    return len;
+}
+
+// Keys are sorted, so the prefix shared by all of them is the first and last key's
+static size_t commonPrefix(const BTreeNode& node) {
+    if(node.keys.empty()) return 0;
+    return sharedLength(node.keys.front(), node.keys.back());
+}
+
+// Bytes one key costs in its page, besides its suffix
+static size_t entryOverhead(const BTreeNode& node) {
+    return SLOT_SIZE + sizeof(uint64_t) + (node.is_leaf ? 0 : sizeof(uint64_t));
+}
+
+// Encoded size of a node - must be <= NODE_PAGE_SIZE to be written
+static size_t pageBytes(const BTreeNode& node) {
+    size_t prefix = commonPrefix(node);
+    size_t bytes = PAGE_HEADER_SIZE + prefix + node.keys.size() * entryOverhead(node);
+    if(!node.is_leaf) bytes += sizeof(uint64_t);   // the extra child
+    for(const auto& key : node.keys) {
+        bytes += key.size() - prefix;
+    }
+    return bytes;
+}
+
+template<typename T>
+static void putValue(char* page, size_t& pos, T value) {
+    memcpy(page + pos, &value, sizeof(T));
+    pos += sizeof(T);
+}
+
+template<typename T>
+static T getValue(const char* page, size_t& pos) {
+    T value;
+    memcpy(&value, page + pos, sizeof(T));
+    pos += sizeof(T);
+    return value;
+}
+
+// Serialize a node into a zeroed page buffer
+static void encodePage(const BTreeNode& node, char* page) {
+    if(pageBytes(node) > NODE_PAGE_SIZE) {
+        throw logic_error("B-Tree node " + to_string(node.node_id) + " does not fit in a page");
+    }
+    
+    uint16_t num_keys = static_cast<uint16_t>(node.keys.size());
+    uint16_t prefix = static_cast<uint16_t>(commonPrefix(node));
+    
+    size_t pos = 0;
+    putValue<uint32_t>(page, pos, PAGE_MAGIC);
+    putValue<uint8_t>(page, pos, node.is_leaf ? 1 : 0);
+    pos += 1;
+    putValue<uint16_t>(page, pos, num_keys);
+    putValue<uint16_t>(page, pos, prefix);
+    pos += 2;
+    if(prefix > 0) {
+        memcpy(page + pos, node.keys.front().data(), prefix);
+        pos += prefix;
+    }
+    
+    // Slots up front, suffix bytes from the back
+    size_t data_end = NODE_PAGE_SIZE;
+    for(const auto& key : node.keys) {
+        uint16_t len = static_cast<uint16_t>(key.size() - prefix);
+        data_end -= len;
+        memcpy(page + data_end, key.data() + prefix, len);
+        putValue<uint16_t>(page, pos, static_cast<uint16_t>(data_end));
+        putValue<uint16_t>(page, pos, len);
+    }
+    
+    for(uint64_t record_id : node.record_ids) {
+        putValue<uint64_t>(page, pos, record_id);
+    }
+    if(!node.is_leaf) {
+        for(uint64_t child : node.children) {
+            putValue<uint64_t>(page, pos, child);
+        }
+    }
+}
+
+// Header fields are read once, keys are only looked at on demand
+NodeView::NodeView(const char* page, uint64_t node_id) : page(page), node_id(node_id) {
+    size_t pos = sizeof(uint32_t);
+    leaf = getValue<uint8_t>(page, pos) != 0;
+    pos += 1;
+    num_keys = getValue<uint16_t>(page, pos);
+    prefix_len = getValue<uint16_t>(page, pos);
+    
+    slots_at = PAGE_HEADER_SIZE + prefix_len;
+    record_ids_at = slots_at + num_keys * SLOT_SIZE;
+    children_at = record_ids_at + num_keys * sizeof(uint64_t);
+    size_t end = children_at + (leaf ? 0 : (num_keys + 1) * sizeof(uint64_t));
+    if(end > NODE_PAGE_SIZE) {
+        throw runtime_error("Corrupt B-Tree node " + to_string(node_id));
+    }
+}
+
+string_view NodeView::prefix() const {
+    return string_view(page + PAGE_HEADER_SIZE, prefix_len);
+}
+
+string_view NodeView::suffix(size_t i) const {
+    size_t pos = slots_at + i * SLOT_SIZE;
+    uint16_t offset = getValue<uint16_t>(page, pos);
+    uint16_t len = getValue<uint16_t>(page, pos);
+    if(offset + len > NODE_PAGE_SIZE) {
+        throw runtime_error("Corrupt B-Tree node " + to_string(node_id));
+    }
+    return string_view(page + offset, len);
+}
+
+uint64_t NodeView::recordId(size_t i) const {
+    size_t pos = record_ids_at + i * sizeof(uint64_t);
+    return getValue<uint64_t>(page, pos);
+}
+
+uint64_t NodeView::child(size_t i) const {
+    size_t pos = children_at + i * sizeof(uint64_t);
+    return getValue<uint64_t>(page, pos);
+}
+
+// Prefix first, then the suffix - same order as comparing the whole key
+int NodeView::compare(size_t i, string_view key) const {
+    int c = prefix().compare(key.substr(0, prefix_len));
+    if(c != 0) return c;
+    return suffix(i).compare(key.substr(prefix_len));
+}
+
+size_t NodeView::lowerBound(string_view key) const {
+    size_t lo = 0, hi = num_keys;
+    while(lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if(compare(mid, key) < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+size_t NodeView::upperBound(string_view key) const {
+    size_t lo = 0, hi = num_keys;
+    while(lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if(compare(mid, key) <= 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+void NodeView::materialize(BTreeNode& node) const {
+    node.node_id = node_id;
+    node.is_leaf = leaf;
+    
+    string_view shared = prefix();
+    node.keys.resize(num_keys);
+    node.record_ids.resize(num_keys);
+    for(size_t i = 0; i < num_keys; i++) {
+        string_view rest = suffix(i);
+        string& key = node.keys[i];
+        key.reserve(shared.size() + rest.size());
+        key.assign(shared.data(), shared.size());
+        key.append(rest.data(), rest.size());
+        node.record_ids[i] = recordId(i);
+    }
+    
+    node.children.clear();
+    if(!leaf) {
+        node.children.resize(num_keys + 1);
+        for(size_t i = 0; i <= num_keys; i++) {
+            node.children[i] = child(i);
+        }
+    }
+}
+
+// A key as prefix + suffix pieces, without joining them
+struct KeyParts {
+    string_view head;
+    string_view tail;
+    
+    size_t size() const { return head.size() + tail.size(); }
+    char operator[](size_t i) const { return i < head.size() ? head[i] : tail[i - head.size()]; }
+};
+
+// Encode a leaf page for view plus key inserted at index, straight from the
+// old page - no key is copied into a string. False if it wouldn't fit,
+// in which case nothing useful was written to page
+static bool encodeLeafInsert(const NodeView& view, size_t index, string_view key,
+                             uint64_t record_id, char* page) {
+    size_t count = view.numKeys() + 1;
+    auto keyAt = [&](size_t i) {
+        if(i == index) return KeyParts{key, string_view()};
+        return KeyParts{view.prefix(), view.suffix(i < index ? i : i - 1)};
+    };
+    
+    // New shared prefix can only shrink - everything sits between first and last
+    KeyParts first = keyAt(0);
+    KeyParts last = keyAt(count - 1);
+    size_t prefix = 0;
+    size_t limit = min(first.size(), last.size());
+    while(prefix < limit && first[prefix] == last[prefix]) prefix++;
+    
+    size_t bytes = PAGE_HEADER_SIZE + prefix + count * (SLOT_SIZE + sizeof(uint64_t));
+    for(size_t i = 0; i < count; i++) {
+        bytes += keyAt(i).size() - prefix;
+    }
+    if(bytes > NODE_PAGE_SIZE) return false;
+    
+    size_t pos = 0;
+    putValue<uint32_t>(page, pos, PAGE_MAGIC);
+    putValue<uint8_t>(page, pos, 1);
+    pos += 1;
+    putValue<uint16_t>(page, pos, static_cast<uint16_t>(count));
+    putValue<uint16_t>(page, pos, static_cast<uint16_t>(prefix));
+    pos += 2;
+    copy(key.begin(), key.begin() + prefix, page + pos);    // key starts with the shared prefix too
+    pos += prefix;
+    
+    // Suffix = whatever of the old prefix is no longer shared, then the old suffix
+    size_t data_end = NODE_PAGE_SIZE;
+    for(size_t i = 0; i < count; i++) {
+        KeyParts parts = keyAt(i);
+        size_t len = parts.size() - prefix;
+        data_end -= len;
+        char* out = page + data_end;
+        if(prefix < parts.head.size()) {
+            out = copy(parts.head.begin() + prefix, parts.head.end(), out);
+            copy(parts.tail.begin(), parts.tail.end(), out);
+        } else {
+            copy(parts.tail.begin() + (prefix - parts.head.size()), parts.tail.end(), out);
+        }
+        putValue<uint16_t>(page, pos, static_cast<uint16_t>(data_end));
+        putValue<uint16_t>(page, pos, static_cast<uint16_t>(len));
+    }
+    
+    for(size_t i = 0; i < count; i++) {
+        uint64_t id = i == index ? record_id : view.recordId(i < index ? i : i - 1);
+        putValue<uint64_t>(page, pos, id);
+    }
+    return true;
+}
+
 // Constructor - initialize or load from file
-BTree::BTree(const string& filename) : filename(filename), root_id(0), next_node_id(1), next_record_id(1) {
+BTree::BTree(const string& filename)
+    : filename(filename), root_id(0), next_node_id(1), next_record_id(1), dead_record_bytes(0),
+      node_map(filename, MapAccess::Random), record_map(filename + ".records", MapAccess::Sequential) {
+    loadRecordIndex();
+    
     ifstream file(filename, ios::binary);
     if(file.is_open()) {
         file.read(reinterpret_cast<char*>(&root_id), sizeof(root_id));
         file.read(reinterpret_cast<char*>(&next_node_id), sizeof(next_node_id));
         file.read(reinterpret_cast<char*>(&next_record_id), sizeof(next_record_id));
         file.close();
+        
+        // Vault from before slotted pages, or a crash between a record
+        // write and its index change - the records file has everything needed
+        if(!hasPagedRoot() || !indexMatchesRecords()) {
+            rebuildIndex(DEFAULT_FILL_FACTOR);
+        } else {
+            loadFreeList();
+        }
     } else {
         // Create new tree with root node
         BTreeNode root;
         root.node_id = 0;
         root.is_leaf = true;
-        root.num_keys = 0;
         writeNode(root);
         saveMetadata();
     }
@@ -27,6 +337,7 @@ BTree::BTree(const string& filename) : filename(filename), root_id(0), next_node
 
 // Save tree metadata
 void BTree::saveMetadata() {
+    preserve(false, 0, METADATA_SIZE);
     ofstream file(filename, ios::binary | ios::in | ios::out);
     if(!file.is_open()) {
         file.open(filename, ios::binary | ios::trunc);
@@ -38,81 +349,285 @@ void BTree::saveMetadata() {
     file.close();
 }
 
-// Read node from disk
-BTreeNode BTree::readNode(uint64_t node_id) {
-    ifstream file(filename, ios::binary);
-    if(!file.is_open()) {
-        throw runtime_error("Failed to open B-Tree file for reading");
+// Is the root node stored in the current page format
+bool BTree::hasPagedRoot() {
+    uint64_t offset = nodeOffset(root_id);
+    if(!node_map.contains(offset, NODE_PAGE_SIZE)) return false;
+    
+    uint32_t magic;
+    memcpy(&magic, node_map.data() + offset, sizeof(magic));
+    return magic == PAGE_MAGIC;
+}
+
+// Every live record indexed exactly once, under its current name, and
+// nothing else. Record writes and index changes go to different files,
+// so a crash between the two leaves them disagreeing
+bool BTree::indexMatchesRecords() const {
+    vector<bool> seen(record_offsets.size(), false);
+    uint64_t keys = 0;
+    bool matched = walkFrom(root_id, "", [&](string_view key, uint64_t record_id) {
+        VaultRecordView view;
+        if(record_id >= seen.size() || seen[record_id] || !getView(record_id, view) ||
+           key != indexKey(view.user_id, view.site_name)) {
+            return false;
+        }
+        seen[record_id] = true;
+        keys++;
+        return true;
+    });
+    uint64_t live = count_if(record_offsets.begin(), record_offsets.end(),
+                             [](uint64_t offset) { return offset != NO_RECORD_OFFSET; });
+    return matched && keys == live;
+}
+
+// Free pages are stamped on disk, so the freelist is just a scan of page headers
+void BTree::loadFreeList() {
+    free_nodes.clear();
+    for(uint64_t node_id = 0; node_id < next_node_id; node_id++) {
+        uint64_t offset = nodeOffset(node_id);
+        if(!node_map.contains(offset, sizeof(uint32_t))) break;
+        
+        uint32_t magic;
+        memcpy(&magic, node_map.data() + offset, sizeof(magic));
+        if(magic == FREE_MAGIC) {
+            free_nodes.insert(node_id);
+        }
     }
+}
+
+// Lowest free page first, so the file tail empties out and can be cut off
+uint64_t BTree::allocateNode() {
+    if(free_nodes.empty()) {
+        return next_node_id++;
+    }
+    uint64_t node_id = *free_nodes.begin();
+    free_nodes.erase(free_nodes.begin());
+    return node_id;
+}
+
+// Stamp a page free, then give back any free pages at the end of the file
+void BTree::freeNode(uint64_t node_id) {
+    char page[NODE_PAGE_SIZE] = {};
+    memcpy(page, &FREE_MAGIC, sizeof(FREE_MAGIC));
+    writePage(node_id, page);
+    free_nodes.insert(node_id);
     
-    // Skip metadata (3 * 8 bytes) and seek to node position
-    uint64_t node_offset = 24 + (node_id * 4096);
-    file.seekg(node_offset);
+    bool shrunk = false;
+    while(!free_nodes.empty() && *free_nodes.rbegin() == next_node_id - 1) {
+        free_nodes.erase(prev(free_nodes.end()));
+        next_node_id--;
+        shrunk = true;
+    }
+    if(shrunk) {
+        for(uint64_t offset = nodeOffset(next_node_id); offset < node_map.size(); offset += NODE_PAGE_SIZE) {
+            preserve(false, offset, NODE_PAGE_SIZE);
+        }
+        filesystem::resize_file(filename, nodeOffset(next_node_id));
+        node_map.refresh();
+    }
+}
+
+// Recreate the node file from the records file with the bulk loader
+// Also migrates vaults written with an older node layout
+void BTree::rebuildIndex(double fill_factor) {
+    vector<IndexEntry> entries;
+    uint64_t max_id = 0;
+    scanRecordViews([&entries, &max_id](const VaultRecordView& view) {
+        entries.push_back({indexKey(view.user_id, view.site_name), view.record_id});
+        max_id = max(max_id, view.record_id);
+        return true;
+    });
+    
+    next_record_id = max(next_record_id, max_id + 1);
+    bulkLoad(entries, fill_factor);
+}
+
+// Pack one level of the tree, left to right
+// Each node takes entries until it would pass the fill target; the entry
+// that didn't fit goes up to the next level as a separator. For internal
+// levels, node covering entries [a, b) gets children [a, b]
+static void packLevel(vector<IndexEntry>& entries, const vector<uint64_t>& children, bool leaf,
+                      size_t target_bytes, vector<BTreeNode>& nodes, vector<IndexEntry>& separators) {
+    size_t overhead = SLOT_SIZE + sizeof(uint64_t) + (leaf ? 0 : sizeof(uint64_t));
+    size_t fixed = PAGE_HEADER_SIZE + (leaf ? 0 : sizeof(uint64_t));
     
     BTreeNode node;
-    node.node_id = node_id;
+    node.is_leaf = leaf;
+    size_t key_bytes = 0;
     
-    file.read(reinterpret_cast<char*>(&node.is_leaf), sizeof(node.is_leaf));
-    file.read(reinterpret_cast<char*>(&node.num_keys), sizeof(node.num_keys));
+    auto startNode = [&](size_t child) {
+        node = BTreeNode();
+        node.is_leaf = leaf;
+        key_bytes = 0;
+        if(!leaf) node.children.push_back(children[child]);
+    };
+    startNode(0);
     
-    // Read keys
-    for(int i = 0; i < 40; i++) {
-        size_t key_len;
-        file.read(reinterpret_cast<char*>(&key_len), sizeof(key_len));
-        if(key_len > 0) {
-            node.keys[i].resize(key_len);
-            file.read(&node.keys[i][0], key_len);
+    for(size_t i = 0; i < entries.size(); i++) {
+        IndexEntry& entry = entries[i];
+        if(!node.keys.empty()) {
+            size_t n = node.keys.size() + 1;
+            size_t prefix = sharedLength(node.keys.front(), entry.key);
+            size_t bytes = fixed + prefix + n * overhead + key_bytes + entry.key.size() - n * prefix;
+            if(bytes > target_bytes) {
+                // Full - this entry separates it from the next node
+                nodes.push_back(move(node));
+                separators.push_back(move(entry));
+                startNode(i + 1);
+                continue;
+            }
         }
+        key_bytes += entry.key.size();
+        node.keys.push_back(move(entry.key));
+        node.record_ids.push_back(entry.record_id);
+        if(!leaf) node.children.push_back(children[i + 1]);
+    }
+    nodes.push_back(move(node));
+}
+
+// Replace the node file with one built bottom-up from entries
+void BTree::bulkLoad(vector<IndexEntry>& entries, double fill_factor) {
+    preserveNodeFile();
+    writeIndexFile(filename, entries, fill_factor, root_id, next_node_id);
+    free_nodes.clear();
+    node_map.refresh();
+}
+
+// Write a complete node file bottom-up from (key, record_id) entries
+// Sorts, packs leaves to fill_factor of a page, then each internal level
+// from the separators of the one below, and writes every page in order
+// with one stream - no splits, no random node I/O
+void BTree::writeIndexFile(const string& path, vector<IndexEntry>& entries, double fill_factor,
+                           uint64_t& new_root_id, uint64_t& node_count) {
+    fill_factor = min(1.0, max(0.5, fill_factor));
+    size_t target_bytes = static_cast<size_t>(NODE_PAGE_SIZE * fill_factor);
+    
+    // Equal keys keep insertion (record id) order
+    sort(entries.begin(), entries.end(), [](const IndexEntry& a, const IndexEntry& b) {
+        return a.key != b.key ? a.key < b.key : a.record_id < b.record_id;
+    });
+    
+    ofstream file(path, ios::binary | ios::trunc);
+    if(!file.is_open()) {
+        throw runtime_error("Failed to open B-Tree file for writing");
     }
+    file.seekp(nodeOffset(0));
     
-    // Read children and record_ids
-    file.read(reinterpret_cast<char*>(node.children), sizeof(node.children));
-    file.read(reinterpret_cast<char*>(node.record_ids), sizeof(node.record_ids));
+    node_count = 0;
+    vector<uint64_t> children;
+    bool leaf = true;
+    while(true) {
+        vector<BTreeNode> nodes;
+        vector<IndexEntry> separators;
+        packLevel(entries, children, leaf, target_bytes, nodes, separators);
+        
+        // The last node gets whatever was left over - merge it into its
+        // neighbour or even the two out if it's underfull
+        if(nodes.size() > 1 && pageBytes(nodes.back()) < MIN_FILL_BYTES) {
+            BTreeNode last = move(nodes.back());
+            nodes.pop_back();
+            BTreeNode& prev = nodes.back();
+            prev.keys.push_back(move(separators.back().key));
+            prev.record_ids.push_back(separators.back().record_id);
+            separators.pop_back();
+            prev.keys.insert(prev.keys.end(), make_move_iterator(last.keys.begin()), make_move_iterator(last.keys.end()));
+            prev.record_ids.insert(prev.record_ids.end(), last.record_ids.begin(), last.record_ids.end());
+            prev.children.insert(prev.children.end(), last.children.begin(), last.children.end());
+            
+            if(pageBytes(prev) > NODE_PAGE_SIZE) {
+                BTreeNode right;
+                Split split;
+                divideNode(prev, right, split);
+                separators.push_back({move(split.key), split.record_id});
+                nodes.push_back(move(right));
+            }
+        }
+        
+        children.clear();
+        for(auto& node : nodes) {
+            node.node_id = node_count++;
+            children.push_back(node.node_id);
+            
+            char page[NODE_PAGE_SIZE] = {};
+            encodePage(node, page);
+            file.write(page, NODE_PAGE_SIZE);
+        }
+        
+        if(nodes.size() == 1) break;
+        entries = move(separators);
+        leaf = false;
+    }
     
+    // Root is the last page written
+    new_root_id = node_count - 1;
+    file.seekp(0);
+    file.write(reinterpret_cast<const char*>(&new_root_id), sizeof(new_root_id));
+    file.write(reinterpret_cast<const char*>(&node_count), sizeof(node_count));
+    file.write(reinterpret_cast<const char*>(&next_record_id), sizeof(next_record_id));
     file.close();
+}
+
+// Give new records their ids and timestamps, append them in one write and
+// add them to the in-memory indexes - the node file is left to the caller
+void BTree::appendNewRecords(vector<VaultRecord>& records) {
+    uint64_t now = time(nullptr);
+    for(auto& record : records) {
+        record.record_id = next_record_id++;
+        record.created_at = now;
+        record.modified_at = now;
+    }
+    writeRecords(records);
+    for(const auto& record : records) {
+        addUserRecord(record.user_id, record.record_id);
+        addCategoryRecord(record.user_id, record.category, record.record_id);
+        modified_index.insert({record.user_id, record.modified_at, record.record_id});
+    }
+}
+
+// View a node page in place
+NodeView BTree::viewNode(uint64_t node_id) const {
+    uint64_t offset = nodeOffset(node_id);
+    if(!node_map.contains(offset, NODE_PAGE_SIZE)) {
+        throw runtime_error("B-Tree node " + to_string(node_id) + " is past the end of the file");
+    }
+    return NodeView(node_map.data() + offset, node_id);
+}
+
+// Read node from the mapped file into an owning copy
+BTreeNode BTree::readNode(uint64_t node_id) {
+    BTreeNode node;
+    viewNode(node_id).materialize(node);
     return node;
 }
 
-// Write node to disk
+// Write node to disk - always one whole page
 void BTree::writeNode(const BTreeNode& node) {
+    char page[NODE_PAGE_SIZE] = {};
+    encodePage(node, page);
+    writePage(node.node_id, page);
+}
+
+// Write an encoded page in its slot
+void BTree::writePage(uint64_t node_id, const char* page) {
+    preserve(false, nodeOffset(node_id), NODE_PAGE_SIZE);
     fstream file(filename, ios::binary | ios::in | ios::out);
     if(!file.is_open()) {
-        file.open(filename, ios::binary | ios::trunc);
+        file.open(filename, ios::binary | ios::out | ios::trunc);
     }
     
-    // Seek to node position
-    uint64_t node_offset = 24 + (node.node_id * 4096);
-    file.seekp(node_offset);
-    
-    file.write(reinterpret_cast<const char*>(&node.is_leaf), sizeof(node.is_leaf));
-    file.write(reinterpret_cast<const char*>(&node.num_keys), sizeof(node.num_keys));
+    uint64_t offset = nodeOffset(node_id);
+    file.seekp(offset);
+    file.write(page, NODE_PAGE_SIZE);
+    file.close();
     
-    // Write keys
-    for(int i = 0; i < 40; i++) {
-        size_t key_len = node.keys[i].length();
-        file.write(reinterpret_cast<const char*>(&key_len), sizeof(key_len));
-        if(key_len > 0) {
-            file.write(node.keys[i].c_str(), key_len);
-        }
+    // In-place rewrites show up through the mapping, growth needs a refresh
+    if(offset + NODE_PAGE_SIZE > node_map.size()) {
+        node_map.refresh();
     }
-    
-    // Write children and record_ids
-    file.write(reinterpret_cast<const char*>(node.children), sizeof(node.children));
-    file.write(reinterpret_cast<const char*>(node.record_ids), sizeof(node.record_ids));
-    
-    file.close();
 }
 
-// Write record to disk
-void BTree::writeRecord(const VaultRecord& record) {
-    string records_file = filename + ".records";
-    
-    // Open in append mode or create new file
-    ofstream file(records_file, ios::binary | ios::app);
-    if(!file.is_open()) {
-        throw runtime_error("Failed to open records file for writing");
-    }
-    
+// Serialize one record at the stream position
+static void putRecord(ostream& file, const VaultRecord& record) {
     file.write(reinterpret_cast<const char*>(&record.record_id), sizeof(record.record_id));
     file.write(reinterpret_cast<const char*>(&record.user_id), sizeof(record.user_id));
     
@@ -144,190 +659,787 @@ void BTree::writeRecord(const VaultRecord& record) {
     
     file.write(reinterpret_cast<const char*>(&record.created_at), sizeof(record.created_at));
     file.write(reinterpret_cast<const char*>(&record.modified_at), sizeof(record.modified_at));
+}
+
+// Write record to disk
+// Bytes putRecord writes for a record
+static uint64_t recordSize(const VaultRecord& record) {
+    return sizeof(record.record_id) + sizeof(record.user_id)
+        + 6 * sizeof(size_t)
+        + record.site_name.length() + record.username.length()
+        + record.encrypted_password.length() + record.iv.length()
+        + record.notes.length() + record.category.length()
+        + sizeof(record.created_at) + sizeof(record.modified_at);
+}
+
+void BTree::writeRecord(const VaultRecord& record) {
+    string records_file = filename + ".records";
+    
+    // Open in append mode or create new file
+    ofstream file(records_file, ios::binary | ios::app);
+    if(!file.is_open()) {
+        throw runtime_error("Failed to open records file for writing");
+    }
+    
+    putRecord(file, record);
     
     file.flush();
     file.close();
+    setRecordOffset(record.record_id, record_map.size());
+    record_map.refresh();
 }
 
-// Read all records from disk
-vector<VaultRecord> BTree::readAllRecords() {
-    vector<VaultRecord> records;
+// Append a batch of records with one open and one flush
+void BTree::writeRecords(const vector<VaultRecord>& records) {
     string records_file = filename + ".records";
-    ifstream file(records_file, ios::binary);
-    if(!file.is_open()) return records;
     
-    while(file.peek() != EOF) {
-        VaultRecord record;
-        
-        file.read(reinterpret_cast<char*>(&record.record_id), sizeof(record.record_id));
-        file.read(reinterpret_cast<char*>(&record.user_id), sizeof(record.user_id));
-        
-        size_t len;
-        file.read(reinterpret_cast<char*>(&len), sizeof(len));
-        record.site_name.resize(len);
-        file.read(&record.site_name[0], len);
-        
-        file.read(reinterpret_cast<char*>(&len), sizeof(len));
-        record.username.resize(len);
-        file.read(&record.username[0], len);
-        
-        file.read(reinterpret_cast<char*>(&len), sizeof(len));
-        record.encrypted_password.resize(len);
-        file.read(&record.encrypted_password[0], len);
-        
-        file.read(reinterpret_cast<char*>(&len), sizeof(len));
-        record.iv.resize(len);
-        file.read(&record.iv[0], len);
-        
-        file.read(reinterpret_cast<char*>(&len), sizeof(len));
-        record.notes.resize(len);
-        file.read(&record.notes[0], len);
-        
-        file.read(reinterpret_cast<char*>(&len), sizeof(len));
-        record.category.resize(len);
-        file.read(&record.category[0], len);
-        
-        file.read(reinterpret_cast<char*>(&record.created_at), sizeof(record.created_at));
-        file.read(reinterpret_cast<char*>(&record.modified_at), sizeof(record.modified_at));
-        
-        records.push_back(record);
+    ofstream file(records_file, ios::binary | ios::app);
+    if(!file.is_open()) {
+        throw runtime_error("Failed to open records file for writing");
+    }
+    
+    uint64_t offset = record_map.size();
+    for(const auto& record : records) {
+        putRecord(file, record);
+        setRecordOffset(record.record_id, offset);
+        offset += recordSize(record);
+    }
+    
+    file.flush();
+    file.close();
+    record_map.refresh();
+}
+
+// Helper: fixed-width field at an unaligned offset
+template<typename T>
+static bool takeValue(const MappedFile& map, uint64_t& pos, T& value) {
+    if(!map.contains(pos, sizeof(T))) return false;
+    memcpy(&value, map.data() + pos, sizeof(T));
+    pos += sizeof(T);
+    return true;
+}
+
+// Helper: length-prefixed string as a view into the mapping
+static bool takeString(const MappedFile& map, uint64_t& pos, string_view& value) {
+    size_t len;
+    if(!takeValue(map, pos, len) || !map.contains(pos, len)) return false;
+    value = string_view(map.data() + pos, len);
+    pos += len;
+    return true;
+}
+
+// Decode the record at offset and advance past it, false at end of file
+// (or on a partially written record at the tail)
+bool BTree::parseRecord(uint64_t& offset, VaultRecordView& view) const {
+    uint64_t pos = offset;
+    bool ok = takeValue(record_map, pos, view.record_id)
+        && takeValue(record_map, pos, view.user_id)
+        && takeString(record_map, pos, view.site_name)
+        && takeString(record_map, pos, view.username)
+        && takeString(record_map, pos, view.encrypted_password)
+        && takeString(record_map, pos, view.iv)
+        && takeString(record_map, pos, view.notes)
+        && takeString(record_map, pos, view.category)
+        && takeValue(record_map, pos, view.created_at)
+        && takeValue(record_map, pos, view.modified_at);
+    if(ok) offset = pos;
+    return ok;
+}
+
+void VaultRecordView::copyTo(VaultRecord& record) const {
+    record.record_id = record_id;
+    record.user_id = user_id;
+    record.site_name.assign(site_name.data(), site_name.size());
+    record.username.assign(username.data(), username.size());
+    record.encrypted_password.assign(encrypted_password.data(), encrypted_password.size());
+    record.iv.assign(iv.data(), iv.size());
+    record.notes.assign(notes.data(), notes.size());
+    record.category.assign(category.data(), category.size());
+    record.created_at = created_at;
+    record.modified_at = modified_at;
+}
+
+VaultRecord VaultRecordView::toRecord() const {
+    VaultRecord record;
+    copyTo(record);
+    return record;
+}
+
+// Walk the mapped records file in place - no reads, no allocations
+void BTree::scanRecordViews(const function<bool(const VaultRecordView&)>& visit) {
+    uint64_t offset = 0;
+    VaultRecordView view;
+    while(parseRecord(offset, view)) {
+        if(view.record_id == DEAD_RECORD_ID) continue;
+        if(!visit(view)) break;
     }
+}
+
+// Live copy of a record: where it starts, how long it is, and its fields
+bool BTree::findRecord(uint64_t record_id, uint64_t& offset, uint64_t& length, VaultRecordView& view) const {
+    uint64_t start = recordOffset(record_id);
+    if(start == NO_RECORD_OFFSET) return false;
     
+    uint64_t end = start;
+    if(!parseRecord(end, view) || view.record_id != record_id) return false;
+    offset = start;
+    length = end - start;
+    return true;
+}
+
+// Point lookup through the id index - one parse, no scan
+bool BTree::getView(uint64_t record_id, VaultRecordView& view) const {
+    uint64_t offset, length;
+    return findRecord(record_id, offset, length, view);
+}
+
+bool BTree::get(uint64_t record_id, VaultRecord& record) const {
+    VaultRecordView view;
+    if(!getView(record_id, view)) return false;
+    view.copyTo(record);
+    return true;
+}
+
+// Retire a record version in place by zeroing its id
+// The mapping sees the write straight away, so scans skip it from now on
+void BTree::killRecord(uint64_t offset, uint64_t length) {
+    fstream file(filename + ".records", ios::binary | ios::in | ios::out);
+    if(!file.is_open()) {
+        throw runtime_error("Failed to open records file for writing");
+    }
+    
+    uint64_t dead = DEAD_RECORD_ID;
+    preserve(true, offset, sizeof(dead));
+    file.seekp(offset);
+    file.write(reinterpret_cast<const char*>(&dead), sizeof(dead));
     file.close();
-    return records;
+    record_map.refresh();
+    dead_record_bytes += length;
 }
 
-// Split a full child node
-void BTree::splitChild(BTreeNode& parent, int index) {
-    BTreeNode full_child = readNode(parent.children[index]);
-    BTreeNode new_child;
-    new_child.node_id = next_node_id++;
-    new_child.is_leaf = full_child.is_leaf;
-    new_child.num_keys = 19;  // Half of 40 (minus 1 for middle)
+// Index every live record by id and count dead bytes. Also settles
+// duplicates left by a crash between an update's append and its kill -
+// the later copy wins
+void BTree::loadRecordIndex() {
+    dead_record_bytes = 0;
+    record_offsets.clear();
+    user_record_ids.clear();
+    user_categories.clear();
+    modified_index.clear();
+    vector<uint64_t> stale;
     
-    // Copy second half to new child
-    for(int i = 0; i < 19; i++) {
-        new_child.keys[i] = full_child.keys[i + 20];
-        new_child.record_ids[i] = full_child.record_ids[i + 20];
+    uint64_t pos = 0;
+    VaultRecordView view;
+    while(true) {
+        uint64_t start = pos;
+        if(!parseRecord(pos, view)) break;
+        if(view.record_id == DEAD_RECORD_ID) {
+            dead_record_bytes += pos - start;
+            continue;
+        }
+        uint64_t previous = recordOffset(view.record_id);
+        if(previous != NO_RECORD_OFFSET) {
+            // The older copy may have had another category
+            VaultRecordView older;
+            uint64_t end = previous;
+            parseRecord(end, older);
+            dropCategoryRecord(older.user_id, older.category, older.record_id);
+            modified_index.erase({older.user_id, older.modified_at, older.record_id});
+            stale.push_back(previous);
+        } else {
+            user_record_ids[view.user_id].push_back(view.record_id);
+        }
+        addCategoryRecord(view.user_id, view.category, view.record_id);
+        modified_index.insert({view.user_id, view.modified_at, view.record_id});
+        setRecordOffset(view.record_id, start);
     }
     
-    if(!full_child.is_leaf) {
-        for(int i = 0; i < 20; i++) {
-            new_child.children[i] = full_child.children[i + 20];
+    // Updated records come back later in the file than their id says
+    for(auto& entry : user_record_ids) {
+        sort(entry.second.begin(), entry.second.end());
+    }
+    for(auto& entry : user_categories) {
+        for(auto& ids : entry.second.record_ids) {
+            sort(ids.begin(), ids.end());
         }
     }
     
-    full_child.num_keys = 20;
+    for(uint64_t offset : stale) {
+        uint64_t end = offset;
+        parseRecord(end, view);
+        killRecord(offset, end - offset);
+    }
+}
+
+uint64_t BTree::recordOffset(uint64_t record_id) const {
+    return record_id < record_offsets.size() ? record_offsets[record_id] : NO_RECORD_OFFSET;
+}
+
+void BTree::setRecordOffset(uint64_t record_id, uint64_t offset) {
+    if(record_id >= record_offsets.size()) {
+        record_offsets.resize(max<uint64_t>(record_id + 1, record_offsets.size() * 2), NO_RECORD_OFFSET);
+    }
+    record_offsets[record_id] = offset;
+}
+
+// Ids only grow, so a new record normally just goes on the end
+void BTree::addUserRecord(uint64_t user_id, uint64_t record_id) {
+    vector<uint64_t>& ids = user_record_ids[user_id];
+    if(ids.empty() || ids.back() < record_id) {
+        ids.push_back(record_id);
+    } else {
+        ids.insert(lower_bound(ids.begin(), ids.end(), record_id), record_id);
+    }
+}
+
+void BTree::dropUserRecord(uint64_t user_id, uint64_t record_id) {
+    auto it = user_record_ids.find(user_id);
+    if(it == user_record_ids.end()) return;
+    vector<uint64_t>& ids = it->second;
+    auto pos = lower_bound(ids.begin(), ids.end(), record_id);
+    if(pos != ids.end() && *pos == record_id) ids.erase(pos);
+    if(ids.empty()) user_record_ids.erase(it);
+}
+
+vector<uint64_t> BTree::userRecordIds(uint64_t user_id, uint64_t after_id, size_t limit) const {
+    vector<uint64_t> result;
+    auto it = user_record_ids.find(user_id);
+    if(it == user_record_ids.end()) return result;
+    
+    const vector<uint64_t>& ids = it->second;
+    auto from = upper_bound(ids.begin(), ids.end(), after_id);
+    size_t count = min<size_t>(limit, ids.end() - from);
+    result.assign(from, from + count);
+    return result;
+}
+
+// Uncategorized records aren't tracked
+void BTree::addCategoryRecord(uint64_t user_id, string_view category, uint64_t record_id) {
+    if(category.empty()) return;
     
-    // Move parent's keys and children to make space
-    for(int i = parent.num_keys; i > index; i--) {
-        parent.children[i + 1] = parent.children[i];
+    CategoryDictionary& dict = user_categories[user_id];
+    string name(category);
+    auto found = dict.ids.find(name);
+    uint32_t category_id;
+    if(found == dict.ids.end()) {
+        category_id = static_cast<uint32_t>(dict.names.size());
+        dict.ids.emplace(name, category_id);
+        dict.names.push_back(move(name));
+        dict.record_ids.emplace_back();
+    } else {
+        category_id = found->second;
     }
-    parent.children[index + 1] = new_child.node_id;
     
-    for(int i = parent.num_keys - 1; i >= index; i--) {
-        parent.keys[i + 1] = parent.keys[i];
-        parent.record_ids[i + 1] = parent.record_ids[i];
+    vector<uint64_t>& ids = dict.record_ids[category_id];
+    if(ids.empty() || ids.back() < record_id) {
+        ids.push_back(record_id);
+    } else {
+        auto pos = lower_bound(ids.begin(), ids.end(), record_id);
+        if(pos == ids.end() || *pos != record_id) ids.insert(pos, record_id);
     }
+}
+
+void BTree::dropCategoryRecord(uint64_t user_id, string_view category, uint64_t record_id) {
+    if(category.empty()) return;
     
-    parent.keys[index] = full_child.keys[19];
-    parent.record_ids[index] = full_child.record_ids[19];
-    parent.num_keys++;
+    auto dict = user_categories.find(user_id);
+    if(dict == user_categories.end()) return;
+    auto found = dict->second.ids.find(string(category));
+    if(found == dict->second.ids.end()) return;
     
-    writeNode(full_child);
-    writeNode(new_child);
-    writeNode(parent);
-    saveMetadata();
+    vector<uint64_t>& ids = dict->second.record_ids[found->second];
+    auto pos = lower_bound(ids.begin(), ids.end(), record_id);
+    if(pos != ids.end() && *pos == record_id) ids.erase(pos);
 }
 
-// Insert into non-full node
-void BTree::insertNonFull(BTreeNode& node, const VaultRecord& record) {
-    int i = node.num_keys - 1;
+vector<uint64_t> BTree::categoryRecordIds(uint64_t user_id, const string& category,
+                                          uint64_t after_id, size_t limit) const {
+    vector<uint64_t> result;
+    auto dict = user_categories.find(user_id);
+    if(dict == user_categories.end()) return result;
+    auto found = dict->second.ids.find(category);
+    if(found == dict->second.ids.end()) return result;
     
-    if(node.is_leaf) {
-        // Insert in sorted order
-        while(i >= 0 && record.site_name < node.keys[i]) {
-            node.keys[i + 1] = node.keys[i];
-            node.record_ids[i + 1] = node.record_ids[i];
-            i--;
+    const vector<uint64_t>& ids = dict->second.record_ids[found->second];
+    auto from = upper_bound(ids.begin(), ids.end(), after_id);
+    size_t count = min<size_t>(limit, ids.end() - from);
+    result.assign(from, from + count);
+    return result;
+}
+
+// Walks the (user_id, modified_at) index backwards from the cursor
+vector<ModifiedKey> BTree::recentRecords(uint64_t user_id, uint64_t before_time, uint64_t before_id,
+                                         size_t limit) const {
+    vector<ModifiedKey> result;
+    ModifiedKey from = before_id == 0 ? ModifiedKey{user_id, UINT64_MAX, UINT64_MAX}
+                                      : ModifiedKey{user_id, before_time, before_id};
+    auto it = modified_index.lower_bound(from);
+    while(result.size() < limit && it != modified_index.begin()) {
+        --it;
+        if(it->user_id != user_id) break;
+        result.push_back(*it);
+    }
+    return result;
+}
+
+vector<CategoryCount> BTree::userCategories(uint64_t user_id) const {
+    vector<CategoryCount> result;
+    auto dict = user_categories.find(user_id);
+    if(dict == user_categories.end()) return result;
+    
+    for(size_t i = 0; i < dict->second.names.size(); i++) {
+        if(!dict->second.record_ids[i].empty()) {
+            result.push_back({dict->second.names[i], dict->second.record_ids[i].size()});
         }
-        node.keys[i + 1] = record.site_name;
-        node.record_ids[i + 1] = record.record_id;
-        node.num_keys++;
-        writeNode(node);
-    } else {
-        // Find child to insert into
-        while(i >= 0 && record.site_name < node.keys[i]) {
-            i--;
+    }
+    sort(result.begin(), result.end(), [](const CategoryCount& a, const CategoryCount& b) {
+        return a.name < b.name;
+    });
+    return result;
+}
+
+// Move the upper half of node into right, the middle key into split
+// The split point is picked by encoded page size, not key count, so both
+// halves fit whatever the key sizes - each half gets its own shared prefix,
+// which can differ a lot from the combined node's (e.g. when rebalancing
+// two siblings with very different keys)
+void BTree::divideNode(BTreeNode& node, BTreeNode& right, Split& split) {
+    size_t count = node.keys.size();
+    if(count < 3) {
+        throw logic_error("B-Tree node " + to_string(node.node_id) + " too small to split");
+    }
+    
+    size_t overhead = entryOverhead(node);
+    size_t fixed = PAGE_HEADER_SIZE + (node.is_leaf ? 0 : sizeof(uint64_t));
+    vector<size_t> key_bytes(count + 1, 0);    // running total of key lengths
+    for(size_t i = 0; i < count; i++) {
+        key_bytes[i + 1] = key_bytes[i] + node.keys[i].size();
+    }
+    
+    // Page size of a node holding keys [from, to)
+    auto bytes = [&](size_t from, size_t to) {
+        size_t n = to - from;
+        size_t prefix = sharedLength(node.keys[from], node.keys[to - 1]);
+        return fixed + prefix + n * overhead + (key_bytes[to] - key_bytes[from]) - n * prefix;
+    };
+    
+    // Keep at least one key on each side, make the bigger half as small as possible
+    size_t mid = 1;
+    size_t best = SIZE_MAX;
+    for(size_t m = 1; m + 1 < count; m++) {
+        size_t worst = max(bytes(0, m), bytes(m + 1, count));
+        if(worst < best) {
+            best = worst;
+            mid = m;
         }
-        i++;
+    }
+    
+    right.is_leaf = node.is_leaf;
+    right.keys.assign(make_move_iterator(node.keys.begin() + mid + 1), make_move_iterator(node.keys.end()));
+    right.record_ids.assign(node.record_ids.begin() + mid + 1, node.record_ids.end());
+    right.children.clear();
+    if(!node.is_leaf) {
+        right.children.assign(node.children.begin() + mid + 1, node.children.end());
+        node.children.resize(mid + 1);
+    }
+    
+    split.key = move(node.keys[mid]);
+    split.record_id = node.record_ids[mid];
+    split.right_id = right.node_id;
+    
+    node.keys.resize(mid);
+    node.record_ids.resize(mid);
+}
+
+// Split an overfull node in two and write both halves
+void BTree::splitNode(BTreeNode& node, Split& split) {
+    BTreeNode right;
+    right.node_id = allocateNode();
+    divideNode(node, right, split);
+    
+    writeNode(node);
+    writeNode(right);
+}
+
+// Insert into the subtree under node_id, true if that node split (split says how)
+// Nodes grow in memory and are split on the way back up if they no longer
+// fit their page, so fanout follows key sizes instead of a fixed 40.
+// The descent only views pages; a node is copied out only when it splits
+// or takes a separator from a split child
+bool BTree::insertInto(uint64_t node_id, const string& key, uint64_t record_id, Split& split) {
+    size_t i;
+    {
+        NodeView view = viewNode(node_id);
+        // Equal keys go after existing ones
+        i = view.upperBound(key);
         
-        BTreeNode child = readNode(node.children[i]);
-        if(child.num_keys == 40) {
-            splitChild(node, i);
-            if(record.site_name > node.keys[i]) {
-                i++;
+        if(!view.isLeaf()) {
+            Split child_split;
+            // The view is dead after this - writes below can remap the file
+            if(!insertInto(view.child(i), key, record_id, child_split)) {
+                return false;   // child absorbed it, this node is unchanged
             }
-            child = readNode(node.children[i]);
+            
+            BTreeNode node = readNode(node_id);
+            node.keys.insert(node.keys.begin() + i, move(child_split.key));
+            node.record_ids.insert(node.record_ids.begin() + i, child_split.record_id);
+            node.children.insert(node.children.begin() + i + 1, child_split.right_id);
+            return writeOrSplit(node, split);
+        }
+        
+        // Common case, a leaf with room: splice the key into a copy of the page
+        char page[NODE_PAGE_SIZE] = {};
+        if(encodeLeafInsert(view, i, key, record_id, page)) {
+            writePage(node_id, page);
+            return false;
         }
-        insertNonFull(child, record);
     }
+    
+    // Leaf is full - copy it out and split
+    BTreeNode node = readNode(node_id);
+    node.keys.insert(node.keys.begin() + i, key);
+    node.record_ids.insert(node.record_ids.begin() + i, record_id);
+    return writeOrSplit(node, split);
+}
+
+// Write a modified node back, splitting it first if it outgrew its page
+bool BTree::writeOrSplit(BTreeNode& node, Split& split) {
+    if(pageBytes(node) <= NODE_PAGE_SIZE) {
+        writeNode(node);
+        return false;
+    }
+    splitNode(node, split);
+    return true;
+}
+
+// Add one key to the tree, growing a new root if the old one splits
+void BTree::insertKey(const string& key, uint64_t record_id) {
+    Split split;
+    if(insertInto(root_id, key, record_id, split)) {
+        BTreeNode new_root;
+        new_root.node_id = allocateNode();
+        new_root.is_leaf = false;
+        new_root.keys.push_back(move(split.key));
+        new_root.record_ids.push_back(split.record_id);
+        new_root.children = {root_id, split.right_id};
+        writeNode(new_root);
+        root_id = new_root.node_id;
+    }
+}
+
+// Largest entry under node_id - the rightmost key of the rightmost leaf
+void BTree::maxEntry(uint64_t node_id, string& key, uint64_t& record_id) const {
+    NodeView view = viewNode(node_id);
+    while(!view.isLeaf()) {
+        view = viewNode(view.child(view.numKeys()));
+    }
+    if(view.numKeys() == 0) {
+        throw logic_error("Empty B-Tree leaf " + to_string(view.nodeId()));
+    }
+    
+    size_t last = view.numKeys() - 1;
+    string_view prefix = view.prefix();
+    string_view suffix = view.suffix(last);
+    key.assign(prefix.data(), prefix.size());
+    key.append(suffix.data(), suffix.size());
+    record_id = view.recordId(last);
+}
+
+// Child i of parent dropped below MIN_FILL_BYTES: merge it with a
+// neighbour if both fit one page, otherwise share their keys out evenly
+void BTree::rebalance(BTreeNode& parent, size_t i) {
+    if(parent.children.size() < 2) return;
+    
+    // Separator s sits between children s and s + 1
+    size_t s = i > 0 ? i - 1 : i;
+    BTreeNode left = readNode(parent.children[s]);
+    BTreeNode right = readNode(parent.children[s + 1]);
+    
+    // Pull the separator and all of right into left
+    left.keys.push_back(move(parent.keys[s]));
+    left.record_ids.push_back(parent.record_ids[s]);
+    left.keys.insert(left.keys.end(), make_move_iterator(right.keys.begin()), make_move_iterator(right.keys.end()));
+    left.record_ids.insert(left.record_ids.end(), right.record_ids.begin(), right.record_ids.end());
+    left.children.insert(left.children.end(), right.children.begin(), right.children.end());
+    
+    if(pageBytes(left) <= NODE_PAGE_SIZE) {
+        // Merge - right's page goes on the freelist
+        parent.keys.erase(parent.keys.begin() + s);
+        parent.record_ids.erase(parent.record_ids.begin() + s);
+        parent.children.erase(parent.children.begin() + s + 1);
+        writeNode(left);
+        freeNode(right.node_id);
+        return;
+    }
+    
+    // Borrow - re-split the combined keys, right keeps its page
+    Split split;
+    divideNode(left, right, split);
+    parent.keys[s] = move(split.key);
+    parent.record_ids[s] = split.record_id;
+    writeNode(left);
+    writeNode(right);
+}
+
+// Write back a node changed by a removal below or in it
+// A replacement separator can be longer than the old one, so this may
+// still have to split
+BTree::RemoveResult BTree::finishRemove(BTreeNode& node, Split& split) {
+    if(pageBytes(node) > NODE_PAGE_SIZE) {
+        splitNode(node, split);
+        return RemoveResult::Split;
+    }
+    writeNode(node);
+    return pageBytes(node) < MIN_FILL_BYTES ? RemoveResult::Underflow : RemoveResult::Removed;
+}
+
+// Fix up node after removing from its child i
+void BTree::applyChildResult(BTreeNode& node, size_t i, RemoveResult result, Split& child_split) {
+    if(result == RemoveResult::Underflow) {
+        rebalance(node, i);
+    } else if(result == RemoveResult::Split) {
+        node.keys.insert(node.keys.begin() + i, move(child_split.key));
+        node.record_ids.insert(node.record_ids.begin() + i, child_split.record_id);
+        node.children.insert(node.children.begin() + i + 1, child_split.right_id);
+    }
+}
+
+// Remove the entry (key, record_id) from the subtree under node_id
+// Like insert, the descent only views pages; nodes are copied out on the
+// way back up when a child underflowed or the entry was in this node
+BTree::RemoveResult BTree::removeFrom(uint64_t node_id, const string& key, uint64_t record_id, Split& split) {
+    size_t first, last, hit;
+    bool leaf;
+    {
+        NodeView view = viewNode(node_id);
+        leaf = view.isLeaf();
+        first = view.lowerBound(key);
+        last = view.upperBound(key);
+        for(hit = first; hit < last; hit++) {
+            if(view.recordId(hit) == record_id) break;
+        }
+    }
+    
+    Split child_split;
+    if(hit < last) {
+        BTreeNode node = readNode(node_id);
+        if(leaf) {
+            node.keys.erase(node.keys.begin() + hit);
+            node.record_ids.erase(node.record_ids.begin() + hit);
+            return finishRemove(node, split);
+        }
+        
+        // Internal entry: take over the predecessor, then delete that from the left subtree
+        uint64_t child_id = node.children[hit];
+        maxEntry(child_id, node.keys[hit], node.record_ids[hit]);
+        RemoveResult result = removeFrom(child_id, node.keys[hit], node.record_ids[hit], child_split);
+        applyChildResult(node, hit, result, child_split);
+        return finishRemove(node, split);
+    }
+    
+    if(leaf) return RemoveResult::NotFound;
+    
+    // Equal keys can be in any child between first and last
+    for(size_t i = first; i <= last; i++) {
+        RemoveResult result = removeFrom(viewNode(node_id).child(i), key, record_id, child_split);
+        if(result == RemoveResult::NotFound) continue;
+        if(result == RemoveResult::Removed) return result;   // this node is unchanged
+        
+        BTreeNode node = readNode(node_id);
+        applyChildResult(node, i, result, child_split);
+        return finishRemove(node, split);
+    }
+    return RemoveResult::NotFound;
+}
+
+// Remove one entry, then shrink the tree while the root is an empty internal node
+bool BTree::removeKey(const string& key, uint64_t record_id) {
+    Split split;
+    RemoveResult result = removeFrom(root_id, key, record_id, split);
+    if(result == RemoveResult::NotFound) return false;
+    
+    if(result == RemoveResult::Split) {
+        BTreeNode new_root;
+        new_root.node_id = allocateNode();
+        new_root.is_leaf = false;
+        new_root.keys.push_back(move(split.key));
+        new_root.record_ids.push_back(split.record_id);
+        new_root.children = {root_id, split.right_id};
+        writeNode(new_root);
+        root_id = new_root.node_id;
+        return true;
+    }
+    
+    NodeView root = viewNode(root_id);
+    while(!root.isLeaf() && root.numKeys() == 0) {
+        uint64_t old_root = root_id;
+        root_id = root.child(0);
+        freeNode(old_root);
+        root = viewNode(root_id);
+    }
+    return true;
 }
 
 // Insert new password
-bool BTree::insert(const VaultRecord& record_input) {
+uint64_t BTree::insert(const VaultRecord& record_input) {
     VaultRecord record = record_input;
     record.record_id = next_record_id++;
     record.created_at = time(nullptr);
     record.modified_at = record.created_at;
     
     writeRecord(record);
+    addUserRecord(record.user_id, record.record_id);
+    addCategoryRecord(record.user_id, record.category, record.record_id);
+    modified_index.insert({record.user_id, record.modified_at, record.record_id});
+    insertKey(indexKey(record.user_id, record.site_name), record.record_id);
+    
+    saveMetadata();
+    return record.record_id;
+}
+
+// An empty tree has nothing to keep, so its index is written bottom-up
+// from the batch with the bulk loader - one sequential write for the node
+// file, no splits. Anything else takes the keys one by one
+void BTree::insertBatch(vector<VaultRecord>& records) {
+    if(records.empty()) return;
     
-    BTreeNode root = readNode(root_id);
+    bool empty = user_record_ids.empty();
+    appendNewRecords(records);
     
-    if(root.num_keys == 40) {
-        // Root is full, create new root
-        BTreeNode new_root;
-        new_root.node_id = next_node_id++;
-        new_root.is_leaf = false;
-        new_root.num_keys = 0;
-        new_root.children[0] = root_id;
-        
-        writeNode(new_root);
-        root_id = new_root.node_id;
-        
-        splitChild(new_root, 0);
-        insertNonFull(new_root, record);
-    } else {
-        insertNonFull(root, record);
+    if(empty) {
+        vector<IndexEntry> entries;
+        entries.reserve(records.size());
+        for(const auto& record : records) {
+            entries.push_back({indexKey(record.user_id, record.site_name), record.record_id});
+        }
+        bulkLoad(entries, DEFAULT_FILL_FACTOR);
+        return;
+    }
+    for(const auto& record : records) {
+        insertKey(indexKey(record.user_id, record.site_name), record.record_id);
     }
-    
     saveMetadata();
-    return true;
 }
 
-// Search for passwords by site name
-vector<VaultRecord> BTree::search(const string& site_name) {
+// Search a user's passwords by site name
+vector<VaultRecord> BTree::search(uint64_t user_id, const string& site_name) {
     vector<VaultRecord> results;
-    vector<VaultRecord> all_records = readAllRecords();
     
-    for(const auto& record : all_records) {
-        if(record.site_name == site_name) {
-            results.push_back(record);
+    // Index gives the candidates, the id index finds each record - keys
+    // are truncated, so the full name is still checked. File order, as
+    // a scan would return them
+    vector<uint64_t> record_ids = lookupRecordIds(user_id, site_name);
+    sort(record_ids.begin(), record_ids.end(), [this](uint64_t a, uint64_t b) {
+        return recordOffset(a) < recordOffset(b);
+    });
+    
+    VaultRecordView view;
+    for(uint64_t record_id : record_ids) {
+        if(getView(record_id, view) && view.site_name == site_name) {
+            results.push_back(view.toRecord());
         }
     }
     
     return results;
 }
 
+// Every entry equal to key under node_id
+// Equal keys can sit on both sides of an equal separator, so descend into
+// each child between the first and last match
+void BTree::collectMatches(uint64_t node_id, string_view key, vector<uint64_t>& record_ids) const {
+    NodeView view = viewNode(node_id);
+    size_t first = view.lowerBound(key);
+    size_t last = view.upperBound(key);
+    
+    for(size_t i = first; i <= last; i++) {
+        if(!view.isLeaf()) {
+            collectMatches(view.child(i), key, record_ids);
+        }
+        if(i < last) {
+            record_ids.push_back(view.recordId(i));
+        }
+    }
+}
+
+// Record ids for a user's site name, straight from the index pages
+vector<uint64_t> BTree::lookupRecordIds(uint64_t user_id, const string& site_name) const {
+    vector<uint64_t> record_ids;
+    collectMatches(root_id, indexKey(user_id, site_name), record_ids);
+    return record_ids;
+}
+
+// In-order walk of every entry with key >= from; stops when visit says so
+bool BTree::walkFrom(uint64_t node_id, string_view from,
+                     const function<bool(string_view, uint64_t)>& visit) const {
+    NodeView view = viewNode(node_id);
+    size_t n = view.numKeys();
+    string key(view.prefix());
+    size_t prefix_len = key.size();
+    
+    for(size_t i = view.lowerBound(from); i <= n; i++) {
+        if(!view.isLeaf() && !walkFrom(view.child(i), from, visit)) return false;
+        if(i == n) break;
+        
+        key.resize(prefix_len);
+        key.append(view.suffix(i));
+        if(!visit(key, view.recordId(i))) return false;
+    }
+    return true;
+}
+
+// A user's entries whose key starts with prefix, ordered by (key, record_id)
+// Equal keys sit in the tree in insertion order, so each run of them is
+// sorted by id before it goes out - that's what makes (key, id) a stable
+// place to resume from. Keys go out and come back without the user id
+void BTree::scanPrefix(uint64_t user_id, const string& prefix, const string& after_key, uint64_t after_id,
+                       const function<bool(string_view, uint64_t)>& visit) const {
+    string key_prefix = indexKey(user_id, prefix);
+    string resume_key = indexKey(user_id, "") + after_key;
+    string from = (after_id != 0 && resume_key > key_prefix) ? resume_key : key_prefix;
+    
+    string run_key;
+    vector<uint64_t> run_ids;
+    bool stopped = false;   // visit asked to stop
+    auto flush = [&]() {
+        sort(run_ids.begin(), run_ids.end());
+        for(uint64_t record_id : run_ids) {
+            if(after_id != 0 && run_key == resume_key && record_id <= after_id) continue;
+            if(!visit(string_view(run_key).substr(USER_KEY_BYTES), record_id)) {
+                stopped = true;
+                break;
+            }
+        }
+        run_ids.clear();
+        return !stopped;
+    };
+    
+    walkFrom(root_id, from, [&](string_view key, uint64_t record_id) {
+        if(key.compare(0, key_prefix.size(), key_prefix) != 0) return false;   // past the prefix
+        if(key != run_key) {
+            if(!flush()) return false;
+            run_key.assign(key);
+        }
+        run_ids.push_back(record_id);
+        return true;
+    });
+    
+    // Walk ended at the end of the prefix or the tree - last run is still pending
+    if(!stopped) flush();
+}
+
 // Get all passwords for a user
+// Walks the user's id list through the id index, so the cost is the
+// user's records, not the whole file. Ascending id order
 vector<VaultRecord> BTree::getAllRecordsForUser(uint64_t user_id) {
     vector<VaultRecord> results;
-    vector<VaultRecord> all_records = readAllRecords();
+    auto it = user_record_ids.find(user_id);
+    if(it == user_record_ids.end()) return results;
     
-    for(const auto& record : all_records) {
-        if(record.user_id == user_id) {
-            results.push_back(record);
+    results.reserve(it->second.size());
+    VaultRecordView view;
+    for(uint64_t record_id : it->second) {
+        if(getView(record_id, view)) {
+            results.push_back(view.toRecord());
         }
     }
     
@@ -335,111 +1447,275 @@ vector<VaultRecord> BTree::getAllRecordsForUser(uint64_t user_id) {
 }
 
 // Update a password
-bool BTree::update(uint64_t record_id, const VaultRecord& updated_record) {
-    vector<VaultRecord> all_records = readAllRecords();
-    
-    for(auto& record : all_records) {
-        if(record.record_id == record_id) {
-            record.site_name = updated_record.site_name;
-            record.username = updated_record.username;
-            record.encrypted_password = updated_record.encrypted_password;
-            record.iv = updated_record.iv;
-            record.notes = updated_record.notes;
-            record.category = updated_record.category;
-            record.modified_at = time(nullptr);
-            
-            // Rewrite all records
-            string records_file = filename + ".records";
-            ofstream file(records_file, ios::binary | ios::trunc);
-            for(const auto& r : all_records) {
-                file.write(reinterpret_cast<const char*>(&r.record_id), sizeof(r.record_id));
-                file.write(reinterpret_cast<const char*>(&r.user_id), sizeof(r.user_id));
-                
-                size_t len;
-                len = r.site_name.length();
-                file.write(reinterpret_cast<const char*>(&len), sizeof(len));
-                file.write(r.site_name.c_str(), len);
-                
-                len = r.username.length();
-                file.write(reinterpret_cast<const char*>(&len), sizeof(len));
-                file.write(r.username.c_str(), len);
-                
-                len = r.encrypted_password.length();
-                file.write(reinterpret_cast<const char*>(&len), sizeof(len));
-                file.write(r.encrypted_password.c_str(), len);
-                
-                len = r.iv.length();
-                file.write(reinterpret_cast<const char*>(&len), sizeof(len));
-                file.write(r.iv.c_str(), len);
-                
-                len = r.notes.length();
-                file.write(reinterpret_cast<const char*>(&len), sizeof(len));
-                file.write(r.notes.c_str(), len);
-                
-                len = r.category.length();
-                file.write(reinterpret_cast<const char*>(&len), sizeof(len));
-                file.write(r.category.c_str(), len);
-                
-                file.write(reinterpret_cast<const char*>(&r.created_at), sizeof(r.created_at));
-                file.write(reinterpret_cast<const char*>(&r.modified_at), sizeof(r.modified_at));
-            }
-            file.close();
-            return true;
-        }
+// The new version is appended and the old one retired in place, instead of
+// rewriting the records file - compaction reclaims the dead copy later
+bool BTree::update(uint64_t record_id, const VaultRecord& updated_record, VaultRecord* stored) {
+    uint64_t offset, length;
+    VaultRecordView current;
+    if(!findRecord(record_id, offset, length, current)) {
+        return false;
     }
+    VaultRecord record = current.toRecord();
+    string old_key = indexKey(record.user_id, record.site_name);
+    string new_key = indexKey(record.user_id, updated_record.site_name);
+    
+    if(record.category != updated_record.category) {
+        dropCategoryRecord(record.user_id, record.category, record_id);
+        addCategoryRecord(record.user_id, updated_record.category, record_id);
+    }
+    
+    record.site_name = updated_record.site_name;
+    record.username = updated_record.username;
+    record.encrypted_password = updated_record.encrypted_password;
+    record.iv = updated_record.iv;
+    record.notes = updated_record.notes;
+    record.category = updated_record.category;
+    modified_index.erase({record.user_id, record.modified_at, record_id});
+    record.modified_at = time(nullptr);
+    modified_index.insert({record.user_id, record.modified_at, record_id});
     
-    return false;
+    // Records file first - it's what open checks the index against
+    writeRecord(record);
+    killRecord(offset, length);
+    
+    // Renamed site - move the index entry
+    if(old_key != new_key) {
+        removeKey(old_key, record_id);
+        insertKey(new_key, record_id);
+        saveMetadata();
+    }
+    if(stored) *stored = move(record);
+    return true;
 }
 
-// Delete a password
+// Delete a password - mark the record dead, then drop it from the index
 bool BTree::remove(uint64_t record_id) {
-    vector<VaultRecord> all_records = readAllRecords();
+    uint64_t offset, length;
+    VaultRecordView current;
+    if(!findRecord(record_id, offset, length, current)) {
+        return false;  // Not found
+    }
     
-    auto it = remove_if(all_records.begin(), all_records.end(), 
-        [record_id](const VaultRecord& r) { return r.record_id == record_id; });
+    // current points into the mapping - done with it before the kill
+    string key = indexKey(current.user_id, current.site_name);
+    dropUserRecord(current.user_id, record_id);
+    dropCategoryRecord(current.user_id, current.category, record_id);
+    modified_index.erase({current.user_id, current.modified_at, record_id});
+    killRecord(offset, length);
+    record_offsets[record_id] = NO_RECORD_OFFSET;
     
-    if(it == all_records.end()) {
-        return false;  // Not found
+    removeKey(key, record_id);
+    saveMetadata();
+    return true;
+}
+
+// A replicated version over the live one at offset - current is that
+// copy, and goes stale at the write
+void BTree::replaceRecord(const VaultRecord& record, uint64_t offset, uint64_t length,
+                          const VaultRecordView& current) {
+    string old_key = indexKey(current.user_id, current.site_name);
+    string new_key = indexKey(record.user_id, record.site_name);
+    if(old_key != new_key) {
+        removeKey(old_key, record.record_id);
+        insertKey(new_key, record.record_id);
     }
+    dropCategoryRecord(current.user_id, current.category, record.record_id);
+    modified_index.erase({current.user_id, current.modified_at, record.record_id});
     
-    all_records.erase(it, all_records.end());
+    writeRecord(record);
+    killRecord(offset, length);
+    addCategoryRecord(record.user_id, record.category, record.record_id);
+    modified_index.insert({record.user_id, record.modified_at, record.record_id});
+}
+
+// Replicated writes - same bookkeeping as insert and update, but the ids
+// and timestamps come from the primary instead of being handed out here
+void BTree::put(const vector<VaultRecord>& records) {
+    if(records.empty()) return;
     
-    // Rewrite all records
-    string records_file = filename + ".records";
-    ofstream file(records_file, ios::binary | ios::trunc);
-    for(const auto& r : all_records) {
-        file.write(reinterpret_cast<const char*>(&r.record_id), sizeof(r.record_id));
-        file.write(reinterpret_cast<const char*>(&r.user_id), sizeof(r.user_id));
-        
-        size_t len;
-        len = r.site_name.length();
-        file.write(reinterpret_cast<const char*>(&len), sizeof(len));
-        file.write(r.site_name.c_str(), len);
-        
-        len = r.username.length();
-        file.write(reinterpret_cast<const char*>(&len), sizeof(len));
-        file.write(r.username.c_str(), len);
-        
-        len = r.encrypted_password.length();
-        file.write(reinterpret_cast<const char*>(&len), sizeof(len));
-        file.write(r.encrypted_password.c_str(), len);
-        
-        len = r.iv.length();
-        file.write(reinterpret_cast<const char*>(&len), sizeof(len));
-        file.write(r.iv.c_str(), len);
-        
-        len = r.notes.length();
-        file.write(reinterpret_cast<const char*>(&len), sizeof(len));
-        file.write(r.notes.c_str(), len);
-        
-        len = r.category.length();
-        file.write(reinterpret_cast<const char*>(&len), sizeof(len));
-        file.write(r.category.c_str(), len);
+    vector<VaultRecord> added;
+    uint64_t offset, length;
+    VaultRecordView current;
+    for(const auto& record : records) {
+        if(findRecord(record.record_id, offset, length, current)) {
+            replaceRecord(record, offset, length, current);
+        } else {
+            added.push_back(record);
+        }
+        next_record_id = max(next_record_id, record.record_id + 1);
+    }
+    
+    writeRecords(added);
+    for(const auto& record : added) {
+        addUserRecord(record.user_id, record.record_id);
+        addCategoryRecord(record.user_id, record.category, record.record_id);
+        modified_index.insert({record.user_id, record.modified_at, record.record_id});
+        insertKey(indexKey(record.user_id, record.site_name), record.record_id);
+    }
+    saveMetadata();
+}
+
+double StorageStats::fragmentation() const {
+    uint64_t total = record_file_bytes + node_file_bytes;
+    if(total == 0) return 0.0;
+    return static_cast<double>(dead_record_bytes + free_node_bytes) / total;
+}
+
+StorageStats BTree::storageStats() const {
+    StorageStats stats;
+    stats.record_file_bytes = record_map.size();
+    stats.dead_record_bytes = dead_record_bytes;
+    stats.node_file_bytes = node_map.size();
+    stats.free_node_bytes = free_nodes.size() * NODE_PAGE_SIZE;
+    return stats;
+}
+
+// Start a compaction: live records get copied into a side file, the
+// originals stay in use until swapCompaction
+void BTree::beginCompaction(CompactionState& state) {
+    state = CompactionState();
+    state.records_out.open(filename + ".records.compact", ios::binary | ios::trunc);
+    if(!state.records_out.is_open()) {
+        throw runtime_error("Failed to open compaction file for writing");
+    }
+    state.source_end = record_map.size();
+}
+
+// Copy up to max_bytes of the old records file, live records only
+// Records are copied byte for byte straight out of the mapping
+bool BTree::copyLiveRecords(CompactionState& state, uint64_t max_bytes) {
+    uint64_t budget_end = state.read_offset + min(max_bytes, state.source_end - state.read_offset);
+    VaultRecordView view;
+    while(state.read_offset < budget_end) {
+        uint64_t start = state.read_offset;
+        if(!parseRecord(state.read_offset, view)) {
+            state.read_offset = state.source_end;   // torn tail - nothing more to copy
+            break;
+        }
+        if(view.record_id == DEAD_RECORD_ID) continue;
         
-        file.write(reinterpret_cast<const char*>(&r.created_at), sizeof(r.created_at));
-        file.write(reinterpret_cast<const char*>(&r.modified_at), sizeof(r.modified_at));
+        uint64_t length = state.read_offset - start;
+        state.records_out.write(record_map.data() + start, length);
+        state.moved.push_back({start, state.written, length, DEAD_RECORD_ID});
+        state.written += length;
     }
-    file.close();
+    if(!state.records_out) {
+        throw runtime_error("Failed to write compaction file");
+    }
+    return state.read_offset >= state.source_end;
+}
+
+// Finish the copy and build a fresh index beside the old one
+// Caller must keep writers out from here until swapCompaction
+void BTree::finishCompaction(CompactionState& state, double fill_factor) {
+    // Records appended since the copy started
+    state.source_end = record_map.size();
+    copyLiveRecords(state, UINT64_MAX);
     
-    return true;
+    // Anything updated or deleted after it was copied is dead in the new file too
+    vector<IndexEntry> entries;
+    entries.reserve(state.moved.size());
+    VaultRecordView view;
+    uint64_t dead = DEAD_RECORD_ID;
+    for(auto& m : state.moved) {
+        uint64_t pos = m.old_offset;
+        parseRecord(pos, view);
+        if(view.record_id == DEAD_RECORD_ID) {
+            state.records_out.seekp(m.new_offset);
+            state.records_out.write(reinterpret_cast<const char*>(&dead), sizeof(dead));
+            state.dead_written += m.length;
+        } else {
+            entries.push_back({indexKey(view.user_id, view.site_name), view.record_id});
+        }
+        m.record_id = view.record_id;
+    }
+    state.records_out.close();
+    if(state.records_out.fail()) {
+        throw runtime_error("Failed to write compaction file");
+    }
+    
+    writeIndexFile(filename + ".compact", entries, fill_factor, state.new_root_id, state.new_node_count);
+}
+
+// Put the compacted files in place - needs the exclusive lock
+// Records go first: the index only holds record ids, so either file
+// pairs with either version of the other after a crash
+void BTree::swapCompaction(CompactionState& state) {
+    filesystem::rename(filename + ".records.compact", filename + ".records");
+    filesystem::rename(filename + ".compact", filename);
+    
+    root_id = state.new_root_id;
+    next_node_id = state.new_node_count;
+    free_nodes.clear();
+    dead_record_bytes = state.dead_written;
+    fill(record_offsets.begin(), record_offsets.end(), NO_RECORD_OFFSET);
+    for(const auto& m : state.moved) {
+        if(m.record_id != DEAD_RECORD_ID) setRecordOffset(m.record_id, m.new_offset);
+    }
+    record_map.reopen();
+    node_map.reopen();
+    state.moved.clear();
+}
+
+void BTree::abortCompaction(CompactionState& state) {
+    if(state.records_out.is_open()) state.records_out.close();
+    state.moved.clear();
+    error_code ec;
+    filesystem::remove(filename + ".records.compact", ec);
+    filesystem::remove(filename + ".compact", ec);
+}
+
+// Everything a backup could still need from the node file, before it is
+// replaced wholesale
+void BTree::preserveNodeFile() {
+    if(!snapshot) return;
+    preserve(false, 0, METADATA_SIZE);
+    for(uint64_t node_id = 0; nodeOffset(node_id) < snapshot->node_file_bytes; node_id++) {
+        preserve(false, nodeOffset(node_id), NODE_PAGE_SIZE);
+    }
+}
+
+void BTree::preserve(bool records, uint64_t offset, uint64_t length) {
+    if(!snapshot) return;
+    uint64_t limit = records ? snapshot->record_file_bytes : snapshot->node_file_bytes;
+    if(offset >= limit) return;     // appended after the backup started
+    length = min(length, limit - offset);
+    
+    const MappedFile& file = records ? record_map : node_map;
+    lock_guard<mutex> lock(snapshot->images_mutex);
+    auto& images = records ? snapshot->record_images : snapshot->node_images;
+    if(images.count(offset)) return;
+    if(!file.contains(offset, length)) return;  // cut off earlier, saved then
+    images.emplace(offset, string(file.data() + offset, length));
+}
+
+shared_ptr<FileSnapshot> BTree::beginSnapshot() {
+    if(snapshot) {
+        throw runtime_error("A backup is already running");
+    }
+    auto started = make_shared<FileSnapshot>();
+    started->node_file_bytes = filesystem::file_size(filename);
+    started->record_file_bytes = filesystem::exists(filename + ".records")
+                                 ? filesystem::file_size(filename + ".records") : 0;
+    snapshot = started;
+    return started;
+}
+
+void BTree::endSnapshot() {
+    snapshot.reset();
+}
+
+// Saved ranges are at most a page, so only one starting before offset can reach into it
+void FileSnapshot::overlay(bool records, uint64_t offset, char* data, size_t length) {
+    lock_guard<mutex> lock(images_mutex);
+    const auto& images = records ? record_images : node_images;
+    uint64_t end = offset + length;
+    auto it = images.lower_bound(offset > NODE_PAGE_SIZE ? offset - NODE_PAGE_SIZE : 0);
+    for(; it != images.end() && it->first < end; ++it) {
+        uint64_t from = max(offset, it->first);
+        uint64_t to = min(end, it->first + it->second.size());
+        if(from < to) {
+            memcpy(data + (from - offset), it->second.data() + (from - it->first), to - from);
+        }
+    }
 }
@@ -0,0 +1,234 @@
+#include "changelog.hpp"
+#include <algorithm>
+#include <cstring>
+#include <ctime>
+
+using namespace std;
+
+// seq, user_id, record_id, modified_at, op
+static const size_t ENTRY_BYTES = 4 * sizeof(uint64_t) + 1;
+
+static void encodeEntry(const ChangeEntry& entry, string& out) {
+    uint8_t op = static_cast<uint8_t>(entry.op);
+    out.append(reinterpret_cast<const char*>(&entry.seq), sizeof(entry.seq));
+    out.append(reinterpret_cast<const char*>(&entry.user_id), sizeof(entry.user_id));
+    out.append(reinterpret_cast<const char*>(&entry.record_id), sizeof(entry.record_id));
+    out.append(reinterpret_cast<const char*>(&entry.modified_at), sizeof(entry.modified_at));
+    out.append(reinterpret_cast<const char*>(&op), sizeof(op));
+}
+
+static ChangeEntry decodeEntry(const char* data) {
+    ChangeEntry entry;
+    memcpy(&entry.seq, data, sizeof(uint64_t));
+    memcpy(&entry.user_id, data + sizeof(uint64_t), sizeof(uint64_t));
+    memcpy(&entry.record_id, data + 2 * sizeof(uint64_t), sizeof(uint64_t));
+    memcpy(&entry.modified_at, data + 3 * sizeof(uint64_t), sizeof(uint64_t));
+    entry.op = static_cast<ChangeOp>(static_cast<uint8_t>(data[4 * sizeof(uint64_t)]));
+    return entry;
+}
+
+// Tombstones deleted before this are past retention
+static uint64_t expiryCutoff(uint64_t retention) {
+    uint64_t now = time(nullptr);
+    return now > retention ? now - retention : 0;
+}
+
+// Constructor - replay the log file if it exists
+ChangeLog::ChangeLog(const string& filename, uint64_t tombstone_retention)
+    : file(filename, ENTRY_BYTES, "change log"), last_seq(0), tombstone_retention(tombstone_retention) {
+    load();
+}
+
+// Load entries from disk, keeping only the newest one per record and
+// only tombstones still within retention
+void ChangeLog::load() {
+    vector<ChangeEntry> entries;
+    unordered_map<uint64_t, uint64_t> newest;   // record_id -> seq
+    unordered_map<uint64_t, uint64_t> horizons; // user_id -> horizon
+    uint64_t read = 0;
+
+    file.replay([&](const char* data) {
+        ChangeEntry entry = decodeEntry(data);
+        read++;
+        last_seq = max(last_seq, entry.seq);
+        if(entry.op == ChangeOp::Horizon) {
+            horizons[entry.user_id] = max(horizons[entry.user_id], entry.seq);
+            return;
+        }
+        entries.push_back(entry);
+        newest[entry.record_id] = entry.seq;
+    });
+
+    // Drop superseded entries and expired tombstones - the user's horizon
+    // moves up to the newest tombstone dropped
+    uint64_t cutoff = expiryCutoff(tombstone_retention);
+    vector<ChangeEntry> live;
+    for(const auto& entry : entries) {
+        if(newest[entry.record_id] != entry.seq) continue;
+        if(entry.op == ChangeOp::Delete && entry.modified_at < cutoff) {
+            horizons[entry.user_id] = max(horizons[entry.user_id], entry.seq);
+            continue;
+        }
+        live.push_back(entry);
+    }
+
+    // Shrink the file once most of it is history. Horizons go first so
+    // they - and the highest seq handed out - survive the rewrite
+    if(live.size() * 2 < read) {
+        string bytes;
+        bytes.reserve((horizons.size() + live.size()) * ENTRY_BYTES);
+        for(const auto& horizon : horizons) {
+            encodeEntry({horizon.second, horizon.first, 0, 0, ChangeOp::Horizon}, bytes);
+        }
+        for(const auto& entry : live) {
+            encodeEntry(entry, bytes);
+        }
+        file.rewrite(bytes);
+    }
+
+    for(const auto& horizon : horizons) {
+        userLog(horizon.first).horizon = horizon.second;
+    }
+    for(const auto& entry : live) {
+        index(entry);
+    }
+}
+
+// Append entries to the log file
+void ChangeLog::appendEntries(const vector<ChangeEntry>& entries) {
+    string bytes;
+    bytes.reserve(entries.size() * ENTRY_BYTES);
+    for(const auto& entry : entries) {
+        encodeEntry(entry, bytes);
+    }
+    file.append(bytes);
+}
+
+ChangeLog::UserLog& ChangeLog::userLog(uint64_t user_id) {
+    UserLog* log = logs.get(user_id);
+    if(!log) {
+        logs.put(user_id, UserLog());
+        log = logs.get(user_id);
+    }
+    return *log;
+}
+
+// Add entry to the per-user index
+void ChangeLog::index(const ChangeEntry& entry) {
+    UserLog& log = userLog(entry.user_id);
+    log.entries.push_back(entry);
+    log.latest[entry.record_id] = entry.seq;
+    if(entry.op == ChangeOp::Delete) log.deletes++;
+
+    // Superseded entries are skipped by queries - drop them once they
+    // dominate. Tombstones are never superseded, so every so many deletes
+    // also look for expired ones
+    if(log.entries.size() > 64 && (log.entries.size() > 2 * log.latest.size() || log.deletes >= 64)) {
+        compact(log);
+    }
+}
+
+// Remove superseded entries and expired tombstones from one user's log
+// A tombstone is the newest entry for its record, so the record is
+// forgotten with it
+void ChangeLog::compact(UserLog& log) {
+    uint64_t cutoff = expiryCutoff(tombstone_retention);
+    vector<ChangeEntry> kept;
+    kept.reserve(log.latest.size());
+    for(const auto& entry : log.entries) {
+        if(log.latest.find(entry.record_id)->second != entry.seq) continue;
+        if(entry.op == ChangeOp::Delete && entry.modified_at < cutoff) {
+            log.horizon = max(log.horizon, entry.seq);
+            log.latest.erase(entry.record_id);
+            continue;
+        }
+        kept.push_back(entry);
+    }
+    log.entries.swap(kept);
+    log.deletes = 0;
+}
+
+// Log a change and return its sequence number
+uint64_t ChangeLog::record(uint64_t user_id, uint64_t record_id, ChangeOp op, uint64_t modified_at) {
+    ChangeEntry entry;
+    entry.seq = last_seq + 1;
+    entry.user_id = user_id;
+    entry.record_id = record_id;
+    entry.modified_at = modified_at;
+    entry.op = op;
+
+    appendEntries({entry});
+    last_seq = entry.seq;
+    index(entry);
+
+    return entry.seq;
+}
+
+void ChangeLog::recordBatch(uint64_t user_id, const vector<uint64_t>& record_ids, ChangeOp op, uint64_t modified_at) {
+    vector<ChangeEntry> entries;
+    entries.reserve(record_ids.size());
+    for(uint64_t record_id : record_ids) {
+        ChangeEntry entry;
+        entry.seq = last_seq + entries.size() + 1;
+        entry.user_id = user_id;
+        entry.record_id = record_id;
+        entry.modified_at = modified_at;
+        entry.op = op;
+        entries.push_back(entry);
+    }
+
+    appendEntries(entries);
+    for(const auto& entry : entries) {
+        last_seq = entry.seq;
+        index(entry);
+    }
+}
+
+void ChangeLog::replay(const vector<ChangeEntry>& entries) {
+    vector<ChangeEntry> fresh;
+    for(const auto& entry : entries) {
+        if(entry.seq > last_seq && (fresh.empty() || entry.seq > fresh.back().seq)) {
+            fresh.push_back(entry);
+        }
+    }
+    if(fresh.empty()) return;
+
+    appendEntries(fresh);
+    for(const auto& entry : fresh) {
+        last_seq = entry.seq;
+        index(entry);
+    }
+}
+
+// Everything that happened to this user's records after since
+// Read-only so it is safe under a shared lock
+ChangeSet ChangeLog::changesSince(uint64_t user_id, uint64_t since) {
+    ChangeSet changes;
+    changes.latest_seq = last_seq;
+    changes.expired = false;
+
+    UserLog* log = logs.get(user_id);
+    if(!log) return changes;
+
+    // A tombstone the client hasn't seen is gone
+    if(since < log->horizon) {
+        changes.expired = true;
+        return changes;
+    }
+
+    // Entries are in seq order - binary search for the first new one
+    auto it = upper_bound(log->entries.begin(), log->entries.end(), since,
+        [](uint64_t seq, const ChangeEntry& e) { return seq < e.seq; });
+
+    for(; it != log->entries.end(); ++it) {
+        if(log->latest.find(it->record_id)->second != it->seq) continue;  // superseded
+
+        if(it->op == ChangeOp::Delete) {
+            changes.tombstones.push_back(*it);
+        } else {
+            changes.upserts.push_back(*it);
+        }
+    }
+
+    return changes;
+}
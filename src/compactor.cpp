@@ -0,0 +1,174 @@
+#include "compactor.hpp"
+#include <chrono>
+#include <iostream>
+
+using namespace std;
+
+// Bytes copied per shared-lock hold
+static const uint64_t CHUNK_BYTES = 256 * 1024;
+
+Compactor::Compactor(BTree& btree, shared_mutex& vault_mutex, mutex& write_gate)
+    : btree(btree), vault_mutex(vault_mutex), write_gate(write_gate),
+      stopping(false), requested(false), running(false), bytes_copied(0), bytes_to_copy(0),
+      runs(0), last_reclaimed(0), total_reclaimed(0) {
+}
+
+Compactor::~Compactor() {
+    stop();
+}
+
+void Compactor::start(const CompactionSettings& new_settings) {
+    stop();
+    settings = new_settings;
+    stopping = false;
+    worker = thread(&Compactor::loop, this);
+}
+
+void Compactor::stop() {
+    {
+        lock_guard<mutex> lock(state_mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    if(worker.joinable()) {
+        worker.join();
+    }
+}
+
+void Compactor::request() {
+    {
+        lock_guard<mutex> lock(state_mutex);
+        requested = true;
+    }
+    wake.notify_all();
+}
+
+CompactionStatus Compactor::status() const {
+    CompactionStatus s;
+    s.running = running;
+    s.bytes_copied = bytes_copied;
+    s.bytes_to_copy = bytes_to_copy;
+    s.runs = runs;
+    s.last_reclaimed_bytes = last_reclaimed;
+    s.total_reclaimed_bytes = total_reclaimed;
+    return s;
+}
+
+void Compactor::loop() {
+    while(true) {
+        {
+            unique_lock<mutex> lock(state_mutex);
+            if(settings.check_interval_sec == 0) {
+                wake.wait(lock, [this] { return stopping || requested; });
+            } else {
+                wake.wait_for(lock, chrono::seconds(settings.check_interval_sec),
+                              [this] { return stopping || requested; });
+            }
+            if(stopping) return;
+        }
+        
+        bool forced;
+        {
+            lock_guard<mutex> lock(state_mutex);
+            forced = requested;
+            requested = false;
+        }
+        if(!forced && !due()) continue;
+        
+        try {
+            compact();
+        } catch(const exception& e) {
+            cerr << "  [ERROR] Compaction failed: " << e.what() << endl;
+        }
+    }
+}
+
+// Worth running - enough dead space, and enough of it in absolute terms
+bool Compactor::due() {
+    shared_lock<shared_mutex> lock(vault_mutex);
+    StorageStats stats = btree.storageStats();
+    uint64_t reclaimable = stats.dead_record_bytes + stats.free_node_bytes;
+    return reclaimable >= settings.min_dead_bytes && stats.fragmentation() >= settings.threshold;
+}
+
+void Compactor::compact() {
+    CompactionState state;
+    uint64_t size_before;
+    {
+        // A backup is reading the files - next check will try again
+        shared_lock<shared_mutex> lock(vault_mutex);
+        if(btree.snapshotActive()) return;
+        StorageStats stats = btree.storageStats();
+        size_before = stats.record_file_bytes + stats.node_file_bytes;
+        btree.beginCompaction(state);
+    }
+    
+    running = true;
+    bytes_to_copy = state.source_end;
+    bytes_copied = 0;
+    
+    try {
+        // Bulk of the copy - writers interleave between chunks
+        bool done = false;
+        while(!done) {
+            auto chunk_start = chrono::steady_clock::now();
+            {
+                shared_lock<shared_mutex> lock(vault_mutex);
+                done = btree.copyLiveRecords(state, CHUNK_BYTES);
+            }
+            bytes_copied = state.read_offset;
+            
+            // Shutting down - drop the side files, next start begins again
+            {
+                lock_guard<mutex> lock(state_mutex);
+                if(stopping) {
+                    btree.abortCompaction(state);
+                    running = false;
+                    return;
+                }
+            }
+            
+            // Throttle: each chunk gets at least its share of a second
+            if(settings.rate_bytes_per_sec > 0 && !done) {
+                auto budget = chrono::duration<double>(static_cast<double>(CHUNK_BYTES) / settings.rate_bytes_per_sec);
+                auto spent = chrono::steady_clock::now() - chunk_start;
+                if(spent < budget) {
+                    this_thread::sleep_for(budget - spent);
+                }
+            }
+        }
+        
+        // Catch up and build the new index with writers held off; reads carry on
+        lock_guard<mutex> gate(write_gate);
+        {
+            shared_lock<shared_mutex> lock(vault_mutex);
+            if(btree.snapshotActive()) {
+                // Swapping files under a running backup would break it
+                btree.abortCompaction(state);
+                running = false;
+                cout << "  [INFO] Compaction put off, backup running" << endl;
+                return;
+            }
+            btree.finishCompaction(state, settings.fill_factor);
+        }
+        
+        uint64_t size_after;
+        {
+            unique_lock<shared_mutex> lock(vault_mutex);
+            btree.swapCompaction(state);
+            StorageStats stats = btree.storageStats();
+            size_after = stats.record_file_bytes + stats.node_file_bytes;
+        }
+        
+        uint64_t reclaimed = size_before > size_after ? size_before - size_after : 0;
+        last_reclaimed = reclaimed;
+        total_reclaimed += reclaimed;
+        runs++;
+        cout << "  [INFO] Compaction reclaimed " << reclaimed << " bytes" << endl;
+    } catch(...) {
+        btree.abortCompaction(state);
+        running = false;
+        throw;
+    }
+    running = false;
+}
@@ -0,0 +1,193 @@
+#include "config.hpp"
+#include "storage.hpp"
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <algorithm>
+#include <vector>
+#include <utility>
+
+using namespace std;
+
+// Helper: strip leading/trailing whitespace
+static string trim(const string& s) {
+    size_t start = s.find_first_not_of(" \t\r\n");
+    if(start == string::npos) return "";
+    size_t end = s.find_last_not_of(" \t\r\n");
+    return s.substr(start, end - start + 1);
+}
+
+// Helper: parse a non-negative integer setting
+static unsigned long long parseNumber(const string& key, const string& value) {
+    if(value.empty() || value.find_first_not_of("0123456789") != string::npos) {
+        throw runtime_error("Invalid value for " + key + ": '" + value + "'");
+    }
+    return stoull(value);
+}
+
+// Build config: defaults, then --config file, then the rest of the command line
+ServerConfig ConfigLoader::load(int argc, char* argv[]) {
+    ServerConfig config;
+    vector<pair<string, string>> overrides;
+
+    for(int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if(arg.rfind("--", 0) != 0) {
+            throw runtime_error("Unexpected argument: " + arg);
+        }
+
+        // --key=value or --key value
+        string key = arg.substr(2);
+        string value;
+        size_t eq = key.find('=');
+        if(eq != string::npos) {
+            value = key.substr(eq + 1);
+            key = key.substr(0, eq);
+        } else if(i + 1 < argc) {
+            value = argv[++i];
+        } else {
+            throw runtime_error("Missing value for --" + key);
+        }
+        replace(key.begin(), key.end(), '-', '_');
+
+        if(key == "config") {
+            applyFile(config, value);
+        } else {
+            overrides.push_back({key, value});
+        }
+    }
+
+    // Command line wins over the file no matter the order given
+    for(const auto& kv : overrides) {
+        apply(config, kv.first, kv.second);
+    }
+
+    return config;
+}
+
+// Apply "key = value" lines from a file
+void ConfigLoader::applyFile(ServerConfig& config, const string& path) {
+    ifstream file(path);
+    if(!file.is_open()) {
+        throw runtime_error("Failed to open config file: " + path);
+    }
+
+    string line;
+    int line_no = 0;
+    while(getline(file, line)) {
+        line_no++;
+        size_t hash = line.find('#');
+        if(hash != string::npos) line = line.substr(0, hash);
+        line = trim(line);
+        if(line.empty()) continue;
+
+        size_t eq = line.find('=');
+        if(eq == string::npos) {
+            throw runtime_error(path + ":" + to_string(line_no) + ": expected key = value");
+        }
+        apply(config, trim(line.substr(0, eq)), trim(line.substr(eq + 1)));
+    }
+}
+
+// Apply one setting by name
+void ConfigLoader::apply(ServerConfig& config, const string& key, const string& value) {
+    if(key == "host") {
+        config.host = value;
+    } else if(key == "port") {
+        unsigned long long port = parseNumber(key, value);
+        if(port == 0 || port > 65535) throw runtime_error("Invalid port: " + value);
+        config.port = static_cast<int>(port);
+    } else if(key == "data_dir") {
+        if(value.empty()) throw runtime_error("data_dir cannot be empty");
+        config.data_dir = value;
+    } else if(key == "worker_threads") {
+        config.worker_threads = parseNumber(key, value);
+    } else if(key == "max_queued_requests") {
+        config.max_queued_requests = parseNumber(key, value);
+    } else if(key == "listen_backlog") {
+        config.listen_backlog = static_cast<int>(parseNumber(key, value));
+    } else if(key == "tcp_nodelay") {
+        if(value != "true" && value != "false") {
+            throw runtime_error("Invalid value for tcp_nodelay: '" + value + "' (true/false)");
+        }
+        config.tcp_nodelay = (value == "true");
+    } else if(key == "keep_alive_max_count") {
+        config.keep_alive_max_count = parseNumber(key, value);
+    } else if(key == "keep_alive_timeout") {
+        config.keep_alive_timeout_sec = static_cast<time_t>(parseNumber(key, value));
+    } else if(key == "read_timeout") {
+        config.read_timeout_sec = static_cast<time_t>(parseNumber(key, value));
+    } else if(key == "write_timeout") {
+        config.write_timeout_sec = static_cast<time_t>(parseNumber(key, value));
+    } else if(key == "max_payload_bytes") {
+        config.max_payload_bytes = parseNumber(key, value);
+    } else if(key == "vault_shards") {
+        unsigned long long shards = parseNumber(key, value);
+        if(shards > MAX_VAULT_SHARDS) {
+            throw runtime_error("Invalid vault_shards: " + value + " (at most " + to_string(MAX_VAULT_SHARDS) + ")");
+        }
+        config.vault_shards = static_cast<size_t>(shards);
+    } else if(key == "compaction_threshold_percent") {
+        unsigned long long percent = parseNumber(key, value);
+        if(percent > 100) throw runtime_error("Invalid compaction_threshold_percent: " + value);
+        config.compaction_threshold_percent = static_cast<unsigned>(percent);
+    } else if(key == "compaction_rate") {
+        config.compaction_rate = parseNumber(key, value);
+    } else if(key == "compaction_interval") {
+        config.compaction_interval_sec = static_cast<time_t>(parseNumber(key, value));
+    } else if(key == "record_cache_bytes") {
+        config.record_cache_bytes = parseNumber(key, value);
+    } else if(key == "search_index_bytes") {
+        config.search_index_bytes = parseNumber(key, value);
+    } else if(key == "breach_corpus") {
+        config.breach_corpus = value;
+    } else if(key == "admin_token") {
+        config.admin_token = value;
+    } else if(key == "restore_from") {
+        config.restore_from = value;
+    } else if(key == "replication_backlog") {
+        config.replication_backlog = parseNumber(key, value);
+    } else if(key == "replicate_from") {
+        size_t colon = value.rfind(':');
+        if(!value.empty() && (colon == string::npos || colon == 0 || colon + 1 == value.size() ||
+                              value.find_first_not_of("0123456789", colon + 1) != string::npos)) {
+            throw runtime_error("Invalid replicate_from: '" + value + "' (host:port)");
+        }
+        config.replicate_from = value;
+    } else if(key == "replica_max_lag") {
+        config.replica_max_lag_sec = static_cast<time_t>(parseNumber(key, value));
+    } else {
+        throw runtime_error("Unknown setting: " + key);
+    }
+}
+
+string ConfigLoader::usage() {
+    ostringstream ss;
+    ss << "Usage: password_vault_server [--config FILE] [--key value ...]\n"
+       << "Settings (same names in the config file, as key = value):\n"
+       << "  host                  bind address (default 0.0.0.0)\n"
+       << "  port                  listen port (default 8080)\n"
+       << "  data_dir              directory for vault.dat/users.dat (default data)\n"
+       << "  worker_threads        request threads, 0 = httplib default\n"
+       << "  max_queued_requests   pending requests before rejecting, 0 = unbounded\n"
+       << "  listen_backlog        TCP accept backlog (default 5)\n"
+       << "  tcp_nodelay           true/false, disable Nagle (default true)\n"
+       << "  keep_alive_max_count  requests per keep-alive connection (default 100)\n"
+       << "  keep_alive_timeout    idle keep-alive seconds (default 5)\n"
+       << "  read_timeout          seconds (default 5)\n"
+       << "  write_timeout         seconds (default 5)\n"
+       << "  max_payload_bytes     largest request body (default 8388608)\n"
+       << "  vault_shards          vault files users are split across, fixed once created, 0 = as data_dir has (default 0)\n"
+       << "  compaction_threshold_percent  dead space that triggers compaction (default 30)\n"
+       << "  compaction_rate       compaction copy rate in bytes/s, 0 = unthrottled (default 8388608)\n"
+       << "  compaction_interval   seconds between fragmentation checks, 0 = off (default 60)\n"
+       << "  record_cache_bytes    memory for cached user vaults, 0 = off (default 33554432)\n"
+       << "  search_index_bytes    memory for per-user search indexes, least recently searched dropped first (default 16777216)\n"
+       << "  breach_corpus         breached password file from breach_convert (default off)\n"
+       << "  admin_token           secret for /api/admin/backup, sent as Authorization (default off)\n"
+       << "  restore_from          backup archive to unpack into data_dir before starting\n"
+       << "  replication_backlog   writes kept for replicas to catch up from, 0 = off (default 0)\n"
+       << "  replicate_from        run as a read-only replica of this primary (host:port)\n"
+       << "  replica_max_lag       seconds a replica may fall behind before refusing reads, 0 = never (default 10)\n";
+    return ss.str();
+}
@@ -2,6 +2,7 @@
 #include <openssl/evp.h>
 #include <openssl/rand.h>
 #include <openssl/sha.h>
+#include <openssl/hmac.h>
 #include <sstream>
 #include <iomanip>
 #include <stdexcept>
@@ -19,8 +20,14 @@ string Crypto::bytesToHex(const vector<uint8_t>& bytes) {
     return ss.str();
 }
 
+// Throws invalid_argument on an odd length or a non-hex digit - stoi
+// would quietly stop at the first bad one
 vector<uint8_t> Crypto::hexToBytes(const string& hex) {
+    if(hex.length() % 2 != 0 || hex.find_first_not_of("0123456789abcdefABCDEF") != string::npos) {
+        throw invalid_argument("Invalid hex string");
+    }
     vector<uint8_t> bytes;
+    bytes.reserve(hex.length() / 2);
     for(size_t i = 0; i < hex.length(); i += 2) {
         string byteString = hex.substr(i, 2);
         uint8_t byte = static_cast<uint8_t>(stoi(byteString, nullptr, 16));
@@ -76,6 +83,29 @@ bool Crypto::verifyPassword(const string& password, const string& salt, const st
     return computed_hash == hash;
 }
 
+// Keyed hash - same input and key always give the same output
+string Crypto::hmacSHA256(const string& key, const string& data) {
+    vector<uint8_t> key_bytes = hexToBytes(key);
+    vector<uint8_t> mac(32);
+    unsigned int mac_len = 0;
+    
+    if(!HMAC(EVP_sha256(), key_bytes.data(), static_cast<int>(key_bytes.size()),
+             reinterpret_cast<const unsigned char*>(data.data()), data.size(),
+             mac.data(), &mac_len)) {
+        throw runtime_error("HMAC failed");
+    }
+    
+    mac.resize(mac_len);
+    return bytesToHex(mac);
+}
+
+// SHA-1 digest - breach corpora (HIBP) are keyed by it
+string Crypto::sha1Hex(const string& data) {
+    vector<uint8_t> digest(SHA_DIGEST_LENGTH);
+    SHA1(reinterpret_cast<const unsigned char*>(data.data()), data.size(), digest.data());
+    return bytesToHex(digest);
+}
+
 // Encrypt plaintext using AES-256-CBC
 string Crypto::encryptAES256(const string& plaintext, const string& key, const string& iv) {
     vector<uint8_t> key_bytes = hexToBytes(key);
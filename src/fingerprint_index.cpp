@@ -0,0 +1,137 @@
+#include "fingerprint_index.hpp"
+#include <algorithm>
+#include <stdexcept>
+#include <cstring>
+
+using namespace std;
+
+static const string TOMBSTONE(FINGERPRINT_BYTES, '\0');
+
+// user_id, record_id, fingerprint
+static const size_t ENTRY_BYTES = 2 * sizeof(uint64_t) + FINGERPRINT_BYTES;
+
+static void encodeEntry(uint64_t user_id, uint64_t record_id, const string& fingerprint, string& out) {
+    out.append(reinterpret_cast<const char*>(&user_id), sizeof(user_id));
+    out.append(reinterpret_cast<const char*>(&record_id), sizeof(record_id));
+    out.append(fingerprint.data(), FINGERPRINT_BYTES);
+}
+
+// Constructor - replay the file if it exists
+FingerprintIndex::FingerprintIndex(const string& filename)
+    : file(filename, ENTRY_BYTES, "fingerprint index") {
+    load();
+}
+
+// Load entries from disk, keeping only the newest one per record
+void FingerprintIndex::load() {
+    uint64_t entries = file.replay([&](const char* data) {
+        uint64_t user_id, record_id;
+        memcpy(&user_id, data, sizeof(user_id));
+        memcpy(&record_id, data + sizeof(user_id), sizeof(record_id));
+        string fingerprint(data + 2 * sizeof(uint64_t), FINGERPRINT_BYTES);
+
+        UserPrints& prints = userPrints(user_id);
+        if(fingerprint == TOMBSTONE) {
+            prints.by_record.erase(record_id);
+        } else {
+            prints.by_record[record_id] = fingerprint;
+        }
+    });
+
+    uint64_t live = 0;
+    for(uint64_t user_id : user_ids) {
+        live += users.get(user_id)->by_record.size();
+    }
+
+    // Shrink the file once most of it is history
+    if(live * 2 < entries) {
+        rewrite();
+    }
+}
+
+// Append entries for one user to the file
+void FingerprintIndex::appendEntries(uint64_t user_id, const vector<pair<uint64_t, string>>& entries) {
+    string bytes;
+    bytes.reserve(entries.size() * ENTRY_BYTES);
+    for(const auto& entry : entries) {
+        encodeEntry(user_id, entry.first, entry.second, bytes);
+    }
+    file.append(bytes);
+}
+
+// Replace the file with just the live entries
+void FingerprintIndex::rewrite() {
+    string bytes;
+    for(uint64_t user_id : user_ids) {
+        for(const auto& entry : users.get(user_id)->by_record) {
+            encodeEntry(user_id, entry.first, entry.second, bytes);
+        }
+    }
+    file.rewrite(bytes);
+}
+
+FingerprintIndex::UserPrints& FingerprintIndex::userPrints(uint64_t user_id) {
+    UserPrints* prints = users.get(user_id);
+    if(!prints) {
+        users.put(user_id, UserPrints{user_id, {}});
+        user_ids.push_back(user_id);
+        prints = users.get(user_id);
+    }
+    return *prints;
+}
+
+void FingerprintIndex::set(uint64_t user_id, uint64_t record_id, const string& fingerprint) {
+    if(fingerprint.size() != FINGERPRINT_BYTES) {
+        throw runtime_error("Fingerprint must be " + to_string(FINGERPRINT_BYTES) + " bytes");
+    }
+    appendEntries(user_id, {{record_id, fingerprint}});
+    userPrints(user_id).by_record[record_id] = fingerprint;
+}
+
+void FingerprintIndex::setBatch(uint64_t user_id, const vector<pair<uint64_t, string>>& entries) {
+    for(const auto& entry : entries) {
+        if(entry.second.size() != FINGERPRINT_BYTES) {
+            throw runtime_error("Fingerprint must be " + to_string(FINGERPRINT_BYTES) + " bytes");
+        }
+    }
+    appendEntries(user_id, entries);
+    UserPrints& prints = userPrints(user_id);
+    for(const auto& entry : entries) {
+        prints.by_record[entry.first] = entry.second;
+    }
+}
+
+void FingerprintIndex::erase(uint64_t user_id, uint64_t record_id) {
+    UserPrints* prints = users.get(user_id);
+    if(!prints || prints->by_record.erase(record_id) == 0) return;
+    appendEntries(user_id, {{record_id, TOMBSTONE}});
+}
+
+bool FingerprintIndex::contains(uint64_t user_id, uint64_t record_id) {
+    UserPrints* prints = users.get(user_id);
+    return prints && prints->by_record.count(record_id) > 0;
+}
+
+// Group by fingerprint, keep the groups with more than one record
+vector<vector<uint64_t>> FingerprintIndex::duplicates(uint64_t user_id) {
+    vector<vector<uint64_t>> groups;
+    UserPrints* prints = users.get(user_id);
+    if(!prints) return groups;
+
+    unordered_map<string, vector<uint64_t>> by_fingerprint;
+    for(const auto& entry : prints->by_record) {
+        by_fingerprint[entry.second].push_back(entry.first);
+    }
+    for(auto& entry : by_fingerprint) {
+        if(entry.second.size() < 2) continue;
+        sort(entry.second.begin(), entry.second.end());
+        groups.push_back(move(entry.second));
+    }
+
+    // Biggest reuse first, then oldest record
+    sort(groups.begin(), groups.end(), [](const vector<uint64_t>& a, const vector<uint64_t>& b) {
+        if(a.size() != b.size()) return a.size() > b.size();
+        return a.front() < b.front();
+    });
+    return groups;
+}
@@ -0,0 +1,151 @@
+#include "mapped_file.hpp"
+#include <stdexcept>
+#ifdef _WIN32
+#include <fstream>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+// Smallest reservation - avoids remapping on every append to a small file
+static const size_t MIN_RESERVE = 1 << 20;
+
+MappedFile::MappedFile(const string& path, MapAccess access)
+    : path(path), access(access), fd(-1), inode(0), base(nullptr), reserved(0), length(0) {
+    refresh();
+}
+
+MappedFile::~MappedFile() {
+    close();
+}
+
+#ifdef _WIN32
+
+// Windows can't truncate or rename a file with a live view on it,
+// so read a private copy instead of mapping
+void MappedFile::refresh() {
+    ifstream file(path, ios::binary | ios::ate);
+    if(!file.is_open()) {
+        close();
+        return;
+    }
+    buffer.resize(static_cast<size_t>(file.tellg()));
+    file.seekg(0);
+    file.read(buffer.data(), buffer.size());
+    base = buffer.empty() ? nullptr : buffer.data();
+    length = buffer.size();
+}
+
+void MappedFile::reopen() {
+    refresh();
+}
+
+void MappedFile::advise(MapAccess, size_t, size_t) {
+}
+
+void MappedFile::map(size_t) {
+}
+
+void MappedFile::unmap() {
+}
+
+void MappedFile::close() {
+    buffer.clear();
+    base = nullptr;
+    length = 0;
+}
+
+#else
+
+static int adviceFor(MapAccess hint) {
+    switch(hint) {
+        case MapAccess::Sequential: return MADV_SEQUENTIAL;
+        case MapAccess::Random:     return MADV_RANDOM;
+        default:                    return MADV_NORMAL;
+    }
+}
+
+// Pick up appends, truncation, or the file appearing for the first time
+void MappedFile::refresh() {
+    if(fd < 0) {
+        fd = ::open(path.c_str(), O_RDONLY);
+        if(fd < 0) return;  // not created yet - stays empty
+    }
+
+    struct stat st;
+    if(::stat(path.c_str(), &st) != 0 || static_cast<uint64_t>(st.st_ino) != inode) {
+        // First open, or the path now names a different file
+        if(inode != 0) {
+            reopen();
+            return;
+        }
+        if(::fstat(fd, &st) != 0) {
+            throw runtime_error("Failed to stat " + path);
+        }
+        inode = static_cast<uint64_t>(st.st_ino);
+    }
+
+    size_t file_size = static_cast<size_t>(st.st_size);
+    if(file_size > reserved) {
+        map(file_size);
+    }
+    length = file_size;
+}
+
+// Drop everything and start over from the path
+void MappedFile::reopen() {
+    close();
+    refresh();
+}
+
+void MappedFile::advise(MapAccess hint, size_t offset, size_t range) {
+    if(!base) return;
+
+    // madvise wants a page-aligned start
+    size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    size_t start = offset - (offset % page);
+    size_t end = range == 0 ? reserved : min(reserved, offset + range);
+    if(start >= end) return;
+    madvise(base + start, end - start, adviceFor(hint));
+}
+
+// Reserve double what the file needs so appends don't remap each time
+void MappedFile::map(size_t file_size) {
+    unmap();
+
+    size_t want = max(MIN_RESERVE, file_size * 2);
+    void* p = mmap(nullptr, want, PROT_READ, MAP_SHARED, fd, 0);
+    if(p == MAP_FAILED) {
+        throw runtime_error("Failed to map " + path);
+    }
+
+    base = static_cast<char*>(p);
+    reserved = want;
+    if(access != MapAccess::Normal) {
+        madvise(base, reserved, adviceFor(access));
+    }
+}
+
+void MappedFile::unmap() {
+    if(base) {
+        munmap(base, reserved);
+    }
+    base = nullptr;
+    reserved = 0;
+    length = 0;
+}
+
+void MappedFile::close() {
+    unmap();
+    if(fd >= 0) {
+        ::close(fd);
+    }
+    fd = -1;
+    inode = 0;
+}
+
+#endif
@@ -0,0 +1,206 @@
+#include "record_cache.hpp"
+#include <algorithm>
+
+using namespace std;
+
+// Rough per-vault cost on top of the records: entry, list node, vector
+static const size_t ENTRY_OVERHEAD = 128;
+
+CachedVault::CachedVault(vector<VaultRecord> records) : count(records.size()) {
+    for(size_t i = 0; i < records.size(); i += CHUNK_RECORDS) {
+        size_t end = min(records.size(), i + CHUNK_RECORDS);
+        chunks.push_back(make_shared<const vector<VaultRecord>>(
+            make_move_iterator(records.begin() + i), make_move_iterator(records.begin() + end)));
+    }
+}
+
+size_t CachedVault::chunkFor(uint64_t record_id) const {
+    size_t lo = 0, hi = chunks.size();
+    while(lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if(chunks[mid]->back().record_id < record_id) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo == chunks.size() && lo > 0 ? lo - 1 : lo;
+}
+
+static bool idBefore(const VaultRecord& record, uint64_t record_id) {
+    return record.record_id < record_id;
+}
+
+const VaultRecord* CachedVault::find(uint64_t record_id) const {
+    if(chunks.empty()) return nullptr;
+    const vector<VaultRecord>& chunk = *chunks[chunkFor(record_id)];
+    auto it = lower_bound(chunk.begin(), chunk.end(), record_id, idBefore);
+    return it != chunk.end() && it->record_id == record_id ? &*it : nullptr;
+}
+
+vector<VaultRecord> CachedVault::toVector() const {
+    return vector<VaultRecord>(begin(), end());
+}
+
+CachedVault CachedVault::with(const VaultRecord& record) const {
+    CachedVault next = *this;
+    if(next.chunks.empty()) {
+        next.chunks.push_back(make_shared<const vector<VaultRecord>>(1, record));
+        next.count = 1;
+        return next;
+    }
+    
+    size_t i = chunkFor(record.record_id);
+    vector<VaultRecord> chunk = *chunks[i];
+    auto it = lower_bound(chunk.begin(), chunk.end(), record.record_id, idBefore);
+    if(it != chunk.end() && it->record_id == record.record_id) {
+        *it = record;
+    } else {
+        chunk.insert(it, record);
+        next.count++;
+    }
+    
+    // New ids land in the last chunk - split it once it's full
+    if(chunk.size() > CHUNK_RECORDS) {
+        vector<VaultRecord> upper(make_move_iterator(chunk.begin() + chunk.size() / 2),
+                                  make_move_iterator(chunk.end()));
+        chunk.resize(chunk.size() / 2);
+        next.chunks.insert(next.chunks.begin() + i + 1, make_shared<const vector<VaultRecord>>(move(upper)));
+    }
+    next.chunks[i] = make_shared<const vector<VaultRecord>>(move(chunk));
+    return next;
+}
+
+CachedVault CachedVault::without(uint64_t record_id) const {
+    const VaultRecord* existing = find(record_id);
+    if(!existing) return *this;
+    
+    CachedVault next = *this;
+    size_t i = chunkFor(record_id);
+    vector<VaultRecord> chunk = *chunks[i];
+    chunk.erase(lower_bound(chunk.begin(), chunk.end(), record_id, idBefore));
+    next.count--;
+    if(chunk.empty()) {
+        next.chunks.erase(next.chunks.begin() + i);
+    } else {
+        next.chunks[i] = make_shared<const vector<VaultRecord>>(move(chunk));
+    }
+    return next;
+}
+
+RecordCache::RecordCache(size_t budget_bytes)
+    : budget(budget_bytes), total_bytes(0), hits(0), misses(0), evictions(0) {
+}
+
+// What one record costs in memory - strings count by capacity, since
+// that's what the heap is holding
+size_t RecordCache::recordBytes(const VaultRecord& record) {
+    return sizeof(VaultRecord)
+        + record.site_name.capacity()
+        + record.username.capacity()
+        + record.encrypted_password.capacity()
+        + record.iv.capacity()
+        + record.notes.capacity()
+        + record.category.capacity();
+}
+
+void RecordCache::setBudget(size_t budget_bytes) {
+    lock_guard<mutex> lock(cache_mutex);
+    budget = budget_bytes;
+    evict();
+}
+
+RecordCache::Snapshot RecordCache::get(uint64_t user_id) {
+    lock_guard<mutex> lock(cache_mutex);
+    Entry* entry = entries.get(user_id);
+    if(!entry) {
+        misses++;
+        return nullptr;
+    }
+    hits++;
+    lru.splice(lru.begin(), lru, entry->lru_pos);
+    return entry->records;
+}
+
+RecordCache::Snapshot RecordCache::put(uint64_t user_id, vector<VaultRecord> records) {
+    size_t bytes = ENTRY_OVERHEAD;
+    for(const auto& record : records) {
+        bytes += recordBytes(record);
+    }
+    Snapshot snapshot = make_shared<const CachedVault>(move(records));
+
+    lock_guard<mutex> lock(cache_mutex);
+    store(user_id, snapshot, bytes);
+    return snapshot;
+}
+
+// Copy on write - readers may still be walking the old version
+void RecordCache::upsert(uint64_t user_id, const VaultRecord& record) {
+    lock_guard<mutex> lock(cache_mutex);
+    Entry* entry = entries.get(user_id);
+    if(!entry) return;
+
+    size_t bytes = entry->bytes + recordBytes(record);
+    const VaultRecord* existing = entry->records->find(record.record_id);
+    if(existing) bytes -= recordBytes(*existing);
+    store(user_id, make_shared<const CachedVault>(entry->records->with(record)), bytes);
+}
+
+void RecordCache::erase(uint64_t user_id, uint64_t record_id) {
+    lock_guard<mutex> lock(cache_mutex);
+    Entry* entry = entries.get(user_id);
+    if(!entry) return;
+
+    const VaultRecord* existing = entry->records->find(record_id);
+    if(!existing) return;
+    size_t bytes = entry->bytes - recordBytes(*existing);
+    store(user_id, make_shared<const CachedVault>(entry->records->without(record_id)), bytes);
+}
+
+void RecordCache::invalidate(uint64_t user_id) {
+    lock_guard<mutex> lock(cache_mutex);
+    Entry* entry = entries.get(user_id);
+    if(entry) drop(user_id, entry);
+}
+
+RecordCacheStats RecordCache::stats() const {
+    lock_guard<mutex> lock(cache_mutex);
+    RecordCacheStats s;
+    s.hits = hits;
+    s.misses = misses;
+    s.evictions = evictions;
+    s.users = lru.size();
+    s.bytes = total_bytes;
+    s.budget_bytes = budget;
+    return s;
+}
+
+// Insert or replace, then trim back under budget - caller holds cache_mutex
+void RecordCache::store(uint64_t user_id, Snapshot records, size_t bytes) {
+    Entry* entry = entries.get(user_id);
+    if(entry) {
+        total_bytes -= entry->bytes;
+        entry->records = move(records);
+        entry->bytes = bytes;
+        lru.splice(lru.begin(), lru, entry->lru_pos);
+    } else {
+        // One vault bigger than the whole budget would just flush everyone else
+        if(bytes > budget) return;
+        lru.push_front(user_id);
+        entries.put(user_id, Entry{move(records), bytes, lru.begin()});
+    }
+    total_bytes += bytes;
+    evict();
+}
+
+void RecordCache::drop(uint64_t user_id, Entry* entry) {
+    total_bytes -= entry->bytes;
+    lru.erase(entry->lru_pos);
+    entries.remove(user_id);
+}
+
+// Least recently used vaults go first
+void RecordCache::evict() {
+    while(total_bytes > budget && !lru.empty()) {
+        uint64_t user_id = lru.back();
+        drop(user_id, entries.get(user_id));
+        evictions++;
+    }
+}
@@ -0,0 +1,249 @@
+#define CPPHTTPLIB_NO_EXCEPTIONS
+#include <httplib.h>
+#include "replica.hpp"
+#include <iostream>
+#include <fstream>
+#include <filesystem>
+#include <stdexcept>
+
+using namespace std;
+
+// How long the primary holds a poll open when there's nothing new
+static const int POLL_WAIT_MS = 1000;
+// Entries asked for per poll
+static const size_t POLL_MAX_ENTRIES = 1000;
+// Between retries while the primary is unreachable
+static const chrono::milliseconds RETRY_DELAY(1000);
+// Tries at a backup to seed from while another backup holds the primary
+static const int BOOTSTRAP_ATTEMPTS = 60;
+
+// "host:port" -> parts
+static void splitAddress(const string& address, string& host, int& port) {
+    size_t colon = address.rfind(':');
+    if(colon == string::npos || colon == 0 || colon + 1 == address.size() ||
+       address.find_first_not_of("0123456789", colon + 1) != string::npos) {
+        throw runtime_error("Primary must be host:port, got '" + address + "'");
+    }
+    host = address.substr(0, colon);
+    port = stoi(address.substr(colon + 1));
+}
+
+static string logPath(const string& epoch, uint64_t since, int wait_ms, size_t max, const string& name) {
+    return "/api/replication/log?epoch=" + epoch + "&since=" + to_string(since) +
+           "&wait=" + to_string(wait_ms) + "&max=" + to_string(max) +
+           "&replica=" + httplib::encode_uri_component(name);
+}
+
+ReplicaFollower::ReplicaFollower(shared_ptr<StorageManager> storage, const string& primary,
+                                 const string& admin_token, const string& name)
+    : storage(storage), primary(primary), admin_token(admin_token), name(name), stopping(false),
+      applied_seq(0), primary_seq(0), connected(false), resync_needed(false), caught_up(false) {
+    splitAddress(primary, host, port);
+    if(!StorageManager::readReplicaPosition(storage->vaultFile(), epoch, applied_seq)) {
+        throw runtime_error("No replica position - bootstrap from the primary first");
+    }
+    primary_seq = applied_seq;
+}
+
+ReplicaFollower::~ReplicaFollower() {
+    {
+        lock_guard<mutex> lock(status_mutex);
+        stopping = true;
+    }
+    stop_signal.notify_all();
+    if(follower.joinable()) follower.join();
+}
+
+void ReplicaFollower::start() {
+    follower = thread(&ReplicaFollower::run, this);
+}
+
+bool ReplicaFollower::pause(chrono::milliseconds delay) {
+    unique_lock<mutex> lock(status_mutex);
+    return !stop_signal.wait_for(lock, delay, [this] { return stopping; });
+}
+
+void ReplicaFollower::run() {
+    httplib::Client cli(host, port);
+    cli.set_connection_timeout(2);
+    cli.set_read_timeout(POLL_WAIT_MS / 1000 + 10);
+    httplib::Headers headers = {{"Authorization", admin_token}};
+
+    string poll_epoch;
+    uint64_t since;
+    {
+        lock_guard<mutex> lock(status_mutex);
+        poll_epoch = epoch;
+        since = applied_seq;
+    }
+
+    while(true) {
+        {
+            lock_guard<mutex> lock(status_mutex);
+            if(stopping) return;
+        }
+
+        auto res = cli.Get(logPath(poll_epoch, since, POLL_WAIT_MS, POLL_MAX_ENTRIES, name), headers);
+        auto received_at = chrono::steady_clock::now();    // head was read just before the reply
+
+        if(res && res->status == 410) {
+            // Out of the log for good - a live vault can't be swapped under
+            // the server, so reseeding waits for a restart
+            {
+                lock_guard<mutex> lock(status_mutex);
+                connected = false;
+                resync_needed = true;
+            }
+            cerr << "  [ERROR] Replica is no longer in " << primary << "'s replication log "
+                 << "(primary restarted, or this replica fell more than replication_backlog behind) - "
+                 << "restart it to resync" << endl;
+            unique_lock<mutex> lock(status_mutex);
+            stop_signal.wait(lock, [this] { return stopping; });
+            return;
+        }
+
+        if(!res || res->status != 200) {
+            bool was_connected;
+            {
+                lock_guard<mutex> lock(status_mutex);
+                was_connected = connected;
+                connected = false;
+            }
+            if(was_connected) {
+                cerr << "  [ERROR] Lost primary " << primary << ": "
+                     << (res ? "HTTP " + to_string(res->status) : httplib::to_string(res.error())) << endl;
+            }
+            if(!pause(RETRY_DELAY)) return;
+            continue;
+        }
+
+        uint64_t head;
+        try {
+            vector<ReplicationEntry> entries = ReplicationLog::decode(res->body, head);
+            storage->applyReplicated(poll_epoch, entries);
+            if(!entries.empty()) since = entries.back().seq;
+        } catch(const exception& e) {
+            cerr << "  [ERROR] Replication apply failed: " << e.what() << endl;
+            {
+                lock_guard<mutex> lock(status_mutex);
+                connected = false;
+            }
+            if(!pause(RETRY_DELAY)) return;
+            continue;
+        }
+
+        lock_guard<mutex> lock(status_mutex);
+        if(!connected) {
+            cout << "  [INFO] Following primary " << primary << " from seq " << since << endl;
+        }
+        connected = true;
+        applied_seq = since;
+        primary_seq = head;
+
+        // Everything the primary had when a poll was answered is applied
+        // once that poll's head is - so staleness dates from the newest such poll
+        if(since >= head) {
+            heads.clear();
+            caught_up = true;
+            caught_up_at = received_at;
+        } else {
+            heads.emplace_back(head, received_at);
+            while(!heads.empty() && heads.front().first <= since) {
+                caught_up = true;
+                caught_up_at = heads.front().second;
+                heads.pop_front();
+            }
+        }
+    }
+}
+
+ReplicaStatus ReplicaFollower::status() const {
+    lock_guard<mutex> lock(status_mutex);
+    ReplicaStatus status;
+    status.primary = primary;
+    status.connected = connected;
+    status.resync_needed = resync_needed;
+    status.applied_seq = applied_seq;
+    status.primary_seq = max(primary_seq, applied_seq);
+    status.lag_seconds = caught_up
+        ? chrono::duration<double>(chrono::steady_clock::now() - caught_up_at).count()
+        : -1.0;
+    return status;
+}
+
+bool ReplicaFollower::withinLag(time_t max_lag_sec) const {
+    lock_guard<mutex> lock(status_mutex);
+    return caught_up && chrono::steady_clock::now() - caught_up_at <= chrono::seconds(max_lag_sec);
+}
+
+bool ReplicaFollower::bootstrap(const string& primary, const string& admin_token,
+                                const string& vault_file, const string& users_file) {
+    string host;
+    int port;
+    splitAddress(primary, host, port);
+    httplib::Client cli(host, port);
+    cli.set_connection_timeout(2);
+    httplib::Headers headers = {{"Authorization", admin_token}};
+
+    // A saved position the primary still has - just catch up from it
+    string epoch;
+    uint64_t seq;
+    if(StorageManager::readReplicaPosition(vault_file, epoch, seq)) {
+        auto res = cli.Get(logPath(epoch, seq, 0, 0, ""), headers);
+        if(!res) {
+            cerr << "  [WARN] Primary " << primary << " unreachable, starting from the local copy" << endl;
+            return false;
+        }
+        if(res->status == 200) return false;
+        if(res->status != 410) {
+            throw runtime_error("Primary refused the replication check: HTTP " + to_string(res->status));
+        }
+    }
+
+    // Otherwise a fresh copy. The archive carries the log position it was
+    // taken at, so following resumes exactly where it ends
+    string archive = vault_file + ".bootstrap";
+    for(int attempt = 1; ; attempt++) {
+        int status = 0;
+        ofstream out(archive, ios::binary | ios::trunc);
+        if(!out.is_open()) {
+            throw runtime_error("Failed to open " + archive + " for writing");
+        }
+        auto res = cli.Get("/api/admin/backup", headers,
+            [&status](const httplib::Response& response) {
+                status = response.status;
+                return response.status == 200;
+            },
+            [&out](const char* data, size_t length) {
+                out.write(data, length);
+                return static_cast<bool>(out);
+            });
+        out.close();
+        if(res && status == 200 && out) break;
+        
+        error_code ec;
+        filesystem::remove(archive, ec);
+        // 409 - another backup is running, likely a replica seeding alongside
+        if(status == 409 && attempt < BOOTSTRAP_ATTEMPTS) {
+            this_thread::sleep_for(RETRY_DELAY);
+            continue;
+        }
+        throw runtime_error("Failed to download a backup from " + primary + ": " +
+                            (status != 0 ? "HTTP " + to_string(status) : httplib::to_string(res.error())));
+    }
+
+    try {
+        StorageManager::restoreBackup(archive, vault_file, users_file);
+    } catch(...) {
+        error_code ec;
+        filesystem::remove(archive, ec);
+        throw;
+    }
+    error_code ec;
+    filesystem::remove(archive, ec);
+
+    if(!StorageManager::readReplicaPosition(vault_file, epoch, seq)) {
+        throw runtime_error("Primary " + primary + " has replication off (replication_backlog = 0)");
+    }
+    return true;
+}
@@ -0,0 +1,204 @@
+#include "replication.hpp"
+#include <random>
+#include <cstring>
+#include <sstream>
+#include <iomanip>
+#include <stdexcept>
+#include <algorithm>
+
+using namespace std;
+
+// New every start - a replica's position is meaningless to any other
+// run of the primary, since the log starts empty
+static string generateEpoch() {
+    random_device rd;
+    uint64_t value = (static_cast<uint64_t>(rd()) << 32) ^ rd() ^ static_cast<uint64_t>(time(nullptr));
+    ostringstream ss;
+    ss << hex << setw(16) << setfill('0') << value;
+    return ss.str();
+}
+
+ReplicationLog::ReplicationLog(size_t capacity)
+    : log_epoch(generateEpoch()), capacity(capacity), last_seq(0) {
+}
+
+void ReplicationLog::setCapacity(size_t entries_max) {
+    lock_guard<mutex> lock(log_mutex);
+    capacity = entries_max;
+    while(entries.size() > capacity) entries.pop_front();
+}
+
+bool ReplicationLog::enabled() const {
+    lock_guard<mutex> lock(log_mutex);
+    return capacity > 0;
+}
+
+void ReplicationLog::append(vector<ReplicationEntry>& batch) {
+    lock_guard<mutex> lock(log_mutex);
+    if(capacity == 0) return;
+    for(auto& entry : batch) {
+        entry.seq = ++last_seq;
+        entries.push_back(entry);
+    }
+    while(entries.size() > capacity) entries.pop_front();
+    appended.notify_all();
+}
+
+bool ReplicationLog::since(uint64_t since, size_t max, chrono::milliseconds wait, vector<ReplicationEntry>& out) {
+    unique_lock<mutex> lock(log_mutex);
+    if(capacity == 0 || since > last_seq) return false;
+    if(since < last_seq && (entries.empty() || entries.front().seq > since + 1)) return false;
+
+    // Caught up - hold the poll open until something is written
+    if(since == last_seq && wait.count() > 0) {
+        appended.wait_for(lock, wait, [this, since] { return last_seq > since || capacity == 0; });
+        if(capacity == 0) return false;
+        if(!entries.empty() && entries.front().seq > since + 1) return false;   // lapped while waiting
+    }
+    if(since == last_seq) return true;
+
+    // Seqs are contiguous, so the first one wanted is at a known index
+    size_t start = static_cast<size_t>(since + 1 - entries.front().seq);
+    size_t end = min(entries.size(), start + max);
+    out.insert(out.end(), entries.begin() + start, entries.begin() + end);
+    return true;
+}
+
+uint64_t ReplicationLog::lastSeq() const {
+    lock_guard<mutex> lock(log_mutex);
+    return last_seq;
+}
+
+size_t ReplicationLog::size() const {
+    lock_guard<mutex> lock(log_mutex);
+    return entries.size();
+}
+
+void ReplicationLog::noteReplica(const string& name, uint64_t acked_seq) {
+    lock_guard<mutex> lock(log_mutex);
+    replicas[name] = {name, acked_seq, time(nullptr)};
+}
+
+vector<ReplicaInfo> ReplicationLog::replicaList() const {
+    lock_guard<mutex> lock(log_mutex);
+    vector<ReplicaInfo> list;
+    for(const auto& replica : replicas) {
+        list.push_back(replica.second);
+    }
+    return list;
+}
+
+// Helpers: fixed-size numbers and length-prefixed strings
+
+static void putNumber(uint64_t value, string& out) {
+    out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+static void putString(const string& value, string& out) {
+    putNumber(value.size(), out);
+    out += value;
+}
+
+static uint64_t getNumber(const string& data, size_t& pos) {
+    if(data.size() - pos < sizeof(uint64_t)) {
+        throw runtime_error("Replication data is truncated");
+    }
+    uint64_t value;
+    memcpy(&value, data.data() + pos, sizeof(value));
+    pos += sizeof(value);
+    return value;
+}
+
+static string getString(const string& data, size_t& pos) {
+    uint64_t length = getNumber(data, pos);
+    if(data.size() - pos < length) {
+        throw runtime_error("Replication data is truncated");
+    }
+    string value = data.substr(pos, length);
+    pos += length;
+    return value;
+}
+
+void ReplicationLog::encode(uint64_t head_seq, const vector<ReplicationEntry>& entries, string& out) {
+    putNumber(head_seq, out);
+    for(const auto& entry : entries) {
+        putNumber(entry.seq, out);
+        out += static_cast<char>(entry.op);
+        putNumber(entry.changed_at, out);
+
+        if(entry.op == ReplicationOp::User) {
+            const User& user = entry.user;
+            putNumber(user.user_id, out);
+            putString(user.email, out);
+            putString(user.password_hash, out);
+            putString(user.salt, out);
+            putString(user.recovery_phrase, out);
+            putString(user.encryption_key, out);
+            putNumber(user.created_at, out);
+        } else {
+            const VaultRecord& record = entry.record;
+            putNumber(entry.change_seq, out);
+            putNumber(record.record_id, out);
+            putNumber(record.user_id, out);
+            if(entry.op == ReplicationOp::Delete) continue;
+            putString(record.site_name, out);
+            putString(record.username, out);
+            putString(record.encrypted_password, out);
+            putString(record.iv, out);
+            putString(record.notes, out);
+            putString(record.category, out);
+            putNumber(record.created_at, out);
+            putNumber(record.modified_at, out);
+            putString(entry.fingerprint, out);
+        }
+    }
+}
+
+vector<ReplicationEntry> ReplicationLog::decode(const string& data, uint64_t& head_seq) {
+    size_t pos = 0;
+    head_seq = getNumber(data, pos);
+
+    vector<ReplicationEntry> entries;
+    while(pos < data.size()) {
+        ReplicationEntry entry;
+        entry.seq = getNumber(data, pos);
+        if(pos >= data.size()) {
+            throw runtime_error("Replication data is truncated");
+        }
+        uint8_t op = static_cast<uint8_t>(data[pos++]);
+        if(op < static_cast<uint8_t>(ReplicationOp::Insert) || op > static_cast<uint8_t>(ReplicationOp::User)) {
+            throw runtime_error("Unknown replication op " + to_string(op));
+        }
+        entry.op = static_cast<ReplicationOp>(op);
+        entry.changed_at = getNumber(data, pos);
+
+        if(entry.op == ReplicationOp::User) {
+            User& user = entry.user;
+            user.user_id = getNumber(data, pos);
+            user.email = getString(data, pos);
+            user.password_hash = getString(data, pos);
+            user.salt = getString(data, pos);
+            user.recovery_phrase = getString(data, pos);
+            user.encryption_key = getString(data, pos);
+            user.created_at = getNumber(data, pos);
+        } else {
+            VaultRecord& record = entry.record;
+            entry.change_seq = getNumber(data, pos);
+            record.record_id = getNumber(data, pos);
+            record.user_id = getNumber(data, pos);
+            if(entry.op != ReplicationOp::Delete) {
+                record.site_name = getString(data, pos);
+                record.username = getString(data, pos);
+                record.encrypted_password = getString(data, pos);
+                record.iv = getString(data, pos);
+                record.notes = getString(data, pos);
+                record.category = getString(data, pos);
+                record.created_at = getNumber(data, pos);
+                record.modified_at = getNumber(data, pos);
+                entry.fingerprint = getString(data, pos);
+            }
+        }
+        entries.push_back(move(entry));
+    }
+    return entries;
+}
@@ -1,9 +1,17 @@
 // Disable memory-mapped files in httplib for MinGW compatibility
 #define CPPHTTPLIB_NO_EXCEPTIONS
+// httplib only takes the accept backlog as a macro - point it at the config value
+static int listen_backlog = 5;
+#define CPPHTTPLIB_LISTEN_BACKLOG listen_backlog
 #include <httplib.h>
 #include <json.hpp>
 #include "storage.hpp"
+#include "wire.hpp"
+#include "config.hpp"
+#include "vault_transfer.hpp"
+#include "replica.hpp"
 #include <iostream>
+#include <filesystem>
 #include <memory>
 #include <ctime>
 
@@ -22,7 +30,143 @@ void log_request(const std::string& method, const std::string& path, int status)
     std::cout << "[" << timestr << "] " << method << " " << path << " - " << status << std::endl;
 }
 
-int main() {
+// Reply in the format the client asked for via Accept
+// Small control responses go through the json DOM - record lists use Wire directly
+void send_response(const Request& req, Response& res, const json& body) {
+    WireFormat format = Wire::negotiate(req.get_header_value("Accept"));
+    
+    if (format == WireFormat::MsgPack) {
+        std::vector<uint8_t> bytes = json::to_msgpack(body);
+        res.set_content(std::string(bytes.begin(), bytes.end()), Wire::contentType(format));
+    } else if (format == WireFormat::Cbor) {
+        std::vector<uint8_t> bytes = json::to_cbor(body);
+        res.set_content(std::string(bytes.begin(), bytes.end()), Wire::contentType(format));
+    } else {
+        res.set_content(body.dump(), "application/json");
+    }
+}
+
+// Decode a request body according to its Content-Type
+json parse_body(const Request& req) {
+    switch (Wire::fromContentType(req.get_header_value("Content-Type"))) {
+        case WireFormat::MsgPack: return json::from_msgpack(req.body);
+        case WireFormat::Cbor:    return json::from_cbor(req.body);
+        default:                  return json::parse(req.body);
+    }
+}
+
+// Unsigned query parameter. Anything but digits that fit in 64 bits throws
+// invalid_argument, which the handlers answer with 400
+uint64_t number_param(const Request& req, const std::string& name) {
+    std::string value = req.get_param_value(name);
+    if (value.empty() || value.find_first_not_of("0123456789") != std::string::npos) {
+        throw std::invalid_argument("Invalid " + name);
+    }
+    try {
+        return std::stoull(value);
+    } catch (const std::out_of_range&) {
+        throw std::invalid_argument("Invalid " + name);
+    }
+}
+
+// Import/export format from ?format=, falling back to the Content-Type -
+// false if the name isn't one we know
+bool transfer_format(const Request& req, TransferFormat& format) {
+    std::string name = req.has_param("format") ? req.get_param_value("format") : "";
+    if (name.empty()) {
+        format = req.get_header_value("Content-Type").find("csv") != std::string::npos
+                 ? TransferFormat::Csv : TransferFormat::Json;
+        return true;
+    }
+    if (name == "csv") {
+        format = TransferFormat::Csv;
+    } else if (name == "json") {
+        format = TransferFormat::Json;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// Admin endpoints are off without a token; compare without an early exit
+bool is_admin(const Request& req, const std::string& admin_token) {
+    std::string token = req.get_header_value("Authorization");
+    if (admin_token.empty() || token.size() != admin_token.size()) return false;
+    unsigned char diff = 0;
+    for (size_t i = 0; i < token.size(); i++) {
+        diff |= static_cast<unsigned char>(token[i] ^ admin_token[i]);
+    }
+    return diff == 0;
+}
+
+// Reply with one page of records and the cursor for the next (null on the last)
+void send_page(const Request& req, Response& res, const VaultPage& page) {
+    WireFormat format = Wire::negotiate(req.get_header_value("Accept"));
+    std::string body;
+    if (format == WireFormat::Json) {
+        body = "{\"success\":true,\"passwords\":[";
+        for (size_t i = 0; i < page.records.size(); i++) {
+            if (i > 0) body += ',';
+            Wire::appendRecord(format, page.records[i], body);
+        }
+        body += "],\"nextCursor\":";
+        if (page.next_cursor.empty()) {
+            body += "null";
+        } else {
+            Wire::appendJsonString(page.next_cursor, body);
+        }
+        body += '}';
+    } else {
+        Wire::appendMapHeader(format, 3, body);
+        Wire::appendString(format, "success", body);
+        Wire::appendBool(format, true, body);
+        Wire::appendString(format, "passwords", body);
+        Wire::appendArrayHeader(format, page.records.size(), body);
+        for (const auto& pwd : page.records) {
+            Wire::appendRecord(format, pwd, body);
+        }
+        Wire::appendString(format, "nextCursor", body);
+        if (page.next_cursor.empty()) {
+            Wire::appendNull(format, body);
+        } else {
+            Wire::appendString(format, page.next_cursor, body);
+        }
+    }
+    res.set_content(body, Wire::contentType(format));
+}
+
+// Flush the stream buffer to the client once it gets this big
+const size_t STREAM_CHUNK_SIZE = 16 * 1024;
+
+// Autocomplete page size when limit= isn't given, and the most it may ask for
+const size_t SEARCH_DEFAULT_LIMIT = 10;
+const size_t SEARCH_MAX_LIMIT = 100;
+
+// Same for paged listing (GET /api/passwords?limit=)
+const size_t LIST_DEFAULT_LIMIT = 100;
+const size_t LIST_MAX_LIMIT = 1000;
+
+// Replication polls: entries per reply, and the longest a poll is held open
+const size_t REPLICATION_DEFAULT_BATCH = 1000;
+const size_t REPLICATION_MAX_BATCH = 10000;
+const uint64_t REPLICATION_MAX_WAIT_MS = 30000;
+
+int main(int argc, char* argv[]) {
+    for (int i = 1; i < argc; i++) {
+        if (std::string(argv[i]) == "--help" || std::string(argv[i]) == "-h") {
+            std::cout << ConfigLoader::usage();
+            return 0;
+        }
+    }
+    
+    ServerConfig config;
+    try {
+        config = ConfigLoader::load(argc, argv);
+    } catch (const std::exception& e) {
+        std::cerr << "  [ERROR] " << e.what() << "\n\n" << ConfigLoader::usage();
+        return 1;
+    }
+    
     Server svr;
     
     std::cout << "\n============================================================\n";
@@ -30,41 +174,202 @@ int main() {
     std::cout << "============================================================\n";
     std::cout << "  Initializing server...\n";
     
+    // Runtime tuning
+    size_t worker_threads = config.worker_threads > 0 ? config.worker_threads : CPPHTTPLIB_THREAD_POOL_COUNT;
+    size_t max_queued = config.max_queued_requests;
+    svr.new_task_queue = [worker_threads, max_queued] {
+        return new ThreadPool(worker_threads, max_queued);
+    };
+    listen_backlog = config.listen_backlog;
+    svr.set_tcp_nodelay(config.tcp_nodelay);
+    svr.set_keep_alive_max_count(config.keep_alive_max_count);
+    svr.set_keep_alive_timeout(config.keep_alive_timeout_sec);
+    svr.set_read_timeout(config.read_timeout_sec, 0);
+    svr.set_write_timeout(config.write_timeout_sec, 0);
+    svr.set_payload_max_length(config.max_payload_bytes);
+    
     // Initialize storage manager
-    auto storage = std::make_shared<StorageManager>("data/vault.dat", "data/users.dat");
+    std::error_code ec;
+    std::filesystem::create_directories(config.data_dir, ec);
+    if (!config.restore_from.empty()) {
+        try {
+            uint64_t bytes = StorageManager::restoreBackup(config.restore_from, config.vaultFile(), config.usersFile());
+            std::cout << "  Restored " << bytes << " bytes from " << config.restore_from << "\n";
+        } catch (const std::exception& e) {
+            std::cerr << "  [ERROR] Restore failed: " << e.what() << std::endl;
+            return 1;
+        }
+    }
+    if (!config.replicate_from.empty()) {
+        if (config.admin_token.empty() || config.replication_backlog > 0) {
+            std::cerr << "  [ERROR] A replica needs admin_token (the primary's) and no replication_backlog" << std::endl;
+            return 1;
+        }
+        try {
+            if (ReplicaFollower::bootstrap(config.replicate_from, config.admin_token,
+                                           config.vaultFile(), config.usersFile())) {
+                std::cout << "  Seeded from a backup of " << config.replicate_from << "\n";
+            }
+        } catch (const std::exception& e) {
+            std::cerr << "  [ERROR] Replica bootstrap failed: " << e.what() << std::endl;
+            return 1;
+        }
+    }
+    std::shared_ptr<StorageManager> storage;
+    try {
+        storage = std::make_shared<StorageManager>(config.vaultFile(), config.usersFile(), config.vault_shards);
+    } catch (const std::exception& e) {
+        std::cerr << "  [ERROR] " << e.what() << std::endl;
+        return 1;
+    }
+    storage->setReplicationBacklog(config.replication_backlog);
+    
+    // Replicas replay the primary's writes and take none of their own
+    std::shared_ptr<ReplicaFollower> replica;
+    if (!config.replicate_from.empty()) {
+        replica = std::make_shared<ReplicaFollower>(storage, config.replicate_from, config.admin_token,
+                                                    config.host + ":" + std::to_string(config.port));
+        replica->start();
+        
+        time_t max_lag = config.replica_max_lag_sec;
+        svr.set_pre_routing_handler([replica, max_lag](const Request& req, Response& res) {
+            if (req.method == "OPTIONS" || req.path == "/api/health") {
+                return Server::HandlerResponse::Unhandled;
+            }
+            if (req.method != "GET" && req.path != "/api/login") {
+                json response = {{"success", false}, {"message", "Read-only replica - send writes to the primary"}};
+                send_response(req, res, response);
+                res.status = 403;
+                log_request(req.method, req.path, 403);
+                return Server::HandlerResponse::Handled;
+            }
+            if (max_lag > 0 && !replica->withinLag(max_lag)) {
+                json response = {{"success", false}, {"message", "Replica is too far behind the primary"}};
+                send_response(req, res, response);
+                res.set_header("Retry-After", "1");
+                res.status = 503;
+                log_request(req.method, req.path, 503);
+                return Server::HandlerResponse::Handled;
+            }
+            return Server::HandlerResponse::Unhandled;
+        });
+    }
+    
+    CompactionSettings compaction;
+    compaction.threshold = config.compaction_threshold_percent / 100.0;
+    compaction.rate_bytes_per_sec = config.compaction_rate;
+    compaction.check_interval_sec = static_cast<uint64_t>(config.compaction_interval_sec);
+    storage->startCompaction(compaction);
+    storage->setRecordCacheBudget(config.record_cache_bytes);
+    storage->setSearchIndexBudget(config.search_index_bytes);
+    if (!config.breach_corpus.empty()) {
+        try {
+            storage->loadBreachCorpus(config.breach_corpus);
+        } catch (const std::exception& e) {
+            std::cerr << "  [ERROR] " << e.what() << std::endl;
+            return 1;
+        }
+    }
     
     // CORS headers
     svr.set_default_headers({
         {"Access-Control-Allow-Origin", "*"},
         {"Access-Control-Allow-Methods", "GET, POST, PUT, DELETE, OPTIONS"},
-        {"Access-Control-Allow-Headers", "Content-Type, Authorization, X-Username"}
+        {"Access-Control-Allow-Headers", "Content-Type, Accept, Authorization, X-Username"}
     });
     
     // Handle OPTIONS requests for CORS preflight
     svr.Options(".*", [](const Request&, Response& res) {
         res.set_header("Access-Control-Allow-Origin", "*");
         res.set_header("Access-Control-Allow-Methods", "GET, POST, PUT, DELETE, OPTIONS");
-        res.set_header("Access-Control-Allow-Headers", "Content-Type, Authorization, X-Username");
+        res.set_header("Access-Control-Allow-Headers", "Content-Type, Accept, Authorization, X-Username");
         res.status = 200;
     });
     
     // Health check endpoint
-    svr.Get("/api/health", [](const Request& req, Response& res) {
+    svr.Get("/api/health", [storage, replica](const Request& req, Response& res) {
+        StorageStats stats = storage->getStorageStats();
+        CompactionStatus compaction = storage->getCompactionStatus();
+        RecordCacheStats cache = storage->getRecordCacheStats();
+        TrigramIndexStats search = storage->getSearchIndexStats();
         json response = {{"status", "ok"}, {"server", "Password Vault API"}};
-        res.set_content(response.dump(), "application/json");
+        response["storage"] = {
+            {"shards", storage->shardCount()},
+            {"recordFileBytes", stats.record_file_bytes},
+            {"deadRecordBytes", stats.dead_record_bytes},
+            {"indexFileBytes", stats.node_file_bytes},
+            {"freeIndexBytes", stats.free_node_bytes},
+            {"fragmentation", stats.fragmentation()},
+            {"compaction", {
+                {"running", compaction.running},
+                {"bytesCopied", compaction.bytes_copied},
+                {"bytesToCopy", compaction.bytes_to_copy},
+                {"runs", compaction.runs},
+                {"lastReclaimedBytes", compaction.last_reclaimed_bytes},
+                {"totalReclaimedBytes", compaction.total_reclaimed_bytes}
+            }}
+        };
+        response["recordCache"] = {
+            {"hits", cache.hits},
+            {"misses", cache.misses},
+            {"hitRatio", cache.hitRatio()},
+            {"evictions", cache.evictions},
+            {"users", cache.users},
+            {"bytes", cache.bytes},
+            {"budgetBytes", cache.budget_bytes}
+        };
+        response["searchIndex"] = {
+            {"users", search.users},
+            {"bytes", search.bytes},
+            {"budgetBytes", search.budget_bytes},
+            {"evictions", search.evictions}
+        };
+        ReplicationLog& log = storage->replicationLog();
+        if (replica) {
+            ReplicaStatus status = replica->status();
+            response["replication"] = {
+                {"role", "replica"},
+                {"primary", status.primary},
+                {"connected", status.connected},
+                {"resyncNeeded", status.resync_needed},
+                {"appliedSeq", status.applied_seq},
+                {"primarySeq", status.primary_seq},
+                {"lagEntries", status.primary_seq - status.applied_seq},
+                {"lagSeconds", status.lag_seconds < 0 ? json(nullptr) : json(status.lag_seconds)}
+            };
+        } else if (log.enabled()) {
+            uint64_t seq = log.lastSeq();
+            json replicas = json::array();
+            for (const auto& info : log.replicaList()) {
+                replicas.push_back({
+                    {"name", info.name},
+                    {"ackedSeq", info.acked_seq},
+                    {"lagEntries", seq > info.acked_seq ? seq - info.acked_seq : 0},
+                    {"lastSeenSecondsAgo", time(nullptr) - info.last_seen}
+                });
+            }
+            response["replication"] = {
+                {"role", "primary"},
+                {"epoch", log.epoch()},
+                {"seq", seq},
+                {"backlogEntries", log.size()},
+                {"replicas", replicas}
+            };
+        }
+        send_response(req, res, response);
         log_request("GET", req.path, 200);
     });
     
     // Register endpoint
     svr.Post("/api/register", [storage](const Request& req, Response& res) {
         try {
-            auto body = json::parse(req.body);
+            auto body = parse_body(req);
             std::string username = body["username"];
             std::string password = body["password"];
             
             if (username.empty() || password.empty()) {
                 json response = {{"success", false}, {"message", "Username and password required"}};
-                res.set_content(response.dump(), "application/json");
+                send_response(req, res, response);
                 res.status = 400;
                 log_request("POST", req.path, 400);
                 return;
@@ -74,18 +379,18 @@ int main() {
             
             if (user_id > 0) {
                 json response = {{"success", true}, {"message", "Registration successful"}};
-                res.set_content(response.dump(), "application/json");
+                send_response(req, res, response);
                 log_request("POST", req.path, 200);
                 std::cout << "  [INFO] User registered: " << username << std::endl;
             } else {
                 json response = {{"success", false}, {"message", "Username already exists"}};
-                res.set_content(response.dump(), "application/json");
+                send_response(req, res, response);
                 res.status = 400;
                 log_request("POST", req.path, 400);
             }
         } catch (const std::exception& e) {
             json response = {{"success", false}, {"message", "Server error"}};
-            res.set_content(response.dump(), "application/json");
+            send_response(req, res, response);
             res.status = 500;
             log_request("POST", req.path, 500);
             std::cerr << "  [ERROR] Registration failed: " << e.what() << std::endl;
@@ -95,13 +400,13 @@ int main() {
     // Login endpoint
     svr.Post("/api/login", [storage](const Request& req, Response& res) {
         try {
-            auto body = json::parse(req.body);
+            auto body = parse_body(req);
             std::string username = body["username"];
             std::string password = body["password"];
             
             if (username.empty() || password.empty()) {
                 json response = {{"success", false}, {"message", "Username and password required"}};
-                res.set_content(response.dump(), "application/json");
+                send_response(req, res, response);
                 res.status = 400;
                 log_request("POST", req.path, 400);
                 return;
@@ -111,18 +416,18 @@ int main() {
             
             if (!token.empty()) {
                 json response = {{"success", true}, {"sessionToken", token}};
-                res.set_content(response.dump(), "application/json");
+                send_response(req, res, response);
                 log_request("POST", req.path, 200);
                 std::cout << "  [INFO] User logged in: " << username << std::endl;
             } else {
                 json response = {{"success", false}, {"message", "Invalid credentials"}};
-                res.set_content(response.dump(), "application/json");
+                send_response(req, res, response);
                 res.status = 401;
                 log_request("POST", req.path, 401);
             }
         } catch (const std::exception& e) {
             json response = {{"success", false}, {"message", "Server error"}};
-            res.set_content(response.dump(), "application/json");
+            send_response(req, res, response);
             res.status = 500;
             log_request("POST", req.path, 500);
             std::cerr << "  [ERROR] Login failed: " << e.what() << std::endl;
@@ -135,7 +440,7 @@ int main() {
         
         if (token.empty()) {
             json response = {{"success", false}, {"message", "Unauthorized"}};
-            res.set_content(response.dump(), "application/json");
+            send_response(req, res, response);
             res.status = 401;
             log_request("GET", req.path, 401);
             return;
@@ -146,47 +451,468 @@ int main() {
             
             if (user_id == 0) {
                 json response = {{"success", false}, {"message", "Invalid session"}};
-                res.set_content(response.dump(), "application/json");
+                send_response(req, res, response);
                 res.status = 401;
                 log_request("GET", req.path, 401);
                 return;
             }
             
-            auto passwords = storage->getUserVault(user_id);
+            // limit=, cursor=, category= or sort= asks for one page at a time,
+            // in record id order or with sort=modified newest first
+            if (req.has_param("limit") || req.has_param("cursor") || req.has_param("category") ||
+                req.has_param("sort")) {
+                size_t limit = LIST_DEFAULT_LIMIT;
+                if (req.has_param("limit")) {
+                    limit = number_param(req, "limit");
+                    limit = std::max<size_t>(1, std::min(limit, LIST_MAX_LIMIT));
+                }
+                VaultOrder order = VaultOrder::ById;
+                std::string sort = req.get_param_value("sort");
+                if (sort == "modified") {
+                    order = VaultOrder::ByModified;
+                } else if (!sort.empty() && sort != "id") {
+                    throw std::invalid_argument("Unknown sort");
+                }
+                VaultPage page = storage->getVaultPage(user_id, limit, req.get_param_value("cursor"),
+                                                       req.get_param_value("category"), order);
+                send_page(req, res, page);
+                log_request("GET", req.path, 200);
+                return;
+            }
+            
+            WireFormat format = Wire::negotiate(req.get_header_value("Accept"));
+            std::string path = req.path;
             
-            json pwd_array = json::array();
-            for (const auto& pwd : passwords) {
-                json pwd_obj;
-                pwd_obj["id"] = std::to_string(pwd.record_id);
-                pwd_obj["site"] = pwd.site_name;
-                pwd_obj["username"] = pwd.username;
-                pwd_obj["password"] = pwd.encrypted_password;
-                pwd_obj["category"] = pwd.category;
-                pwd_obj["notes"] = pwd.notes;
-                pwd_array.push_back(pwd_obj);
+            // MessagePack needs the array length up front - encode straight
+            // from the records into one buffer, still without a json DOM
+            if (format == WireFormat::MsgPack) {
+                std::string records;
+                uint64_t count = 0;
+                storage->forEachVaultEntry(user_id, [&](const VaultRecord& pwd) {
+                    Wire::appendRecord(format, pwd, records);
+                    count++;
+                    return true;
+                });
+                
+                std::string body;
+                Wire::appendMapHeader(format, 2, body);
+                Wire::appendString(format, "success", body);
+                Wire::appendBool(format, true, body);
+                Wire::appendString(format, "passwords", body);
+                Wire::appendArrayHeader(format, count, body);
+                body += records;
+                res.set_content(body, Wire::contentType(format));
+                log_request("GET", path, 200);
+                return;
             }
             
-            json response;
-            response["success"] = true;
-            response["passwords"] = pwd_array;
-            res.set_content(response.dump(), "application/json");
-            log_request("GET", req.path, 200);
+            // JSON and CBOR (indefinite-length array) stream records as they
+            // are read and decrypted - memory stays at one chunk
+            res.set_chunked_content_provider(Wire::contentType(format),
+                [storage, user_id, path, format](size_t, DataSink& sink) {
+                    std::string buffer;
+                    if (format == WireFormat::Cbor) {
+                        Wire::appendMapHeader(format, 2, buffer);
+                        Wire::appendString(format, "success", buffer);
+                        Wire::appendBool(format, true, buffer);
+                        Wire::appendString(format, "passwords", buffer);
+                        Wire::appendIndefiniteArray(buffer);
+                    } else {
+                        buffer = "{\"success\":true,\"passwords\":[";
+                    }
+                    bool first = true;
+                    bool client_alive = true;
+                    
+                    try {
+                        storage->forEachVaultEntry(user_id, [&](const VaultRecord& pwd) {
+                            if (format == WireFormat::Json && !first) buffer += ',';
+                            first = false;
+                            Wire::appendRecord(format, pwd, buffer);
+                            
+                            if (buffer.size() >= STREAM_CHUNK_SIZE) {
+                                client_alive = sink.write(buffer.data(), buffer.size());
+                                buffer.clear();
+                            }
+                            return client_alive;
+                        });
+                    } catch (const std::exception& e) {
+                        // Headers are already out, all we can do is cut the response short
+                        std::cerr << "  [ERROR] Get passwords failed: " << e.what() << std::endl;
+                        log_request("GET", path, 500);
+                        return false;
+                    }
+                    
+                    if (!client_alive) return false;
+                    
+                    if (format == WireFormat::Cbor) {
+                        Wire::appendBreak(buffer);
+                    } else {
+                        buffer += "]}";
+                    }
+                    sink.write(buffer.data(), buffer.size());
+                    sink.done();
+                    log_request("GET", path, 200);
+                    return true;
+                });
+        } catch (const std::invalid_argument& e) {
+            json response = {{"success", false}, {"message", "Invalid limit, cursor or sort"}};
+            send_response(req, res, response);
+            res.status = 400;
+            log_request("GET", req.path, 400);
         } catch (const std::exception& e) {
             json response = {{"success", false}, {"message", "Server error"}};
-            res.set_content(response.dump(), "application/json");
+            send_response(req, res, response);
             res.status = 500;
             log_request("GET", req.path, 500);
             std::cerr << "  [ERROR] Get passwords failed: " << e.what() << std::endl;
         }
     });
     
+    // Categories in use with counts - from the category index, no record reads
+    svr.Get("/api/categories", [storage](const Request& req, Response& res) {
+        std::string token = req.get_header_value("Authorization");
+        
+        if (token.empty()) {
+            json response = {{"success", false}, {"message", "Unauthorized"}};
+            send_response(req, res, response);
+            res.status = 401;
+            log_request("GET", req.path, 401);
+            return;
+        }
+        
+        try {
+            uint64_t user_id = storage->validateSession(token);
+            
+            if (user_id == 0) {
+                json response = {{"success", false}, {"message", "Invalid session"}};
+                send_response(req, res, response);
+                res.status = 401;
+                log_request("GET", req.path, 401);
+                return;
+            }
+            
+            json categories = json::array();
+            for (const auto& category : storage->getCategories(user_id)) {
+                categories.push_back({{"name", category.name}, {"count", category.count}});
+            }
+            
+            json response = {{"success", true}, {"categories", categories}};
+            send_response(req, res, response);
+            log_request("GET", req.path, 200);
+        } catch (const std::exception& e) {
+            json response = {{"success", false}, {"message", "Server error"}};
+            send_response(req, res, response);
+            res.status = 500;
+            log_request("GET", req.path, 500);
+            std::cerr << "  [ERROR] Get categories failed: " << e.what() << std::endl;
+        }
+    });
+    
+    // Reuse audit - entries that share a password, without decrypting the vault
+    svr.Get("/api/audit/reuse", [storage](const Request& req, Response& res) {
+        std::string token = req.get_header_value("Authorization");
+        
+        if (token.empty()) {
+            json response = {{"success", false}, {"message", "Unauthorized"}};
+            send_response(req, res, response);
+            res.status = 401;
+            log_request("GET", req.path, 401);
+            return;
+        }
+        
+        try {
+            uint64_t user_id = storage->validateSession(token);
+            
+            if (user_id == 0) {
+                json response = {{"success", false}, {"message", "Invalid session"}};
+                send_response(req, res, response);
+                res.status = 401;
+                log_request("GET", req.path, 401);
+                return;
+            }
+            
+            json groups = json::array();
+            for (const auto& group : storage->auditReuse(user_id)) {
+                json entries = json::array();
+                for (const auto& record : group.records) {
+                    entries.push_back({
+                        {"id", std::to_string(record.record_id)},
+                        {"site", record.site_name},
+                        {"username", record.username},
+                        {"category", record.category}
+                    });
+                }
+                groups.push_back({{"count", group.records.size()}, {"passwords", entries}});
+            }
+            
+            json response = {{"success", true}, {"groups", groups}};
+            send_response(req, res, response);
+            log_request("GET", req.path, 200);
+        } catch (const std::exception& e) {
+            json response = {{"success", false}, {"message", "Server error"}};
+            send_response(req, res, response);
+            res.status = 500;
+            log_request("GET", req.path, 500);
+            std::cerr << "  [ERROR] Reuse audit failed: " << e.what() << std::endl;
+        }
+    });
+    
+    // Breach audit - entries whose password is in the offline breach corpus
+    svr.Get("/api/audit/breached", [storage](const Request& req, Response& res) {
+        std::string token = req.get_header_value("Authorization");
+        
+        if (token.empty()) {
+            json response = {{"success", false}, {"message", "Unauthorized"}};
+            send_response(req, res, response);
+            res.status = 401;
+            log_request("GET", req.path, 401);
+            return;
+        }
+        
+        try {
+            uint64_t user_id = storage->validateSession(token);
+            
+            if (user_id == 0) {
+                json response = {{"success", false}, {"message", "Invalid session"}};
+                send_response(req, res, response);
+                res.status = 401;
+                log_request("GET", req.path, 401);
+                return;
+            }
+            
+            if (!storage->hasBreachCorpus()) {
+                json response = {{"success", false}, {"message", "No breach corpus loaded"}};
+                send_response(req, res, response);
+                res.status = 503;
+                log_request("GET", req.path, 503);
+                return;
+            }
+            
+            json entries = json::array();
+            for (const auto& record : storage->auditBreached(user_id)) {
+                entries.push_back({
+                    {"id", std::to_string(record.record_id)},
+                    {"site", record.site_name},
+                    {"username", record.username},
+                    {"category", record.category}
+                });
+            }
+            
+            json response = {{"success", true}, {"passwords", entries}};
+            send_response(req, res, response);
+            log_request("GET", req.path, 200);
+        } catch (const std::exception& e) {
+            json response = {{"success", false}, {"message", "Server error"}};
+            send_response(req, res, response);
+            res.status = 500;
+            log_request("GET", req.path, 500);
+            std::cerr << "  [ERROR] Breach audit failed: " << e.what() << std::endl;
+        }
+    });
+    
+    // Delta sync - only what changed since the client's last seq
+    svr.Get("/api/passwords/changes", [storage](const Request& req, Response& res) {
+        std::string token = req.get_header_value("Authorization");
+        
+        if (token.empty()) {
+            json response = {{"success", false}, {"message", "Unauthorized"}};
+            send_response(req, res, response);
+            res.status = 401;
+            log_request("GET", req.path, 401);
+            return;
+        }
+        
+        try {
+            uint64_t user_id = storage->validateSession(token);
+            
+            if (user_id == 0) {
+                json response = {{"success", false}, {"message", "Invalid session"}};
+                send_response(req, res, response);
+                res.status = 401;
+                log_request("GET", req.path, 401);
+                return;
+            }
+            
+            uint64_t since = 0;
+            if (req.has_param("since")) {
+                since = number_param(req, "since");
+            }
+            
+            auto changes = storage->getVaultChanges(user_id, since);
+            
+            WireFormat format = Wire::negotiate(req.get_header_value("Accept"));
+            std::string body;
+            
+            if (format == WireFormat::Json) {
+                body = "{\"success\":true,\"seq\":" + std::to_string(changes.seq);
+                body += changes.full ? ",\"full\":true" : ",\"full\":false";
+                body += ",\"passwords\":[";
+                for (size_t i = 0; i < changes.records.size(); i++) {
+                    if (i > 0) body += ',';
+                    Wire::appendRecord(format, changes.records[i], body);
+                }
+                body += "],\"deleted\":[";
+                for (size_t i = 0; i < changes.deleted_ids.size(); i++) {
+                    if (i > 0) body += ',';
+                    body += '"' + std::to_string(changes.deleted_ids[i]) + '"';
+                }
+                body += "]}";
+            } else {
+                Wire::appendMapHeader(format, 5, body);
+                Wire::appendString(format, "success", body);
+                Wire::appendBool(format, true, body);
+                Wire::appendString(format, "seq", body);
+                Wire::appendUInt(format, changes.seq, body);
+                Wire::appendString(format, "full", body);
+                Wire::appendBool(format, changes.full, body);
+                Wire::appendString(format, "passwords", body);
+                Wire::appendArrayHeader(format, changes.records.size(), body);
+                for (const auto& pwd : changes.records) {
+                    Wire::appendRecord(format, pwd, body);
+                }
+                Wire::appendString(format, "deleted", body);
+                Wire::appendArrayHeader(format, changes.deleted_ids.size(), body);
+                for (uint64_t id : changes.deleted_ids) {
+                    Wire::appendString(format, std::to_string(id), body);
+                }
+            }
+            res.set_content(body, Wire::contentType(format));
+            log_request("GET", req.path, 200);
+        } catch (const std::invalid_argument& e) {
+            json response = {{"success", false}, {"message", "Invalid since"}};
+            send_response(req, res, response);
+            res.status = 400;
+            log_request("GET", req.path, 400);
+        } catch (const std::exception& e) {
+            json response = {{"success", false}, {"message", "Server error"}};
+            send_response(req, res, response);
+            res.status = 500;
+            log_request("GET", req.path, 500);
+            std::cerr << "  [ERROR] Get changes failed: " << e.what() << std::endl;
+        }
+    });
+    
+    // Search - ?prefix= autocompletes site names a page at a time,
+    // ?q= ranks substring and near matches across site, username and category
+    svr.Get("/api/passwords/search", [storage](const Request& req, Response& res) {
+        std::string token = req.get_header_value("Authorization");
+        
+        if (token.empty()) {
+            json response = {{"success", false}, {"message", "Unauthorized"}};
+            send_response(req, res, response);
+            res.status = 401;
+            log_request("GET", req.path, 401);
+            return;
+        }
+        
+        try {
+            uint64_t user_id = storage->validateSession(token);
+            
+            if (user_id == 0) {
+                json response = {{"success", false}, {"message", "Invalid session"}};
+                send_response(req, res, response);
+                res.status = 401;
+                log_request("GET", req.path, 401);
+                return;
+            }
+            
+            size_t limit = SEARCH_DEFAULT_LIMIT;
+            if (req.has_param("limit")) {
+                limit = number_param(req, "limit");
+                limit = std::max<size_t>(1, std::min(limit, SEARCH_MAX_LIMIT));
+            }
+            
+            // q= is ranked substring/fuzzy search, one page of best matches
+            VaultPage page;
+            if (req.has_param("q")) {
+                page.records = storage->searchVault(user_id, req.get_param_value("q"), limit);
+            } else {
+                page = storage->searchVaultPrefix(user_id, req.get_param_value("prefix"), limit,
+                                                  req.get_param_value("cursor"));
+            }
+            
+            send_page(req, res, page);
+            log_request("GET", req.path, 200);
+        } catch (const std::invalid_argument& e) {
+            json response = {{"success", false}, {"message", "Invalid limit or cursor"}};
+            send_response(req, res, response);
+            res.status = 400;
+            log_request("GET", req.path, 400);
+        } catch (const std::exception& e) {
+            json response = {{"success", false}, {"message", "Server error"}};
+            send_response(req, res, response);
+            res.status = 500;
+            log_request("GET", req.path, 500);
+            std::cerr << "  [ERROR] Search passwords failed: " << e.what() << std::endl;
+        }
+    });
+    
+    // Get one password by id
+    svr.Get(R"(/api/passwords/(\d+))", [storage](const Request& req, Response& res) {
+        std::string token = req.get_header_value("Authorization");
+        
+        if (token.empty()) {
+            json response = {{"success", false}, {"message", "Unauthorized"}};
+            send_response(req, res, response);
+            res.status = 401;
+            log_request("GET", req.path, 401);
+            return;
+        }
+        
+        try {
+            uint64_t user_id = storage->validateSession(token);
+            
+            if (user_id == 0) {
+                json response = {{"success", false}, {"message", "Invalid session"}};
+                send_response(req, res, response);
+                res.status = 401;
+                log_request("GET", req.path, 401);
+                return;
+            }
+            
+            uint64_t record_id = std::stoull(std::string(req.matches[1]));
+            VaultRecord pwd;
+            
+            // Someone else's record is a 404 too - don't confirm it exists
+            if (!storage->getVaultEntry(user_id, record_id, pwd)) {
+                json response = {{"success", false}, {"message", "Password not found"}};
+                send_response(req, res, response);
+                res.status = 404;
+                log_request("GET", req.path, 404);
+                return;
+            }
+            
+            WireFormat format = Wire::negotiate(req.get_header_value("Accept"));
+            std::string body;
+            if (format == WireFormat::Json) {
+                body = "{\"success\":true,\"password\":";
+                Wire::appendRecord(format, pwd, body);
+                body += '}';
+            } else {
+                Wire::appendMapHeader(format, 2, body);
+                Wire::appendString(format, "success", body);
+                Wire::appendBool(format, true, body);
+                Wire::appendString(format, "password", body);
+                Wire::appendRecord(format, pwd, body);
+            }
+            res.set_content(body, Wire::contentType(format));
+            log_request("GET", req.path, 200);
+        } catch (const std::exception& e) {
+            json response = {{"success", false}, {"message", "Server error"}};
+            send_response(req, res, response);
+            res.status = 500;
+            log_request("GET", req.path, 500);
+            std::cerr << "  [ERROR] Get password failed: " << e.what() << std::endl;
+        }
+    });
+    
     // Add password
     svr.Post("/api/passwords", [storage](const Request& req, Response& res) {
         std::string token = req.get_header_value("Authorization");
         
         if (token.empty()) {
             json response = {{"success", false}, {"message", "Unauthorized"}};
-            res.set_content(response.dump(), "application/json");
+            send_response(req, res, response);
             res.status = 401;
             log_request("POST", req.path, 401);
             return;
@@ -197,13 +923,13 @@ int main() {
             
             if (user_id == 0) {
                 json response = {{"success", false}, {"message", "Invalid session"}};
-                res.set_content(response.dump(), "application/json");
+                send_response(req, res, response);
                 res.status = 401;
                 log_request("POST", req.path, 401);
                 return;
             }
             
-            auto body = json::parse(req.body);
+            auto body = parse_body(req);
             
             std::string site = body["site"];
             std::string username = body["username"];
@@ -213,24 +939,25 @@ int main() {
             
             if (site.empty() || username.empty() || password.empty()) {
                 json response = {{"success", false}, {"message", "Site, username, and password required"}};
-                res.set_content(response.dump(), "application/json");
+                send_response(req, res, response);
                 res.status = 400;
                 log_request("POST", req.path, 400);
                 return;
             }
             
-            uint64_t record_id = storage->addVaultEntry(user_id, site, username, password, notes, category);
+            VaultWrite written = storage->addVaultEntry(user_id, site, username, password, notes, category);
             
             json response;
             response["success"] = true;
             response["message"] = "Password added";
-            response["id"] = std::to_string(record_id);
-            res.set_content(response.dump(), "application/json");
+            response["id"] = std::to_string(written.record_id);
+            response["breached"] = written.breached;
+            send_response(req, res, response);
             log_request("POST", req.path, 200);
             std::cout << "  [INFO] Password added: " << site << std::endl;
         } catch (const std::exception& e) {
             json response = {{"success", false}, {"message", "Server error"}};
-            res.set_content(response.dump(), "application/json");
+            send_response(req, res, response);
             res.status = 500;
             log_request("POST", req.path, 500);
             std::cerr << "  [ERROR] Add password failed: " << e.what() << std::endl;
@@ -243,7 +970,7 @@ int main() {
         
         if (token.empty()) {
             json response = {{"success", false}, {"message", "Unauthorized"}};
-            res.set_content(response.dump(), "application/json");
+            send_response(req, res, response);
             res.status = 401;
             log_request("PUT", req.path, 401);
             return;
@@ -254,7 +981,7 @@ int main() {
             
             if (user_id == 0) {
                 json response = {{"success", false}, {"message", "Invalid session"}};
-                res.set_content(response.dump(), "application/json");
+                send_response(req, res, response);
                 res.status = 401;
                 log_request("PUT", req.path, 401);
                 return;
@@ -262,7 +989,7 @@ int main() {
             
             std::string password_id_str = req.matches[1];
             uint64_t record_id = std::stoull(password_id_str);
-            auto body = json::parse(req.body);
+            auto body = parse_body(req);
             
             std::string site = body["site"];
             std::string username = body["username"];
@@ -270,22 +997,23 @@ int main() {
             std::string category = body.value("category", "");
             std::string notes = body.value("notes", "");
             
-            bool success = storage->updateVaultEntry(user_id, record_id, site, username, password, notes, category);
+            bool breached = false;
+            bool success = storage->updateVaultEntry(user_id, record_id, site, username, password, notes, category, breached);
             
             if (success) {
-                json response = {{"success", true}, {"message", "Password updated"}};
-                res.set_content(response.dump(), "application/json");
+                json response = {{"success", true}, {"message", "Password updated"}, {"breached", breached}};
+                send_response(req, res, response);
                 log_request("PUT", req.path, 200);
                 std::cout << "  [INFO] Password updated: " << site << std::endl;
             } else {
                 json response = {{"success", false}, {"message", "Password not found"}};
-                res.set_content(response.dump(), "application/json");
+                send_response(req, res, response);
                 res.status = 404;
                 log_request("PUT", req.path, 404);
             }
         } catch (const std::exception& e) {
             json response = {{"success", false}, {"message", "Server error"}};
-            res.set_content(response.dump(), "application/json");
+            send_response(req, res, response);
             res.status = 500;
             log_request("PUT", req.path, 500);
             std::cerr << "  [ERROR] Update password failed: " << e.what() << std::endl;
@@ -298,7 +1026,7 @@ int main() {
         
         if (token.empty()) {
             json response = {{"success", false}, {"message", "Unauthorized"}};
-            res.set_content(response.dump(), "application/json");
+            send_response(req, res, response);
             res.status = 401;
             log_request("DELETE", req.path, 401);
             return;
@@ -309,7 +1037,7 @@ int main() {
             
             if (user_id == 0) {
                 json response = {{"success", false}, {"message", "Invalid session"}};
-                res.set_content(response.dump(), "application/json");
+                send_response(req, res, response);
                 res.status = 401;
                 log_request("DELETE", req.path, 401);
                 return;
@@ -322,33 +1050,279 @@ int main() {
             
             if (success) {
                 json response = {{"success", true}, {"message", "Password deleted"}};
-                res.set_content(response.dump(), "application/json");
+                send_response(req, res, response);
                 log_request("DELETE", req.path, 200);
                 std::cout << "  [INFO] Password deleted" << std::endl;
             } else {
                 json response = {{"success", false}, {"message", "Password not found"}};
-                res.set_content(response.dump(), "application/json");
+                send_response(req, res, response);
                 res.status = 404;
                 log_request("DELETE", req.path, 404);
             }
         } catch (const std::exception& e) {
             json response = {{"success", false}, {"message", "Server error"}};
-            res.set_content(response.dump(), "application/json");
+            send_response(req, res, response);
             res.status = 500;
             log_request("DELETE", req.path, 500);
             std::cerr << "  [ERROR] Delete password failed: " << e.what() << std::endl;
         }
     });
     
+    // Hot backup - an archive of every store as of now, streamed while the
+    // server keeps serving. Restore with --restore_from
+    std::string admin_token = config.admin_token;
+    svr.Get("/api/admin/backup", [storage, admin_token](const Request& req, Response& res) {
+        if (!is_admin(req, admin_token)) {
+            json response = {{"success", false}, {"message", "Unauthorized"}};
+            send_response(req, res, response);
+            res.status = 401;
+            log_request("GET", req.path, 401);
+            return;
+        }
+        
+        if (storage->backupRunning()) {
+            json response = {{"success", false}, {"message", "A backup is already running"}};
+            send_response(req, res, response);
+            res.status = 409;
+            log_request("GET", req.path, 409);
+            return;
+        }
+        
+        std::string path = req.path;
+        res.set_header("Content-Disposition", "attachment; filename=\"vault-backup.vbk\"");
+        res.set_chunked_content_provider("application/octet-stream",
+            [storage, path](size_t, DataSink& sink) {
+                try {
+                    bool complete = storage->writeBackup([&sink](const char* data, size_t size) {
+                        return sink.write(data, size);
+                    });
+                    if (!complete) return false;
+                } catch (const std::exception& e) {
+                    // Headers are already out - the archive has no end section, restore refuses it
+                    std::cerr << "  [ERROR] Backup failed: " << e.what() << std::endl;
+                    log_request("GET", path, 500);
+                    return false;
+                }
+                sink.done();
+                log_request("GET", path, 200);
+                std::cout << "  [INFO] Backup complete" << std::endl;
+                return true;
+            });
+    });
+    
+    // Replication log - replicas poll this with the admin token. Entries
+    // after since= in the binary layout of ReplicationLog::encode; waits up
+    // to wait= ms for one when there are none. 410 = reseed from a backup
+    svr.Get("/api/replication/log", [storage, admin_token](const Request& req, Response& res) {
+        if (!is_admin(req, admin_token)) {
+            json response = {{"success", false}, {"message", "Unauthorized"}};
+            send_response(req, res, response);
+            res.status = 401;
+            log_request("GET", req.path, 401);
+            return;
+        }
+        
+        uint64_t since, wait_ms = 0;
+        size_t max = REPLICATION_DEFAULT_BATCH;
+        try {
+            since = number_param(req, "since");
+            if (req.has_param("wait")) wait_ms = std::min<uint64_t>(number_param(req, "wait"), REPLICATION_MAX_WAIT_MS);
+            if (req.has_param("max")) max = std::min<size_t>(number_param(req, "max"), REPLICATION_MAX_BATCH);
+        } catch (const std::exception&) {
+            json response = {{"success", false}, {"message", "since, wait and max must be numbers"}};
+            send_response(req, res, response);
+            res.status = 400;
+            log_request("GET", req.path, 400);
+            return;
+        }
+        
+        ReplicationLog& log = storage->replicationLog();
+        std::vector<ReplicationEntry> entries;
+        if (req.get_param_value("epoch") != log.epoch() ||
+            !log.since(since, max, std::chrono::milliseconds(wait_ms), entries)) {
+            json response = {{"success", false}, {"message", "Position not in the replication log - reseed from a backup"},
+                             {"epoch", log.epoch()}, {"seq", log.lastSeq()}};
+            send_response(req, res, response);
+            res.status = 410;
+            log_request("GET", req.path, 410);
+            return;
+        }
+        if (!req.get_param_value("replica").empty()) {
+            log.noteReplica(req.get_param_value("replica"), since);
+        }
+        
+        std::string body;
+        ReplicationLog::encode(log.lastSeq(), entries, body);
+        res.set_content(body, "application/octet-stream");
+        // Idle polls come every second per replica - only log the ones that carry something
+        if (!entries.empty()) log_request("GET", req.path, 200);
+    });
+    
+    // Bulk import - the body is parsed as it arrives and handed to the
+    // encrypt workers in batches, so it is never held in memory whole
+    svr.Post("/api/import", [storage](const Request& req, Response& res, const ContentReader& content_reader) {
+        std::string token = req.get_header_value("Authorization");
+        
+        if (token.empty()) {
+            json response = {{"success", false}, {"message", "Unauthorized"}};
+            send_response(req, res, response);
+            res.status = 401;
+            log_request("POST", req.path, 401);
+            return;
+        }
+        
+        try {
+            uint64_t user_id = storage->validateSession(token);
+            
+            if (user_id == 0) {
+                json response = {{"success", false}, {"message", "Invalid session"}};
+                send_response(req, res, response);
+                res.status = 401;
+                log_request("POST", req.path, 401);
+                return;
+            }
+            
+            TransferFormat format;
+            if (!transfer_format(req, format)) {
+                json response = {{"success", false}, {"message", "Format must be csv or json"}};
+                send_response(req, res, response);
+                res.status = 400;
+                log_request("POST", req.path, 400);
+                return;
+            }
+            
+            VaultImporter importer(*storage, user_id, format);
+            content_reader([&](const char* data, size_t length) {
+                importer.feed(data, length);
+                return true;
+            });
+            ImportResult result = importer.finish();
+            
+            json response;
+            response["success"] = true;
+            response["message"] = "Import complete";
+            response["imported"] = result.imported;
+            response["skipped"] = result.skipped;
+            response["breached"] = result.breached;
+            send_response(req, res, response);
+            log_request("POST", req.path, 200);
+            std::cout << "  [INFO] Imported " << result.imported << " passwords" << std::endl;
+        } catch (const std::invalid_argument& e) {
+            // Batches before the bad line are already in
+            json response = {{"success", false}, {"message", std::string("Invalid import: ") + e.what()}};
+            send_response(req, res, response);
+            res.status = 400;
+            log_request("POST", req.path, 400);
+        } catch (const std::exception& e) {
+            json response = {{"success", false}, {"message", "Server error"}};
+            send_response(req, res, response);
+            res.status = 500;
+            log_request("POST", req.path, 500);
+            std::cerr << "  [ERROR] Import failed: " << e.what() << std::endl;
+        }
+    });
+    
+    // Bulk export - decrypted on the worker pool, streamed in id order
+    svr.Get("/api/export", [storage](const Request& req, Response& res) {
+        std::string token = req.get_header_value("Authorization");
+        
+        if (token.empty()) {
+            json response = {{"success", false}, {"message", "Unauthorized"}};
+            send_response(req, res, response);
+            res.status = 401;
+            log_request("GET", req.path, 401);
+            return;
+        }
+        
+        try {
+            uint64_t user_id = storage->validateSession(token);
+            
+            if (user_id == 0) {
+                json response = {{"success", false}, {"message", "Invalid session"}};
+                send_response(req, res, response);
+                res.status = 401;
+                log_request("GET", req.path, 401);
+                return;
+            }
+            
+            TransferFormat format = TransferFormat::Json;
+            if (req.has_param("format") && !transfer_format(req, format)) {
+                json response = {{"success", false}, {"message", "Format must be csv or json"}};
+                send_response(req, res, response);
+                res.status = 400;
+                log_request("GET", req.path, 400);
+                return;
+            }
+            
+            bool csv = format == TransferFormat::Csv;
+            res.set_header("Content-Disposition", csv ? "attachment; filename=\"vault.csv\""
+                                                      : "attachment; filename=\"vault.json\"");
+            std::string path = req.path;
+            res.set_chunked_content_provider(csv ? "text/csv" : "application/json",
+                [storage, user_id, path, format](size_t, DataSink& sink) {
+                    try {
+                        bool client_alive = exportVault(*storage, user_id, format, [&sink](const std::string& chunk) {
+                            return sink.write(chunk.data(), chunk.size());
+                        });
+                        if (!client_alive) return false;
+                    } catch (const std::exception& e) {
+                        // Headers are already out, all we can do is cut the response short
+                        std::cerr << "  [ERROR] Export failed: " << e.what() << std::endl;
+                        log_request("GET", path, 500);
+                        return false;
+                    }
+                    sink.done();
+                    log_request("GET", path, 200);
+                    return true;
+                });
+        } catch (const std::exception& e) {
+            json response = {{"success", false}, {"message", "Server error"}};
+            send_response(req, res, response);
+            res.status = 500;
+            log_request("GET", req.path, 500);
+            std::cerr << "  [ERROR] Export failed: " << e.what() << std::endl;
+        }
+    });
+    
     std::cout << "  Server ready!\n";
     std::cout << "============================================================\n";
-    std::cout << "  Listening on: http://0.0.0.0:8080\n";
-    std::cout << "  API Base URL: http://localhost:8080/api/\n";
-    std::cout << "  Data Directory: data/\n";
+    std::cout << "  Listening on: http://" << config.host << ":" << config.port << "\n";
+    std::cout << "  API Base URL: http://localhost:" << config.port << "/api/\n";
+    std::cout << "  Data Directory: " << config.data_dir << "/\n";
+    std::cout << "  Worker Threads: " << worker_threads
+              << " (queue limit: " << (max_queued > 0 ? std::to_string(max_queued) : "none") << ")\n";
+    std::cout << "  Listen Backlog: " << config.listen_backlog
+              << (config.tcp_nodelay ? ", TCP_NODELAY" : "") << "\n";
+    std::cout << "  Keep-Alive: " << config.keep_alive_max_count << " requests, "
+              << config.keep_alive_timeout_sec << "s idle\n";
+    std::cout << "  Timeouts: read " << config.read_timeout_sec << "s, write "
+              << config.write_timeout_sec << "s\n";
+    std::cout << "  Max Payload: " << config.max_payload_bytes << " bytes\n";
+    std::cout << "  Vault Shards: " << storage->shardCount() << "\n";
+    std::cout << "  Compaction: " << (config.compaction_interval_sec > 0
+                  ? "at " + std::to_string(config.compaction_threshold_percent) + "% dead, checked every "
+                    + std::to_string(config.compaction_interval_sec) + "s"
+                  : std::string("off")) << "\n";
+    std::cout << "  Record Cache: " << config.record_cache_bytes << " bytes\n";
+    std::cout << "  Search Index: " << config.search_index_bytes << " bytes\n";
+    std::cout << "  Breach Corpus: " << (config.breach_corpus.empty()
+                  ? std::string("off")
+                  : config.breach_corpus + " (" + std::to_string(storage->breachCorpusSize()) + " hashes)") << "\n";
+    std::cout << "  Admin Endpoints: " << (config.admin_token.empty() ? "off" : "on") << "\n";
+    std::cout << "  Replication: " << (replica
+                  ? "replica of " + config.replicate_from + ", reads refused "
+                    + (config.replica_max_lag_sec > 0 ? "past " + std::to_string(config.replica_max_lag_sec) + "s behind"
+                                                      : std::string("never"))
+                  : config.replication_backlog > 0
+                    ? "primary, " + std::to_string(config.replication_backlog) + " writes kept"
+                    : std::string("off")) << "\n";
     std::cout << "\n  Press Ctrl+C to stop the server\n";
     std::cout << "============================================================\n\n";
     
-    svr.listen("0.0.0.0", 8080);
+    if (!svr.listen(config.host, config.port)) {
+        std::cerr << "  [ERROR] Failed to listen on " << config.host << ":" << config.port << std::endl;
+        return 1;
+    }
     
     return 0;
 }
@@ -2,17 +2,202 @@
 #include "crypto.hpp"
 #include <stdexcept>
 #include <ctime>
+#include <mutex>
+#include <unordered_set>
+#include <cctype>
+#include <algorithm>
+#include <fstream>
+#include <filesystem>
 
 using namespace std;
 
+// Records copied per read lock hold when streaming an uncached vault
+static const size_t VISIT_BATCH = 256;
+
+// Opaque paging cursor for a (index key, record id) position: hex key, '.', id
+static string encodeCursor(const string& key, uint64_t record_id) {
+    return Crypto::bytesToHex(vector<uint8_t>(key.begin(), key.end())) + "." + to_string(record_id);
+}
+
+// Anything we didn't hand out - bad hex, a key longer than max_key_bytes,
+// an id past 64 bits - throws invalid_argument
+static void decodeCursor(const string& cursor, size_t max_key_bytes, string& key, uint64_t& record_id) {
+    size_t dot = cursor.find('.');
+    if(dot == string::npos || dot > 2 * max_key_bytes || dot + 1 == cursor.size() ||
+       cursor.size() - dot - 1 > 20 ||
+       cursor.find_first_not_of("0123456789", dot + 1) != string::npos) {
+        throw invalid_argument("Invalid cursor");
+    }
+    vector<uint8_t> bytes = Crypto::hexToBytes(cursor.substr(0, dot));
+    key.assign(bytes.begin(), bytes.end());
+    try {
+        record_id = stoull(cursor.substr(dot + 1));
+    } catch(const out_of_range&) {
+        throw invalid_argument("Invalid cursor");
+    }
+}
+
+static bool startsWithFolded(string_view name, const string& prefix) {
+    if(name.size() < prefix.size()) return false;
+    for(size_t i = 0; i < prefix.size(); i++) {
+        if(tolower(static_cast<unsigned char>(name[i])) != tolower(static_cast<unsigned char>(prefix[i]))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static string foldCase(string_view text) {
+    string folded(text);
+    for(char& c : folded) {
+        c = static_cast<char>(tolower(static_cast<unsigned char>(c)));
+    }
+    return folded;
+}
+
+// How well a record matches a folded query: 3 = site starts with it,
+// 2 = site contains it, 1 = username or category does, 0 = no substring match
+// (fuzzy matches score below 1)
+static double substringScore(string_view site_name, string_view username, string_view category,
+                             const string& query) {
+    string site = foldCase(site_name);
+    size_t at = site.find(query);
+    if(at == 0) return 3.0;
+    if(at != string::npos) return 2.0;
+    if(foldCase(username).find(query) != string::npos) return 1.0;
+    if(foldCase(category).find(query) != string::npos) return 1.0;
+    return 0.0;
+}
+
 // basic setup
 
-StorageManager::StorageManager(const string& vault_file, const string& users_file)
-    : btree(vault_file), auth_manager(users_file) {
+VaultShard::VaultShard(const string& vault_file)
+    : btree(vault_file), change_log(vault_file + ".changes"),
+      fingerprints(vault_file + ".fingerprints"), compactor(btree, vault_mutex, write_gate) {
+}
+
+// How many shards the data directory was made with (vault.dat.shards).
+// A vault from before sharding has no count and is one shard; 0 = new directory
+static size_t savedShardCount(const string& vault_file) {
+    ifstream in(vault_file + ".shards");
+    if(!in.is_open()) {
+        return filesystem::exists(vault_file) ? 1 : 0;
+    }
+    size_t count = 0;
+    if(!(in >> count) || count == 0 || count > MAX_VAULT_SHARDS) {
+        throw runtime_error("Corrupt shard count in " + vault_file + ".shards");
+    }
+    return count;
+}
+
+StorageManager::StorageManager(const string& vault_file, const string& users_file, size_t shard_count)
+    : vault_file(vault_file), users_file(users_file), auth_manager(users_file) {
+    size_t saved = savedShardCount(vault_file);
+    if(shard_count == 0) {
+        shard_count = saved > 0 ? saved : 1;
+    }
+    if(shard_count > MAX_VAULT_SHARDS) {
+        throw runtime_error("At most " + to_string(MAX_VAULT_SHARDS) + " vault shards");
+    }
+    if(saved > 0 && saved != shard_count) {
+        // Users would land in the wrong shard and their records go missing
+        throw runtime_error("Vault was created with " + to_string(saved) + " shard(s), not " +
+                            to_string(shard_count) + " - the shard count can't change once the data directory exists");
+    }
+    
+    // Count first, so a crash part way through creating shards doesn't
+    // leave a directory that reads as an unsharded vault
+    string count_file = vault_file + ".shards";
+    if(!filesystem::exists(count_file)) {
+        {
+            ofstream out(count_file + ".tmp", ios::trunc);
+            if(!out.is_open()) {
+                throw runtime_error("Failed to open " + count_file + ".tmp for writing");
+            }
+            out << shard_count << "\n";
+        }
+        filesystem::rename(count_file + ".tmp", count_file);
+    }
+    
+    for(size_t i = 0; i < shard_count; i++) {
+        shards.push_back(make_unique<VaultShard>(shardFile(vault_file, i)));
+    }
+}
+
+// Sequential ids would split evenly on their own, but get mixed anyway
+// (splitmix64's finalizer) so the split doesn't depend on how ids are
+// handed out. Part of the file format: changing it moves users' shards
+size_t StorageManager::shardIndex(uint64_t user_id) const {
+    uint64_t h = user_id;
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+    return static_cast<size_t>(h % shards.size());
+}
+
+VaultShard& StorageManager::shardFor(uint64_t user_id) {
+    return *shards[shardIndex(user_id)];
+}
+
+string StorageManager::shardFile(const string& vault_file, size_t shard) {
+    if(shard == 0) return vault_file;
+    size_t dot = vault_file.rfind('.');
+    size_t slash = vault_file.find_last_of("/\\");
+    if(dot == string::npos || (slash != string::npos && dot < slash)) {
+        return vault_file + "-" + to_string(shard);
+    }
+    return vault_file.substr(0, dot) + "-" + to_string(shard) + vault_file.substr(dot);
+}
+
+// Keyed so equal passwords match within a vault but the fingerprints say
+// nothing without the user's key. The HMAC key is derived from the vault
+// key rather than being the vault key itself
+static string passwordFingerprint(const User& user, const string& password) {
+    string key = Crypto::hmacSHA256(user.encryption_key, "password fingerprint");
+    vector<uint8_t> mac = Crypto::hexToBytes(Crypto::hmacSHA256(key, password));
+    return string(mac.begin(), mac.begin() + FINGERPRINT_BYTES);
+}
+
+// One id index lookup - caller holds the user's shard's vault_mutex
+bool StorageManager::ownsRecord(uint64_t user_id, uint64_t record_id) {
+    VaultRecordView view;
+    return shardFor(user_id).btree.getView(record_id, view) && view.user_id == user_id;
+}
+
+// Caller holds the user's shard's vault_mutex, so a miss can't race a write
+RecordCache::Snapshot StorageManager::userRecords(uint64_t user_id) {
+    RecordCache::Snapshot records = record_cache.get(user_id);
+    if(!records) {
+        records = record_cache.put(user_id, shardFor(user_id).btree.getAllRecordsForUser(user_id));
+    }
+    return records;
 }
 
 uint64_t StorageManager::registerUser(const string& email, const string& password, const string& recovery_phrase) {
-    return auth_manager.registerUser(email, password, recovery_phrase);
+    uint64_t user_id = auth_manager.registerUser(email, password, recovery_phrase);
+    
+    // Before the account's first vault write can be, so replicas get it first
+    User* user = auth_manager.getUserById(user_id);
+    if(user && replication_log.enabled()) {
+        vector<ReplicationEntry> batch(1);
+        batch[0].op = ReplicationOp::User;
+        batch[0].changed_at = user->created_at;
+        batch[0].user = *user;
+        replication_log.append(batch);
+    }
+    return user_id;
+}
+
+void StorageManager::replicate(ReplicationOp op, const VaultRecord& record, const string& fingerprint,
+                               uint64_t changed_at, uint64_t change_seq) {
+    if(!replication_log.enabled()) return;
+    vector<ReplicationEntry> batch(1);
+    batch[0].op = op;
+    batch[0].changed_at = changed_at;
+    batch[0].change_seq = change_seq;
+    batch[0].record = record;
+    batch[0].fingerprint = fingerprint;
+    replication_log.append(batch);
 }
 
 string StorageManager::loginUser(const string& email, const string& password) {
@@ -28,7 +213,7 @@ uint64_t StorageManager::validateSession(const string& token) {
 }
 
 // Add new vault entry with encryption
-uint64_t StorageManager::addVaultEntry(uint64_t user_id, const string& site_name, 
+VaultWrite StorageManager::addVaultEntry(uint64_t user_id, const string& site_name, 
                                       const string& username, const string& password,
                                       const string& notes, const string& category) {
     // Get user's encryption key
@@ -50,105 +235,450 @@ uint64_t StorageManager::addVaultEntry(uint64_t user_id, const string& site_name
     record.iv = iv;
     record.notes = notes;
     record.category = category;
+    string fingerprint = passwordFingerprint(*user, password);
+    bool breached = breach_corpus.containsPassword(password);
     
-    // Insert into B-Tree (it will set the record_id)
-    btree.insert(record);
+    VaultShard& shard = shardFor(user_id);
+    lock_guard<mutex> gate(shard.write_gate);
+    unique_lock<shared_mutex> lock(shard.vault_mutex);
     
-    // Get the record_id that was assigned (it's the last one)
-    vector<VaultRecord> user_records = btree.getAllRecordsForUser(user_id);
-    if(!user_records.empty()) {
-        // Return the most recently added record's ID
-        uint64_t max_id = 0;
-        for(const auto& rec : user_records) {
-            if(rec.record_id > max_id) {
-                max_id = rec.record_id;
-            }
+    uint64_t changed_at = time(nullptr);
+    uint64_t record_id = shard.btree.insert(record);
+    uint64_t change_seq = shard.change_log.record(user_id, record_id, ChangeOp::Insert, changed_at);
+    shard.fingerprints.set(user_id, record_id, fingerprint);
+    
+    // Keep a cached vault in step - get() has the timestamps insert set
+    VaultRecord stored;
+    if(shard.btree.get(record_id, stored)) {
+        record_cache.upsert(user_id, stored);
+        search_index.add(user_id, stored);
+        replicate(ReplicationOp::Insert, stored, fingerprint, changed_at, change_seq);
+    }
+    return {record_id, breached};
+}
+
+// Encrypt and fingerprint one entry - no lock, so import workers run it in parallel
+PreparedEntry StorageManager::prepareEntry(uint64_t user_id, const VaultEntryInput& input) {
+    User* user = auth_manager.getUserById(user_id);
+    if(!user) {
+        throw runtime_error("User not found");
+    }
+    
+    PreparedEntry entry;
+    entry.record.record_id = 0;
+    entry.record.user_id = user_id;
+    entry.record.site_name = input.site_name;
+    entry.record.username = input.username;
+    entry.record.iv = Crypto::generateIV();
+    entry.record.encrypted_password = Crypto::encryptAES256(input.password, user->encryption_key, entry.record.iv);
+    entry.record.notes = input.notes;
+    entry.record.category = input.category;
+    entry.fingerprint = passwordFingerprint(*user, input.password);
+    entry.breached = breach_corpus.containsPassword(input.password);
+    return entry;
+}
+
+// Write a batch of prepared entries - one append and one lock for all of
+// them. Sets each record's id
+void StorageManager::addPreparedEntries(uint64_t user_id, vector<PreparedEntry>& entries) {
+    if(entries.empty()) return;
+    
+    vector<VaultRecord> records;
+    records.reserve(entries.size());
+    for(const auto& entry : entries) {
+        records.push_back(entry.record);
+        records.back().user_id = user_id;
+    }
+    
+    VaultShard& shard = shardFor(user_id);
+    lock_guard<mutex> gate(shard.write_gate);
+    unique_lock<shared_mutex> lock(shard.vault_mutex);
+    
+    shard.btree.insertBatch(records);
+    
+    vector<uint64_t> record_ids;
+    vector<pair<uint64_t, string>> prints;
+    record_ids.reserve(records.size());
+    prints.reserve(records.size());
+    for(size_t i = 0; i < records.size(); i++) {
+        entries[i].record = records[i];
+        record_ids.push_back(records[i].record_id);
+        prints.emplace_back(records[i].record_id, entries[i].fingerprint);
+        search_index.add(user_id, records[i]);
+    }
+    // a batch rewrites most chunks anyway - cheaper to drop it once
+    record_cache.invalidate(user_id);
+    shard.change_log.recordBatch(user_id, record_ids, ChangeOp::Insert, records.front().created_at);
+    shard.fingerprints.setBatch(user_id, prints);
+    
+    if(replication_log.enabled()) {
+        uint64_t changed_at = records.front().created_at;
+        uint64_t first_seq = shard.change_log.latestSeq() - records.size() + 1;
+        vector<ReplicationEntry> batch(records.size());
+        for(size_t i = 0; i < records.size(); i++) {
+            batch[i].op = ReplicationOp::Insert;
+            batch[i].changed_at = changed_at;
+            batch[i].change_seq = first_seq + i;
+            batch[i].record = move(records[i]);
+            batch[i].fingerprint = entries[i].fingerprint;
         }
-        return max_id;
+        replication_log.append(batch);
+    }
+}
+
+// Swap a stored record's ciphertext for the password. One that won't
+// decrypt reads "[Decryption failed]" instead, and false is returned
+static bool decryptInPlace(const User& user, VaultRecord& record) {
+    try {
+        record.encrypted_password = Crypto::decryptAES256(record.encrypted_password, user.encryption_key, record.iv);
+        return true;
+    } catch(const exception& e) {
+        record.encrypted_password = "[Decryption failed]";
+        return false;
+    }
+}
+
+// Up to limit of a user's records after after_id, by id - caller holds vault_mutex
+static vector<VaultRecord> readBatch(BTree& btree, uint64_t user_id, uint64_t after_id, size_t limit) {
+    vector<VaultRecord> records;
+    VaultRecordView view;
+    for(uint64_t record_id : btree.userRecordIds(user_id, after_id, limit)) {
+        if(btree.getView(record_id, view)) {
+            records.push_back(view.toRecord());
+        }
+    }
+    return records;
+}
+
+// Next batch of a user's records in id order, still encrypted
+vector<VaultRecord> StorageManager::readVaultBatch(uint64_t user_id, uint64_t after_id, size_t limit) {
+    VaultShard& shard = shardFor(user_id);
+    shared_lock<shared_mutex> lock(shard.vault_mutex);
+    return readBatch(shard.btree, user_id, after_id, limit);
+}
+
+void StorageManager::decryptEntries(uint64_t user_id, vector<VaultRecord>& records) {
+    User* user = auth_manager.getUserById(user_id);
+    if(!user) {
+        throw runtime_error("User not found");
     }
     
-    return 0;
+    // An export is a copy of the vault - a placeholder would pass for the
+    // password, so fail it instead
+    for(auto& record : records) {
+        if(!decryptInPlace(*user, record)) {
+            throw runtime_error("Record " + to_string(record.record_id) + " could not be decrypted");
+        }
+    }
 }
 
-// Get all vault entries for user
-vector<VaultRecord> StorageManager::getUserVault(uint64_t user_id) {
+// Stream vault entries for user one at a time, decrypted
+// Hot users come from the cache; otherwise the user's id list is read a
+// batch at a time, the read lock held only while a batch is copied - never
+// while visit runs, so a slow client can't hold up the shard's writers
+void StorageManager::forEachVaultEntry(uint64_t user_id, const function<bool(const VaultRecord&)>& visit) {
     // Get user's encryption key
     User* user = auth_manager.getUserById(user_id);
     if(!user) {
         throw runtime_error("User not found");
     }
     
-    // Get all records for this user
-    vector<VaultRecord> records = btree.getAllRecordsForUser(user_id);
+    VaultRecord decrypted;
+    auto decryptAndVisit = [&]() {
+        decryptInPlace(*user, decrypted);
+        return visit(decrypted);
+    };
     
-    // Decrypt passwords
-    for(auto& record : records) {
-        try {
-            record.encrypted_password = Crypto::decryptAES256(
-                record.encrypted_password, 
-                user->encryption_key, 
-                record.iv
-            );
-        } catch(const exception& e) {
-            record.encrypted_password = "[Decryption failed]";
+    // Snapshot is immutable - no lock needed to walk it
+    RecordCache::Snapshot cached = record_cache.get(user_id);
+    if(cached) {
+        for(const auto& record : *cached) {
+            decrypted = record;
+            if(!decryptAndVisit()) break;
         }
+        return;
     }
     
-    return records;
+    VaultShard& shard = shardFor(user_id);
+    uint64_t after_id = 0;
+    for(bool first = true; ; first = false) {
+        vector<VaultRecord> batch;
+        {
+            shared_lock<shared_mutex> lock(shard.vault_mutex);
+            batch = readBatch(shard.btree, user_id, after_id, VISIT_BATCH);
+            
+            // Only a vault read under one lock hold is a consistent copy to cache
+            if(first && batch.size() < VISIT_BATCH) {
+                record_cache.put(user_id, batch);
+            }
+        }
+        
+        for(const auto& record : batch) {
+            decrypted = record;
+            if(!decryptAndVisit()) return;
+        }
+        if(batch.size() < VISIT_BATCH) return;
+        after_id = batch.back().record_id;
+    }
 }
 
-// Search vault entries by site name
-vector<VaultRecord> StorageManager::searchVaultEntry(uint64_t user_id, const string& site_name) {
+// One page of the vault - walks the user's id list (or one category's)
+// or their modification time index from the cursor, so a page reads and
+// decrypts limit records whatever the vault size. Inserts get new, higher
+// ids and land on later pages of the id order
+VaultPage StorageManager::getVaultPage(uint64_t user_id, size_t limit, const string& cursor,
+                                       const string& category, VaultOrder order) {
     // Get user's encryption key
     User* user = auth_manager.getUserById(user_id);
     if(!user) {
         throw runtime_error("User not found");
     }
     
-    // Search by site name
-    vector<VaultRecord> records = btree.search(site_name);
-    
-    // Filter by user_id and decrypt
-    vector<VaultRecord> user_records;
-    for(auto& record : records) {
-        if(record.user_id == user_id) {
+    // Id order cursors carry just the id, time order ones the time too
+    string after_key;
+    uint64_t after_id = 0;
+    uint64_t after_time = 0;
+    if(!cursor.empty()) {
+        // A time key is at most 20 decimal digits
+        decodeCursor(cursor, 20, after_key, after_id);
+        bool by_time = order == VaultOrder::ByModified;
+        if(after_key.empty() == by_time ||
+           after_key.find_first_not_of("0123456789") != string::npos) {
+            throw invalid_argument("Invalid cursor");
+        }
+        if(by_time) {
             try {
-                record.encrypted_password = Crypto::decryptAES256(
-                    record.encrypted_password, 
-                    user->encryption_key, 
-                    record.iv
-                );
-            } catch(const exception& e) {
-                record.encrypted_password = "[Decryption failed]";
+                after_time = stoull(after_key);
+            } catch(const out_of_range&) {
+                throw invalid_argument("Invalid cursor");
+            }
+        }
+    }
+    
+    VaultPage page;
+    VaultShard& shard = shardFor(user_id);
+    {
+        shared_lock<shared_mutex> lock(shard.vault_mutex);
+        VaultRecordView view;
+        if(order == VaultOrder::ById) {
+            // One id past the page means there's another page
+            vector<uint64_t> record_ids = category.empty()
+                ? shard.btree.userRecordIds(user_id, after_id, limit + 1)
+                : shard.btree.categoryRecordIds(user_id, category, after_id, limit + 1);
+            for(size_t i = 0; i < record_ids.size() && i < limit; i++) {
+                if(shard.btree.getView(record_ids[i], view)) {
+                    page.records.push_back(view.toRecord());
+                }
             }
-            user_records.push_back(record);
+            if(record_ids.size() > limit) {
+                page.next_cursor = encodeCursor("", record_ids[limit - 1]);
+            }
+        } else {
+            // Newest first. A category filter is checked per record, so
+            // that combination also reads the records it skips
+            ModifiedKey last{user_id, after_time, after_id};
+            bool more = true;
+            while(more && page.next_cursor.empty()) {
+                vector<ModifiedKey> batch = shard.btree.recentRecords(user_id, last.modified_at, last.record_id, limit + 1);
+                more = batch.size() == limit + 1;
+                for(const auto& key : batch) {
+                    // Every key must resolve - skipping one would refetch the same batch forever
+                    if(!shard.btree.getView(key.record_id, view)) {
+                        throw runtime_error("Modified index points at missing record " + to_string(key.record_id));
+                    }
+                    if(!category.empty() && view.category != category) {
+                        last = key;
+                        continue;
+                    }
+                    if(page.records.size() == limit) {
+                        page.next_cursor = encodeCursor(to_string(last.modified_at), last.record_id);
+                        break;
+                    }
+                    page.records.push_back(view.toRecord());
+                    last = key;
+                }
+            }
+        }
+    }
+    
+    for(auto& record : page.records) {
+        decryptInPlace(*user, record);
+    }
+    
+    return page;
+}
+
+// One vault entry by id, decrypted - false if missing or someone else's
+bool StorageManager::getVaultEntry(uint64_t user_id, uint64_t record_id, VaultRecord& record) {
+    // Get user's encryption key
+    User* user = auth_manager.getUserById(user_id);
+    if(!user) {
+        throw runtime_error("User not found");
+    }
+    
+    VaultShard& shard = shardFor(user_id);
+    {
+        shared_lock<shared_mutex> lock(shard.vault_mutex);
+        if(!shard.btree.get(record_id, record) || record.user_id != user_id) {
+            return false;
         }
     }
     
-    return user_records;
+    decryptInPlace(*user, record);
+    return true;
+}
+
+vector<CategoryCount> StorageManager::getCategories(uint64_t user_id) {
+    VaultShard& shard = shardFor(user_id);
+    shared_lock<shared_mutex> lock(shard.vault_mutex);
+    return shard.btree.userCategories(user_id);
+}
+
+// Autocomplete - ordered walk of the user's run of the site name index
+// from the prefix, so a page costs about limit index entries and record
+// reads, not a vault scan
+VaultPage StorageManager::searchVaultPrefix(uint64_t user_id, const string& prefix, size_t limit, const string& cursor) {
+    // Get user's encryption key
+    User* user = auth_manager.getUserById(user_id);
+    if(!user) {
+        throw runtime_error("User not found");
+    }
+    
+    string after_key;
+    uint64_t after_id = 0;
+    if(!cursor.empty()) {
+        decodeCursor(cursor, MAX_KEY_BYTES, after_key, after_id);
+    }
+    
+    VaultPage page;
+    VaultShard& shard = shardFor(user_id);
+    {
+        shared_lock<shared_mutex> lock(shard.vault_mutex);
+        string last_key;
+        uint64_t last_id = 0;
+        VaultRecordView view;
+        shard.btree.scanPrefix(user_id, prefix, after_key, after_id, [&](string_view key, uint64_t record_id) {
+            if(!shard.btree.getView(record_id, view)) return true;
+            
+            // Keys stop at MAX_KEY_BYTES - a longer prefix is checked on the record
+            if(!startsWithFolded(view.site_name, prefix)) return true;
+            
+            // One match past the page means there's another page
+            if(page.records.size() == limit) {
+                page.next_cursor = encodeCursor(last_key, last_id);
+                return false;
+            }
+            page.records.push_back(view.toRecord());
+            last_key.assign(key);
+            last_id = record_id;
+            return true;
+        });
+    }
+    
+    for(auto& record : page.records) {
+        decryptInPlace(*user, record);
+    }
+    
+    return page;
+}
+
+// Ranked search - trigram postings narrow it to candidates, records are
+// read by id to confirm and score them. Substring hits rank first, then,
+// if the page isn't full, records sharing at least half the query's
+// trigrams (typos, transpositions) by how many they share
+vector<VaultRecord> StorageManager::searchVault(uint64_t user_id, const string& query, size_t limit) {
+    // Get user's encryption key
+    User* user = auth_manager.getUserById(user_id);
+    if(!user) {
+        throw runtime_error("User not found");
+    }
+    
+    string folded = foldCase(query);
+    vector<pair<double, VaultRecord>> hits;
+    VaultShard& shard = shardFor(user_id);
+    {
+        shared_lock<shared_mutex> lock(shard.vault_mutex);
+        VaultRecordView view;
+        
+        // Built on first use, and rebuilt once if another user's search
+        // evicted it. Two vaults over the budget together can keep evicting
+        // each other, so after that give up on the index
+        auto indexed = [&](const function<bool()>& lookup) {
+            if(lookup()) return true;
+            search_index.build(user_id, *userRecords(user_id));
+            return lookup();
+        };
+        
+        vector<uint32_t> grams = TrigramIndex::trigrams(folded);
+        vector<uint64_t> candidates;
+        if(folded.size() < 3 || !indexed([&] { return search_index.intersect(user_id, grams, candidates); })) {
+            // Too short for a trigram, or no index - check the user's records
+            // directly. Hold the snapshot: an uncached vault is freed with the temporary
+            RecordCache::Snapshot snapshot = userRecords(user_id);
+            for(const auto& record : *snapshot) {
+                double score = substringScore(record.site_name, record.username, record.category, folded);
+                if(score > 0) hits.push_back({score, record});
+            }
+        } else {
+            unordered_set<uint64_t> seen;
+            for(uint64_t record_id : candidates) {
+                if(!shard.btree.getView(record_id, view)) continue;
+                double score = substringScore(view.site_name, view.username, view.category, folded);
+                if(score > 0) {
+                    hits.push_back({score, view.toRecord()});
+                    seen.insert(record_id);
+                }
+            }
+            
+            uint32_t min_shared = static_cast<uint32_t>((grams.size() + 1) / 2);
+            vector<TrigramIndex::Match> matches;
+            if(hits.size() < limit && indexed([&] { return search_index.overlap(user_id, grams, min_shared, matches); })) {
+                for(const auto& match : matches) {
+                    if(seen.count(match.record_id) || !shard.btree.getView(match.record_id, view)) continue;
+                    hits.push_back({0.9 * match.shared / grams.size(), view.toRecord()});
+                }
+            }
+        }
+    }
+    
+    sort(hits.begin(), hits.end(), [](const pair<double, VaultRecord>& a, const pair<double, VaultRecord>& b) {
+        if(a.first != b.first) return a.first > b.first;
+        if(a.second.site_name != b.second.site_name) return a.second.site_name < b.second.site_name;
+        return a.second.record_id < b.second.record_id;
+    });
+    if(hits.size() > limit) hits.resize(limit);
+    
+    vector<VaultRecord> records;
+    records.reserve(hits.size());
+    for(auto& hit : hits) {
+        VaultRecord& record = hit.second;
+        decryptInPlace(*user, record);
+        records.push_back(move(record));
+    }
+    
+    return records;
 }
 
 // Update vault entry
 bool StorageManager::updateVaultEntry(uint64_t user_id, uint64_t record_id,
                                      const string& site_name, const string& username,
-                                     const string& password, const string& notes, const string& category) {
+                                     const string& password, const string& notes, const string& category,
+                                     bool& breached) {
     // Get user's encryption key
     User* user = auth_manager.getUserById(user_id);
     if(!user) {
         throw runtime_error("User not found");
     }
     
-    // Verify ownership
-    vector<VaultRecord> all_records = btree.getAllRecordsForUser(user_id);
-    bool owns_record = false;
-    for(const auto& rec : all_records) {
-        if(rec.record_id == record_id) {
-            owns_record = true;
-            break;
-        }
-    }
+    string fingerprint = passwordFingerprint(*user, password);
+    breached = breach_corpus.containsPassword(password);
     
-    if(!owns_record) {
+    VaultShard& shard = shardFor(user_id);
+    
+    // Verify ownership
+    lock_guard<mutex> gate(shard.write_gate);
+    unique_lock<shared_mutex> lock(shard.vault_mutex);
+    if(!ownsRecord(user_id, record_id)) {
         throw runtime_error("Unauthorized: Record does not belong to this user");
     }
     
@@ -167,24 +697,508 @@ bool StorageManager::updateVaultEntry(uint64_t user_id, uint64_t record_id,
     updated_record.notes = notes;
     updated_record.category = category;
     
-    return btree.update(record_id, updated_record);
+    // Search index needs the old fields to take them out
+    VaultRecord previous;
+    bool indexed = search_index.covers(user_id) && shard.btree.get(record_id, previous);
+    
+    VaultRecord stored;
+    if(!shard.btree.update(record_id, updated_record, &stored)) {
+        return false;
+    }
+    record_cache.upsert(user_id, stored);
+    if(indexed) {
+        search_index.remove(user_id, previous);
+        search_index.add(user_id, stored);
+    }
+    shard.fingerprints.set(user_id, record_id, fingerprint);
+    
+    uint64_t changed_at = time(nullptr);
+    uint64_t change_seq = shard.change_log.record(user_id, record_id, ChangeOp::Update, changed_at);
+    replicate(ReplicationOp::Update, stored, fingerprint, changed_at, change_seq);
+    return true;
 }
 
 // Delete vault entry
 bool StorageManager::deleteVaultEntry(uint64_t user_id, uint64_t record_id) {
+    VaultShard& shard = shardFor(user_id);
     // Verify ownership
-    vector<VaultRecord> all_records = btree.getAllRecordsForUser(user_id);
-    bool owns_record = false;
-    for(const auto& rec : all_records) {
-        if(rec.record_id == record_id) {
-            owns_record = true;
-            break;
+    lock_guard<mutex> gate(shard.write_gate);
+    unique_lock<shared_mutex> lock(shard.vault_mutex);
+    if(!ownsRecord(user_id, record_id)) {
+        throw runtime_error("Unauthorized: Record does not belong to this user");
+    }
+    
+    VaultRecord previous;
+    bool indexed = search_index.covers(user_id) && shard.btree.get(record_id, previous);
+    
+    if(!shard.btree.remove(record_id)) {
+        return false;
+    }
+    record_cache.erase(user_id, record_id);
+    if(indexed) {
+        search_index.remove(user_id, previous);
+    }
+    shard.fingerprints.erase(user_id, record_id);
+    
+    // Tombstone so syncing clients drop it too
+    uint64_t changed_at = time(nullptr);
+    uint64_t change_seq = shard.change_log.record(user_id, record_id, ChangeOp::Delete, changed_at);
+    
+    VaultRecord removed{};
+    removed.record_id = record_id;
+    removed.user_id = user_id;
+    replicate(ReplicationOp::Delete, removed, "", changed_at, change_seq);
+    return true;
+}
+
+// Reuse audit - a group-by over the shard.fingerprints. Entries from before
+// fingerprints were kept get theirs computed once, here, then never again
+vector<ReuseGroup> StorageManager::auditReuse(uint64_t user_id) {
+    User* user = auth_manager.getUserById(user_id);
+    if(!user) {
+        throw runtime_error("User not found");
+    }
+    
+    // Records written before fingerprints existed - copied under the read
+    // lock, decrypted with no lock held
+    vector<VaultRecord> missing;
+    VaultShard& shard = shardFor(user_id);
+    {
+        shared_lock<shared_mutex> lock(shard.vault_mutex);
+        VaultRecordView view;
+        for(uint64_t record_id : shard.btree.userRecordIds(user_id, 0, SIZE_MAX)) {
+            if(shard.fingerprints.contains(user_id, record_id)) continue;
+            if(shard.btree.getView(record_id, view)) missing.push_back(view.toRecord());
         }
     }
     
-    if(!owns_record) {
-        throw runtime_error("Unauthorized: Record does not belong to this user");
+    if(!missing.empty()) {
+        vector<pair<const VaultRecord*, string>> computed;
+        for(const auto& record : missing) {
+            try {
+                string password = Crypto::decryptAES256(record.encrypted_password,
+                                                        user->encryption_key, record.iv);
+                computed.emplace_back(&record, passwordFingerprint(*user, password));
+            } catch(const exception& e) {
+                // Undecryptable - leave it out of the audit
+            }
+        }
+        
+        // The exclusive lock only covers storing them
+        lock_guard<mutex> gate(shard.write_gate);
+        unique_lock<shared_mutex> lock(shard.vault_mutex);
+        vector<pair<uint64_t, string>> prints;
+        VaultRecordView view;
+        for(auto& [record, fingerprint] : computed) {
+            // Could have been deleted or rewritten (and fingerprinted) meanwhile
+            if(!shard.btree.getView(record->record_id, view) || view.iv != record->iv) continue;
+            if(shard.fingerprints.contains(user_id, record->record_id)) continue;
+            prints.emplace_back(record->record_id, move(fingerprint));
+        }
+        if(!prints.empty()) shard.fingerprints.setBatch(user_id, prints);
     }
     
-    return btree.remove(record_id);
+    vector<ReuseGroup> groups;
+    shared_lock<shared_mutex> lock(shard.vault_mutex);
+    VaultRecordView view;
+    for(const auto& record_ids : shard.fingerprints.duplicates(user_id)) {
+        ReuseGroup group;
+        for(uint64_t record_id : record_ids) {
+            if(!shard.btree.getView(record_id, view) || view.user_id != user_id) continue;
+            VaultRecord record = view.toRecord();
+            record.encrypted_password.clear();
+            record.iv.clear();
+            group.records.push_back(move(record));
+        }
+        if(group.records.size() > 1) groups.push_back(move(group));
+    }
+    return groups;
+}
+
+void StorageManager::loadBreachCorpus(const string& path) {
+    breach_corpus.open(path);
+}
+
+bool StorageManager::hasBreachCorpus() const {
+    return breach_corpus.loaded();
+}
+
+uint64_t StorageManager::breachCorpusSize() const {
+    return breach_corpus.size();
+}
+
+// Every password has to be decrypted to hash it - one pass over the vault,
+// one corpus lookup per entry
+vector<VaultRecord> StorageManager::auditBreached(uint64_t user_id) {
+    vector<VaultRecord> breached;
+    forEachVaultEntry(user_id, [&](const VaultRecord& record) {
+        if(breach_corpus.containsPassword(record.encrypted_password)) {
+            VaultRecord entry = record;
+            entry.encrypted_password.clear();
+            entry.iv.clear();
+            breached.push_back(move(entry));
+        }
+        return true;
+    });
+    return breached;
+}
+
+// Delta sync - only records touched after since
+VaultChanges StorageManager::getVaultChanges(uint64_t user_id, uint64_t since) {
+    // Get user's encryption key
+    User* user = auth_manager.getUserById(user_id);
+    if(!user) {
+        throw runtime_error("User not found");
+    }
+    
+    VaultShard& shard = shardFor(user_id);
+    shared_lock<shared_mutex> lock(shard.vault_mutex);
+    
+    VaultChanges changes;
+    changes.seq = shard.change_log.latestSeq();
+    
+    // since=0, a seq from the future (server was reset) or one older than
+    // the user's tombstone horizon - send everything
+    changes.full = (since == 0 || since > changes.seq);
+    ChangeSet delta;
+    if(!changes.full) {
+        delta = shard.change_log.changesSince(user_id, since);
+        changes.full = delta.expired;
+    }
+    
+    vector<VaultRecord>& records = changes.records;
+    if(changes.full) {
+        records = userRecords(user_id)->toVector();
+    } else {
+        for(const auto& entry : delta.tombstones) {
+            changes.deleted_ids.push_back(entry.record_id);
+        }
+        
+        // One id index lookup per change - records deleted since are gone
+        // from the index and skipped (their tombstone is already in the delta)
+        VaultRecordView view;
+        for(const auto& entry : delta.upserts) {
+            if(shard.btree.getView(entry.record_id, view) && view.user_id == user_id) {
+                records.push_back(view.toRecord());
+            }
+        }
+    }
+    
+    // Decrypt passwords
+    for(auto& record : records) {
+        decryptInPlace(*user, record);
+    }
+    
+    return changes;
+}
+
+void StorageManager::startCompaction(const CompactionSettings& settings) {
+    for(auto& shard : shards) {
+        shard->compactor.start(settings);
+    }
+}
+
+StorageStats StorageManager::getStorageStats() {
+    StorageStats total;
+    for(auto& shard : shards) {
+        shared_lock<shared_mutex> lock(shard->vault_mutex);
+        StorageStats stats = shard->btree.storageStats();
+        total.record_file_bytes += stats.record_file_bytes;
+        total.dead_record_bytes += stats.dead_record_bytes;
+        total.node_file_bytes += stats.node_file_bytes;
+        total.free_node_bytes += stats.free_node_bytes;
+    }
+    return total;
+}
+
+CompactionStatus StorageManager::getCompactionStatus() const {
+    CompactionStatus total;
+    for(const auto& shard : shards) {
+        CompactionStatus status = shard->compactor.status();
+        total.running = total.running || status.running;
+        total.bytes_copied += status.bytes_copied;
+        total.bytes_to_copy += status.bytes_to_copy;
+        total.runs += status.runs;
+        total.last_reclaimed_bytes += status.last_reclaimed_bytes;
+        total.total_reclaimed_bytes += status.total_reclaimed_bytes;
+    }
+    return total;
+}
+
+void StorageManager::setRecordCacheBudget(size_t bytes) {
+    record_cache.setBudget(bytes);
+}
+
+RecordCacheStats StorageManager::getRecordCacheStats() const {
+    return record_cache.stats();
+}
+
+void StorageManager::setSearchIndexBudget(size_t bytes) {
+    search_index.setBudget(bytes);
+}
+
+TrigramIndexStats StorageManager::getSearchIndexStats() const {
+    return search_index.stats();
+}
+
+// Archive section name -> file, shared by backup and restore. Shard 0
+// keeps the names from before sharding; restore gets every shard a
+// vault could have, so shards the archive doesn't carry are cleared out
+static unordered_map<string, string> backupFiles(const string& vault_file, const string& users_file,
+                                                 size_t shard_count = MAX_VAULT_SHARDS) {
+    unordered_map<string, string> files = {
+        {"users", users_file},
+        {"position", vault_file + ".replica"},
+        {"shards", vault_file + ".shards"}
+    };
+    for(size_t i = 0; i < shard_count; i++) {
+        string suffix = i == 0 ? "" : "-" + to_string(i);
+        string shard_file = StorageManager::shardFile(vault_file, i);
+        files["vault" + suffix] = shard_file;
+        files["records" + suffix] = shard_file + ".records";
+        files["changes" + suffix] = shard_file + ".changes";
+        files["fingerprints" + suffix] = shard_file + ".fingerprints";
+    }
+    return files;
+}
+
+static uint64_t fileBytes(const string& path) {
+    error_code ec;
+    uint64_t bytes = filesystem::file_size(path, ec);
+    return ec ? 0 : bytes;
+}
+
+// Writers are held off just long enough to fix the sizes and open the
+// files - on every shard at once, so the archive is one moment across
+// all of them. After that the copy runs unlocked: the change log and
+// fingerprints are append-only so their prefix doesn't move, and in-place
+// writes to the vault files save the old bytes in the snapshot first
+bool StorageManager::writeBackup(const BackupArchive::Writer& write) {
+    auto files = backupFiles(vault_file, users_file, shards.size());
+    
+    struct ShardCopy {
+        shared_ptr<FileSnapshot> snapshot;
+        ifstream nodes, records, changes, prints;
+        uint64_t changes_bytes = 0, prints_bytes = 0;
+    };
+    vector<ShardCopy> copies(shards.size());
+    string users, position;
+    
+    auto endSnapshots = [this, &copies] {
+        for(size_t i = 0; i < shards.size(); i++) {
+            if(!copies[i].snapshot) continue;
+            lock_guard<mutex> gate(shards[i]->write_gate);
+            unique_lock<shared_mutex> lock(shards[i]->vault_mutex);
+            shards[i]->btree.endSnapshot();
+        }
+    };
+    
+    {
+        // Always in shard order - writers only ever hold one shard's locks
+        vector<unique_lock<mutex>> gates;
+        vector<shared_lock<shared_mutex>> locks;
+        for(auto& shard : shards) {
+            gates.emplace_back(shard->write_gate);
+            locks.emplace_back(shard->vault_mutex);
+        }
+        
+        try {
+            for(size_t i = 0; i < shards.size(); i++) {
+                string suffix = i == 0 ? "" : "-" + to_string(i);
+                ShardCopy& copy = copies[i];
+                copy.snapshot = shards[i]->btree.beginSnapshot();
+                copy.nodes.open(files["vault" + suffix], ios::binary);
+                copy.records.open(files["records" + suffix], ios::binary);
+                copy.changes.open(files["changes" + suffix], ios::binary);
+                copy.prints.open(files["fingerprints" + suffix], ios::binary);
+                copy.changes_bytes = fileBytes(files["changes" + suffix]);
+                copy.prints_bytes = fileBytes(files["fingerprints" + suffix]);
+            }
+        } catch(...) {
+            locks.clear();
+            gates.clear();
+            endSnapshots();
+            throw;
+        }
+        
+        // Where a replica seeded from this archive picks up: this primary's
+        // log, or wherever this replica had got to. Taken before the users
+        // so an account registered in between is in both - replaying it is harmless
+        if(replication_log.enabled()) {
+            position = replication_log.epoch() + " " + to_string(replication_log.lastSeq());
+        } else {
+            ifstream saved(files["position"]);
+            getline(saved, position);
+        }
+        users = auth_manager.snapshotUsers();
+    }
+    
+    bool complete;
+    try {
+        complete = BackupArchive::writeHeader(write) &&
+            BackupArchive::writeSection(write, "shards", to_string(shards.size()) + "\n");
+        for(size_t i = 0; complete && i < shards.size(); i++) {
+            string suffix = i == 0 ? "" : "-" + to_string(i);
+            ShardCopy& copy = copies[i];
+            shared_ptr<FileSnapshot>& snapshot = copy.snapshot;
+            complete =
+                BackupArchive::writeSection(write, "vault" + suffix, copy.nodes, snapshot->node_file_bytes,
+                    [&snapshot](uint64_t offset, char* data, size_t size) {
+                        snapshot->overlay(false, offset, data, size);
+                    }) &&
+                BackupArchive::writeSection(write, "records" + suffix, copy.records, snapshot->record_file_bytes,
+                    [&snapshot](uint64_t offset, char* data, size_t size) {
+                        snapshot->overlay(true, offset, data, size);
+                    }) &&
+                BackupArchive::writeSection(write, "changes" + suffix, copy.changes, copy.changes_bytes) &&
+                BackupArchive::writeSection(write, "fingerprints" + suffix, copy.prints, copy.prints_bytes);
+        }
+        complete = complete &&
+            BackupArchive::writeSection(write, "users", users) &&
+            (position.empty() || BackupArchive::writeSection(write, "position", position)) &&
+            BackupArchive::writeEnd(write);
+    } catch(...) {
+        endSnapshots();
+        throw;
+    }
+    endSnapshots();
+    return complete;
+}
+
+// Backups snapshot every shard together, so shard 0 speaks for all of them
+bool StorageManager::backupRunning() {
+    shared_lock<shared_mutex> lock(shards[0]->vault_mutex);
+    return shards[0]->btree.snapshotActive();
+}
+
+uint64_t StorageManager::restoreBackup(const string& archive_path, const string& vault_file, const string& users_file) {
+    uint64_t restored = BackupArchive::restore(archive_path, backupFiles(vault_file, users_file));
+    
+    // Half-done compaction files belong to the vault that was replaced
+    for(size_t i = 0; i < MAX_VAULT_SHARDS; i++) {
+        string shard_file = shardFile(vault_file, i);
+        error_code ec;
+        filesystem::remove(shard_file + ".compact", ec);
+        filesystem::remove(shard_file + ".records.compact", ec);
+    }
+    return restored;
+}
+
+void StorageManager::setReplicationBacklog(size_t entries) {
+    replication_log.setCapacity(entries);
+}
+
+// Same bookkeeping as the write paths above, with the primary's ids,
+// timestamps and change log seqs, so delta sync seqs mean the same on
+// every server. A crash before the position is saved replays the last
+// batch: the vault writes are puts, and the change logs skip seqs they
+// already hold
+void StorageManager::applyReplicated(const string& epoch, const vector<ReplicationEntry>& entries) {
+    if(entries.empty()) return;
+    
+    // Accounts belong to no shard - add them first, so none of a user's
+    // records land before the account does. Then each shard's writes in order
+    vector<vector<const ReplicationEntry*>> by_shard(shards.size());
+    for(const auto& entry : entries) {
+        if(entry.op == ReplicationOp::User) {
+            auth_manager.putUser(entry.user);
+        } else {
+            by_shard[shardIndex(entry.record.user_id)].push_back(&entry);
+        }
+    }
+    
+    for(size_t i = 0; i < shards.size(); i++) {
+        if(by_shard[i].empty()) continue;
+        VaultShard& shard = *shards[i];
+        lock_guard<mutex> gate(shard.write_gate);
+        unique_lock<shared_mutex> lock(shard.vault_mutex);
+        
+        // A run of inserts for one user at one time is an import batch - one append
+        vector<VaultRecord> run;
+        vector<ChangeEntry> run_changes;
+        vector<pair<uint64_t, string>> run_prints;
+        uint64_t run_user = 0, run_time = 0;
+        auto flushRun = [&] {
+            if(run.empty()) return;
+            shard.btree.put(run);
+            for(const auto& record : run) {
+                search_index.add(run_user, record);
+            }
+            if(run.size() == 1) {
+                record_cache.upsert(run_user, run.front());
+            } else {
+                record_cache.invalidate(run_user);
+            }
+            shard.change_log.replay(run_changes);
+            shard.fingerprints.setBatch(run_user, run_prints);
+            run.clear();
+            run_changes.clear();
+            run_prints.clear();
+        };
+        
+        for(const ReplicationEntry* entry : by_shard[i]) {
+            const VaultRecord& record = entry->record;
+            ChangeEntry change;
+            change.seq = entry->change_seq;
+            change.user_id = record.user_id;
+            change.record_id = record.record_id;
+            change.modified_at = entry->changed_at;
+            
+            if(entry->op == ReplicationOp::Insert) {
+                if(!run.empty() && (record.user_id != run_user || entry->changed_at != run_time)) flushRun();
+                run_user = record.user_id;
+                run_time = entry->changed_at;
+                run.push_back(record);
+                change.op = ChangeOp::Insert;
+                run_changes.push_back(change);
+                if(entry->fingerprint.size() == FINGERPRINT_BYTES) {
+                    run_prints.emplace_back(record.record_id, entry->fingerprint);
+                }
+                continue;
+            }
+            flushRun();
+            
+            VaultRecord previous;
+            bool indexed = search_index.covers(record.user_id) && shard.btree.get(record.record_id, previous);
+            if(entry->op == ReplicationOp::Update) {
+                shard.btree.put({record});
+                record_cache.upsert(record.user_id, record);
+                if(indexed) {
+                    search_index.remove(record.user_id, previous);
+                    search_index.add(record.user_id, record);
+                }
+                if(entry->fingerprint.size() == FINGERPRINT_BYTES) {
+                    shard.fingerprints.set(record.user_id, record.record_id, entry->fingerprint);
+                }
+                change.op = ChangeOp::Update;
+                shard.change_log.replay({change});
+            } else {
+                shard.btree.remove(record.record_id);
+                record_cache.erase(record.user_id, record.record_id);
+                if(indexed) {
+                    search_index.remove(record.user_id, previous);
+                }
+                shard.fingerprints.erase(record.user_id, record.record_id);
+                change.op = ChangeOp::Delete;
+                shard.change_log.replay({change});
+            }
+        }
+        flushRun();
+    }
+    
+    // Side file and rename, so a crash leaves the old position or the new one
+    string position_file = vault_file + ".replica";
+    {
+        ofstream out(position_file + ".tmp", ios::trunc);
+        if(!out.is_open()) {
+            throw runtime_error("Failed to open " + position_file + ".tmp for writing");
+        }
+        out << epoch << " " << entries.back().seq << "\n";
+    }
+    filesystem::rename(position_file + ".tmp", position_file);
+}
+
+bool StorageManager::readReplicaPosition(const string& vault_file, string& epoch, uint64_t& seq) {
+    ifstream in(vault_file + ".replica");
+    return in.is_open() && (in >> epoch >> seq) && !epoch.empty();
 }
@@ -0,0 +1,290 @@
+#include "trigram_index.hpp"
+#include <algorithm>
+
+using namespace std;
+
+static void putVarint(string& out, uint64_t value) {
+    while(value >= 0x80) {
+        out += static_cast<char>((value & 0x7f) | 0x80);
+        value >>= 7;
+    }
+    out += static_cast<char>(value);
+}
+
+static uint64_t getVarint(const string& in, size_t& pos) {
+    uint64_t value = 0;
+    int shift = 0;
+    while(true) {
+        uint8_t byte = static_cast<uint8_t>(in[pos++]);
+        value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if(!(byte & 0x80)) return value;
+        shift += 7;
+    }
+}
+
+// Ids arrive in increasing order on insert, so that's just an append;
+// anything else (an update re-adding a field) re-encodes the list
+void PostingList::add(uint64_t record_id) {
+    if(record_id > last_id) {
+        putVarint(bytes, record_id - last_id);
+        last_id = record_id;
+        count++;
+        return;
+    }
+
+    vector<uint64_t> ids;
+    decode(ids);
+    auto it = lower_bound(ids.begin(), ids.end(), record_id);
+    if(it != ids.end() && *it == record_id) return;
+    ids.insert(it, record_id);
+
+    bytes.clear();
+    last_id = 0;
+    count = 0;
+    for(uint64_t id : ids) add(id);
+}
+
+void PostingList::remove(uint64_t record_id) {
+    vector<uint64_t> ids;
+    decode(ids);
+    auto it = lower_bound(ids.begin(), ids.end(), record_id);
+    if(it == ids.end() || *it != record_id) return;
+    ids.erase(it);
+
+    bytes.clear();
+    last_id = 0;
+    count = 0;
+    for(uint64_t id : ids) add(id);
+}
+
+void PostingList::decode(vector<uint64_t>& out) const {
+    out.clear();
+    out.reserve(count);
+    uint64_t id = 0;
+    size_t pos = 0;
+    while(pos < bytes.size()) {
+        id += getVarint(bytes, pos);
+        out.push_back(id);
+    }
+}
+
+// Rough cost of one trigram's list besides its bytes: map node, PostingList
+static const size_t POSTING_OVERHEAD = 64;
+// and of one user's index: entry, list node, empty map
+static const size_t INDEX_OVERHEAD = 128;
+
+TrigramIndex::TrigramIndex(size_t budget_bytes)
+    : budget(budget_bytes), total_bytes(0), evictions(0) {
+}
+
+void TrigramIndex::setBudget(size_t budget_bytes) {
+    lock_guard<mutex> lock(index_mutex);
+    budget = budget_bytes;
+    evict();
+}
+
+vector<uint32_t> TrigramIndex::trigrams(string_view text) {
+    vector<uint32_t> out;
+    if(text.size() < 3) return out;
+
+    out.reserve(text.size() - 2);
+    uint32_t window = 0;
+    for(size_t i = 0; i < text.size(); i++) {
+        unsigned char c = static_cast<unsigned char>(text[i]);
+        if(c >= 'A' && c <= 'Z') c = c - 'A' + 'a';
+        window = ((window << 8) | c) & 0xffffff;
+        if(i >= 2) out.push_back(window);
+    }
+    sort(out.begin(), out.end());
+    out.erase(unique(out.begin(), out.end()), out.end());
+    return out;
+}
+
+// Trigrams don't span fields - "site" + "user" shouldn't match "teu"
+void TrigramIndex::recordTrigrams(const VaultRecord& record, vector<uint32_t>& out) {
+    out.clear();
+    for(const string* field : {&record.site_name, &record.username, &record.category}) {
+        vector<uint32_t> grams = trigrams(*field);
+        out.insert(out.end(), grams.begin(), grams.end());
+    }
+    sort(out.begin(), out.end());
+    out.erase(unique(out.begin(), out.end()), out.end());
+}
+
+bool TrigramIndex::covers(uint64_t user_id) const {
+    lock_guard<mutex> lock(index_mutex);
+    return users.contains(user_id);
+}
+
+// Add one id to a trigram's list, keeping index.bytes current
+void TrigramIndex::addPosting(UserIndex& index, uint32_t gram, uint64_t record_id) {
+    auto [it, added] = index.postings.try_emplace(gram);
+    size_t before = added ? 0 : it->second.byteSize();
+    if(added) index.bytes += POSTING_OVERHEAD;
+    it->second.add(record_id);
+    index.bytes += it->second.byteSize() - before;
+}
+
+// Records come in id order, so every posting list is built by appends
+void TrigramIndex::build(uint64_t user_id, const CachedVault& records) {
+    UserIndex index;
+    index.bytes = INDEX_OVERHEAD;
+    vector<uint32_t> grams;
+    for(const auto& record : records) {
+        recordTrigrams(record, grams);
+        for(uint32_t gram : grams) {
+            addPosting(index, gram, record.record_id);
+        }
+    }
+
+    lock_guard<mutex> lock(index_mutex);
+    UserIndex* existing = users.get(user_id);
+    if(existing) {
+        total_bytes -= existing->bytes;
+        touch(*existing);
+    } else {
+        lru.push_front(user_id);
+        users.put(user_id, UserIndex());
+        existing = users.get(user_id);
+        existing->lru_pos = lru.begin();
+    }
+    existing->postings.swap(index.postings);
+    existing->bytes = index.bytes;
+    total_bytes += existing->bytes;
+    evict();
+}
+
+void TrigramIndex::add(uint64_t user_id, const VaultRecord& record) {
+    lock_guard<mutex> lock(index_mutex);
+    UserIndex* index = users.get(user_id);
+    if(!index) return;
+
+    vector<uint32_t> grams;
+    recordTrigrams(record, grams);
+    size_t before = index->bytes;
+    for(uint32_t gram : grams) {
+        addPosting(*index, gram, record.record_id);
+    }
+    total_bytes += index->bytes - before;
+    evict();
+}
+
+void TrigramIndex::remove(uint64_t user_id, const VaultRecord& record) {
+    lock_guard<mutex> lock(index_mutex);
+    UserIndex* index = users.get(user_id);
+    if(!index) return;
+
+    vector<uint32_t> grams;
+    recordTrigrams(record, grams);
+    size_t before = index->bytes;
+    for(uint32_t gram : grams) {
+        auto it = index->postings.find(gram);
+        if(it == index->postings.end()) continue;
+        index->bytes -= it->second.byteSize();
+        it->second.remove(record.record_id);
+        if(it->second.size() == 0) {
+            index->postings.erase(it);
+            index->bytes -= POSTING_OVERHEAD;
+        } else {
+            index->bytes += it->second.byteSize();
+        }
+    }
+    total_bytes -= before - index->bytes;
+}
+
+// Intersect smallest list first - the candidate set only shrinks, and each
+// step gallops through the bigger list instead of walking all of it
+bool TrigramIndex::intersect(uint64_t user_id, const vector<uint32_t>& query, vector<uint64_t>& result) {
+    lock_guard<mutex> lock(index_mutex);
+    result.clear();
+    UserIndex* index = users.get(user_id);
+    if(!index) return false;
+    touch(*index);
+    if(query.empty()) return true;
+
+    vector<const PostingList*> lists;
+    for(uint32_t gram : query) {
+        auto it = index->postings.find(gram);
+        if(it == index->postings.end()) return true;  // a trigram nobody has
+        lists.push_back(&it->second);
+    }
+    sort(lists.begin(), lists.end(), [](const PostingList* a, const PostingList* b) {
+        return a->size() < b->size();
+    });
+
+    lists[0]->decode(result);
+    vector<uint64_t> ids;
+    for(size_t i = 1; i < lists.size() && !result.empty(); i++) {
+        lists[i]->decode(ids);
+        size_t kept = 0;
+        auto pos = ids.begin();
+        for(uint64_t id : result) {
+            // Gallop: double the step until we reach id, then binary search the last step
+            auto lo = pos, hi = pos;
+            size_t step = 1;
+            while(hi != ids.end() && *hi < id) {
+                lo = hi;
+                hi += min<size_t>(step, ids.end() - hi);
+                step *= 2;
+            }
+            pos = lower_bound(lo, hi, id);
+            if(pos == ids.end()) break;
+            if(*pos == id) result[kept++] = id;
+        }
+        result.resize(kept);
+    }
+    return true;
+}
+
+bool TrigramIndex::overlap(uint64_t user_id, const vector<uint32_t>& query, uint32_t min_shared,
+                           vector<Match>& matches) {
+    lock_guard<mutex> lock(index_mutex);
+    matches.clear();
+    UserIndex* index = users.get(user_id);
+    if(!index) return false;
+    touch(*index);
+
+    // Every posting of every query trigram, then count runs of the same id
+    vector<uint64_t> all, ids;
+    for(uint32_t gram : query) {
+        auto it = index->postings.find(gram);
+        if(it == index->postings.end()) continue;
+        it->second.decode(ids);
+        all.insert(all.end(), ids.begin(), ids.end());
+    }
+    sort(all.begin(), all.end());
+
+    for(size_t i = 0; i < all.size();) {
+        size_t j = i;
+        while(j < all.size() && all[j] == all[i]) j++;
+        uint32_t shared = static_cast<uint32_t>(j - i);
+        if(shared >= min_shared) matches.push_back({all[i], shared});
+        i = j;
+    }
+    return true;
+}
+
+TrigramIndexStats TrigramIndex::stats() const {
+    lock_guard<mutex> lock(index_mutex);
+    TrigramIndexStats s;
+    s.users = lru.size();
+    s.bytes = total_bytes;
+    s.budget_bytes = budget;
+    s.evictions = evictions;
+    return s;
+}
+
+void TrigramIndex::touch(UserIndex& index) {
+    lru.splice(lru.begin(), lru, index.lru_pos);
+}
+
+// Least recently used indexes go first, never the most recent one
+void TrigramIndex::evict() {
+    while(total_bytes > budget && lru.size() > 1) {
+        uint64_t user_id = lru.back();
+        total_bytes -= users.get(user_id)->bytes;
+        lru.pop_back();
+        users.remove(user_id);
+        evictions++;
+    }
+}
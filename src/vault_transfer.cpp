@@ -0,0 +1,483 @@
+#include "vault_transfer.hpp"
+#include "wire.hpp"
+#include <json.hpp>
+#include <map>
+#include <stdexcept>
+#include <algorithm>
+#include <cctype>
+
+using namespace std;
+using json = nlohmann::json;
+
+static const size_t TRANSFER_BATCH = 256;       // entries per queue item
+static const size_t QUEUE_DEPTH = 4;            // batches waiting per stage
+static const size_t EXPORT_CHUNK_SIZE = 64 * 1024;
+static const size_t MAX_CSV_FIELD = 64 * 1024;
+static const size_t MAX_JSON_OBJECT = 256 * 1024;
+
+static size_t workerCount(size_t workers) {
+    if(workers > 0) return workers;
+    return max<size_t>(1, thread::hardware_concurrency());
+}
+
+static string lowercase(string s) {
+    transform(s.begin(), s.end(), s.begin(), [](unsigned char c) { return tolower(c); });
+    return s;
+}
+
+// Column names other managers use for the same fields
+static string canonicalColumn(const string& name) {
+    string column = lowercase(name);
+    column.erase(0, column.find_first_not_of(" \t"));
+    column.erase(column.find_last_not_of(" \t") + 1);
+    if(column == "site" || column == "site_name" || column == "name" || column == "url") return "site";
+    if(column == "username" || column == "login" || column == "login_username") return "username";
+    if(column == "password" || column == "login_password") return "password";
+    if(column == "category" || column == "folder" || column == "grouping") return "category";
+    if(column == "notes" || column == "note" || column == "extra") return "notes";
+    return "";
+}
+
+// ---------------------------------------------------------------- import
+
+VaultImporter::VaultImporter(StorageManager& storage, uint64_t user_id, TransferFormat format, size_t workers)
+    : storage(storage), user_id(user_id), format(format),
+      parsed(QUEUE_DEPTH), encrypted(QUEUE_DEPTH),
+      next_seq(0), skipped(0), imported(0), breached(0), failed(false), finished(false),
+      line_no(1), in_quotes(false), quote_pending(false), field_started(false),
+      json_depth(0), json_in_string(false), json_escape(false), json_opened(false), json_closed(false) {
+    pending.seq = 0;
+    size_t count = workerCount(workers);
+    for(size_t i = 0; i < count; i++) {
+        this->workers.emplace_back(&VaultImporter::runWorker, this);
+    }
+    writer = thread(&VaultImporter::runWriter, this);
+}
+
+VaultImporter::~VaultImporter() {
+    if(!finished) {
+        // Abandoned mid-upload (bad input or client gone) - drop what's queued
+        failed = true;
+        stop();
+    }
+}
+
+void VaultImporter::stop() {
+    parsed.close();
+    for(auto& worker : workers) {
+        if(worker.joinable()) worker.join();
+    }
+    encrypted.close();
+    if(writer.joinable()) writer.join();
+}
+
+void VaultImporter::fail(exception_ptr e) {
+    {
+        lock_guard<mutex> lock(error_mutex);
+        if(!error) error = e;
+    }
+    failed = true;
+    parsed.close();
+    encrypted.close();
+}
+
+void VaultImporter::runWorker() {
+    Batch batch;
+    while(parsed.pop(batch)) {
+        if(failed) return;
+        try {
+            batch.prepared.reserve(batch.inputs.size());
+            for(const auto& input : batch.inputs) {
+                batch.prepared.push_back(storage.prepareEntry(user_id, input));
+            }
+            batch.inputs.clear();
+        } catch(...) {
+            fail(current_exception());
+            return;
+        }
+        if(!encrypted.push(move(batch))) return;
+    }
+}
+
+// Workers finish out of order - hold batches back until their turn so
+// record ids follow the file
+void VaultImporter::runWriter() {
+    map<uint64_t, Batch> waiting;
+    uint64_t expected = 0;
+    Batch batch;
+    while(encrypted.pop(batch)) {
+        if(failed) return;
+        waiting[batch.seq] = move(batch);
+        for(auto it = waiting.begin(); it != waiting.end() && it->first == expected; it = waiting.begin()) {
+            try {
+                storage.addPreparedEntries(user_id, it->second.prepared);
+            } catch(...) {
+                fail(current_exception());
+                return;
+            }
+            imported += it->second.prepared.size();
+            for(const auto& entry : it->second.prepared) {
+                if(entry.breached) breached++;
+            }
+            waiting.erase(it);
+            expected++;
+        }
+    }
+}
+
+void VaultImporter::addEntry(VaultEntryInput input) {
+    if(input.site_name.empty() || input.username.empty() || input.password.empty()) {
+        skipped++;
+        return;
+    }
+    pending.inputs.push_back(move(input));
+    if(pending.inputs.size() >= TRANSFER_BATCH) {
+        flushBatch();
+    }
+}
+
+void VaultImporter::flushBatch() {
+    if(pending.inputs.empty()) return;
+    Batch batch;
+    batch.seq = next_seq++;
+    batch.inputs.swap(pending.inputs);
+    if(!parsed.push(move(batch))) {
+        // A worker or the writer gave up - report why
+        lock_guard<mutex> lock(error_mutex);
+        if(error) rethrow_exception(error);
+        throw runtime_error("Import stopped");
+    }
+}
+
+void VaultImporter::feed(const char* data, size_t size) {
+    if(format == TransferFormat::Csv) {
+        feedCsv(data, size);
+    } else {
+        feedJson(data, size);
+    }
+}
+
+ImportResult VaultImporter::finish() {
+    if(format == TransferFormat::Csv) {
+        if(in_quotes && !quote_pending) {
+            throw invalid_argument("Line " + to_string(line_no) + ": unterminated quoted field");
+        }
+        if(field_started || !row.empty()) {
+            endCsvRow();
+        }
+    } else if(json_opened && !json_closed) {
+        throw invalid_argument("Unterminated JSON array");
+    }
+    flushBatch();
+
+    finished = true;
+    stop();
+    {
+        lock_guard<mutex> lock(error_mutex);
+        if(error) rethrow_exception(error);
+    }
+    return ImportResult{imported.load(), skipped, breached.load()};
+}
+
+// RFC 4180, one byte at a time so a quoted field can span feed() calls
+void VaultImporter::feedCsv(const char* data, size_t size) {
+    for(size_t i = 0; i < size; i++) {
+        char c = data[i];
+
+        if(in_quotes) {
+            if(quote_pending) {
+                quote_pending = false;
+                if(c == '"') {          // "" inside quotes
+                    field += '"';
+                    continue;
+                }
+                in_quotes = false;      // closing quote, c is handled below
+            } else {
+                if(c == '"') {
+                    quote_pending = true;
+                } else {
+                    if(c == '\n') line_no++;
+                    field += c;
+                }
+                if(field.size() > MAX_CSV_FIELD) {
+                    throw invalid_argument("Line " + to_string(line_no) + ": field too long");
+                }
+                continue;
+            }
+        }
+
+        if(c == ',') {
+            endCsvField();
+        } else if(c == '\n') {
+            endCsvRow();
+            line_no++;
+        } else if(c == '\r') {
+            // dropped - \r\n ends rows like \n
+        } else if(c == '"' && !field_started) {
+            in_quotes = true;
+            field_started = true;
+        } else {
+            field += c;
+            field_started = true;
+            if(field.size() > MAX_CSV_FIELD) {
+                throw invalid_argument("Line " + to_string(line_no) + ": field too long");
+            }
+        }
+    }
+}
+
+void VaultImporter::endCsvField() {
+    row.push_back(move(field));
+    field.clear();
+    field_started = false;
+}
+
+void VaultImporter::endCsvRow() {
+    endCsvField();
+    vector<string> values;
+    values.swap(row);
+
+    // Blank line
+    if(values.size() == 1 && values[0].empty()) return;
+
+    if(header.empty()) {
+        for(const auto& name : values) {
+            // First column wins when two map to the same field (name, url)
+            string column = canonicalColumn(name);
+            if(find(header.begin(), header.end(), column) != header.end()) column.clear();
+            header.push_back(column);
+        }
+        // Rows need all three, like a single add - without a column every row would be skipped
+        for(const char* required : {"site", "username", "password"}) {
+            if(find(header.begin(), header.end(), required) == header.end()) {
+                throw invalid_argument(string("CSV header has no ") + required + " column");
+            }
+        }
+        return;
+    }
+
+    VaultEntryInput input;
+    for(size_t i = 0; i < values.size() && i < header.size(); i++) {
+        const string& column = header[i];
+        if(column == "site") input.site_name = move(values[i]);
+        else if(column == "username") input.username = move(values[i]);
+        else if(column == "password") input.password = move(values[i]);
+        else if(column == "category") input.category = move(values[i]);
+        else if(column == "notes") input.notes = move(values[i]);
+    }
+    addEntry(move(input));
+}
+
+// Top-level array of objects - cut each object out by tracking depth and
+// strings, then parse just that object
+void VaultImporter::feedJson(const char* data, size_t size) {
+    for(size_t i = 0; i < size; i++) {
+        char c = data[i];
+
+        if(json_depth > 0) {
+            object += c;
+            if(object.size() > MAX_JSON_OBJECT) {
+                throw invalid_argument("JSON entry too large");
+            }
+            if(json_in_string) {
+                if(json_escape) {
+                    json_escape = false;
+                } else if(c == '\\') {
+                    json_escape = true;
+                } else if(c == '"') {
+                    json_in_string = false;
+                }
+            } else if(c == '"') {
+                json_in_string = true;
+            } else if(c == '{' || c == '[') {
+                json_depth++;
+            } else if(c == '}' || c == ']') {
+                if(--json_depth == 0) endJsonObject();
+            }
+            continue;
+        }
+
+        if(isspace(static_cast<unsigned char>(c))) continue;
+        if(json_closed) {
+            throw invalid_argument("Unexpected data after JSON array");
+        }
+        if(!json_opened) {
+            if(c != '[') throw invalid_argument("Expected a JSON array");
+            json_opened = true;
+        } else if(c == '{') {
+            json_depth = 1;
+            object = "{";
+        } else if(c == ']') {
+            json_closed = true;
+        } else if(c != ',') {
+            throw invalid_argument("Expected an object in the JSON array");
+        }
+    }
+}
+
+void VaultImporter::endJsonObject() {
+    json entry = json::parse(object, nullptr, false);
+    object.clear();
+    if(entry.is_discarded() || !entry.is_object()) {
+        throw invalid_argument("Malformed JSON entry");
+    }
+
+    auto text = [&entry](const char* key) -> string {
+        auto it = entry.find(key);
+        return it != entry.end() && it->is_string() ? it->get<string>() : string();
+    };
+    VaultEntryInput input;
+    input.site_name = text("site");
+    input.username = text("username");
+    input.password = text("password");
+    input.category = text("category");
+    input.notes = text("notes");
+    addEntry(move(input));
+}
+
+// ---------------------------------------------------------------- export
+
+static void appendCsvField(const string& value, string& out) {
+    if(value.find_first_of(",\"\r\n") == string::npos) {
+        out += value;
+        return;
+    }
+    out += '"';
+    for(char c : value) {
+        if(c == '"') out += '"';
+        out += c;
+    }
+    out += '"';
+}
+
+static void appendEntry(TransferFormat format, const VaultRecord& record, bool first, string& out) {
+    if(format == TransferFormat::Csv) {
+        appendCsvField(record.site_name, out);
+        out += ',';
+        appendCsvField(record.username, out);
+        out += ',';
+        appendCsvField(record.encrypted_password, out);
+        out += ',';
+        appendCsvField(record.category, out);
+        out += ',';
+        appendCsvField(record.notes, out);
+        out += "\r\n";
+        return;
+    }
+
+    if(!first) out += ',';
+    out += "\n{\"site\":";
+    Wire::appendJsonString(record.site_name, out);
+    out += ",\"username\":";
+    Wire::appendJsonString(record.username, out);
+    out += ",\"password\":";
+    Wire::appendJsonString(record.encrypted_password, out);
+    out += ",\"category\":";
+    Wire::appendJsonString(record.category, out);
+    out += ",\"notes\":";
+    Wire::appendJsonString(record.notes, out);
+    out += '}';
+}
+
+namespace {
+struct ExportBatch {
+    uint64_t seq;
+    vector<VaultRecord> records;
+};
+}
+
+// reader thread -> decrypt workers -> this thread, which puts batches back
+// in id order and serializes them
+bool exportVault(StorageManager& storage, uint64_t user_id, TransferFormat format,
+                 const function<bool(const string&)>& write, size_t workers) {
+    BoundedQueue<ExportBatch> loaded(QUEUE_DEPTH);
+    BoundedQueue<ExportBatch> decrypted(QUEUE_DEPTH);
+    atomic<bool> stopped(false);
+    mutex error_mutex;
+    exception_ptr error;
+
+    auto fail = [&](exception_ptr e) {
+        {
+            lock_guard<mutex> lock(error_mutex);
+            if(!error) error = e;
+        }
+        stopped = true;
+        loaded.close();
+        decrypted.close();
+    };
+
+    thread reader([&] {
+        try {
+            uint64_t after_id = 0;
+            for(uint64_t seq = 0; !stopped; seq++) {
+                ExportBatch batch{seq, storage.readVaultBatch(user_id, after_id, TRANSFER_BATCH)};
+                if(batch.records.empty()) break;
+                after_id = batch.records.back().record_id;
+                if(!loaded.push(move(batch))) break;
+            }
+        } catch(...) {
+            fail(current_exception());
+        }
+        loaded.close();
+    });
+
+    vector<thread> decryptors;
+    size_t count = workerCount(workers);
+    atomic<size_t> running(count);
+    for(size_t i = 0; i < count; i++) {
+        decryptors.emplace_back([&] {
+            ExportBatch batch;
+            while(!stopped && loaded.pop(batch)) {
+                try {
+                    storage.decryptEntries(user_id, batch.records);
+                } catch(...) {
+                    fail(current_exception());
+                    break;
+                }
+                if(!decrypted.push(move(batch))) break;
+            }
+            if(--running == 0) decrypted.close();
+        });
+    }
+
+    string buffer = format == TransferFormat::Csv ? "site,username,password,category,notes\r\n" : "[";
+    bool first = true;
+    bool client_alive = true;
+    map<uint64_t, ExportBatch> waiting;
+    uint64_t expected = 0;
+    ExportBatch batch;
+    while(!stopped && decrypted.pop(batch)) {
+        waiting[batch.seq] = move(batch);
+        for(auto it = waiting.begin(); it != waiting.end() && it->first == expected; it = waiting.begin()) {
+            for(const auto& record : it->second.records) {
+                appendEntry(format, record, first, buffer);
+                first = false;
+            }
+            waiting.erase(it);
+            expected++;
+
+            if(buffer.size() >= EXPORT_CHUNK_SIZE) {
+                if(!write(buffer)) {
+                    client_alive = false;
+                    stopped = true;
+                    break;
+                }
+                buffer.clear();
+            }
+        }
+    }
+
+    // Unblock anyone still waiting on a queue, then wait for them
+    stopped = true;
+    loaded.close();
+    decrypted.close();
+    reader.join();
+    for(auto& decryptor : decryptors) {
+        decryptor.join();
+    }
+
+    if(error) rethrow_exception(error);
+    if(!client_alive) return false;
+    if(format == TransferFormat::Json) buffer += "\n]\n";
+    return write(buffer);
+}
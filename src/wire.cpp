@@ -0,0 +1,279 @@
+#include "wire.hpp"
+#include <algorithm>
+#include <cstdlib>
+
+using namespace std;
+
+// Helper: append big-endian integer of n bytes
+static void appendBigEndian(uint64_t value, int bytes, string& out) {
+    for(int i = bytes - 1; i >= 0; i--) {
+        out += static_cast<char>((value >> (i * 8)) & 0xff);
+    }
+}
+
+// Helper: CBOR initial byte + argument
+static void appendCborHead(uint8_t major, uint64_t value, string& out) {
+    uint8_t type = major << 5;
+    if(value < 24) {
+        out += static_cast<char>(type | value);
+    } else if(value <= 0xff) {
+        out += static_cast<char>(type | 24);
+        appendBigEndian(value, 1, out);
+    } else if(value <= 0xffff) {
+        out += static_cast<char>(type | 25);
+        appendBigEndian(value, 2, out);
+    } else if(value <= 0xffffffffULL) {
+        out += static_cast<char>(type | 26);
+        appendBigEndian(value, 4, out);
+    } else {
+        out += static_cast<char>(type | 27);
+        appendBigEndian(value, 8, out);
+    }
+}
+
+// Helper: s without surrounding spaces and tabs, ASCII lowercased
+static string trimLower(const string& s, size_t begin, size_t end) {
+    while(begin < end && (s[begin] == ' ' || s[begin] == '\t')) begin++;
+    while(end > begin && (s[end - 1] == ' ' || s[end - 1] == '\t')) end--;
+    string out = s.substr(begin, end - begin);
+    for(char& c : out) {
+        if(c >= 'A' && c <= 'Z') c = static_cast<char>(c - 'A' + 'a');
+    }
+    return out;
+}
+
+// Helper: a q parameter's weight, 1 when missing or malformed
+static double qValue(const string& value) {
+    char* end = nullptr;
+    double q = strtod(value.c_str(), &end);
+    if(end == value.c_str() || *end != '\0' || !(q >= 0)) return 1.0;
+    return min(q, 1.0);
+}
+
+// Pick response format from the Accept header
+// Each format takes the q of the most specific range that matches it
+// (exact type, then application/*, then */*). The highest q wins; ties
+// go to the more specific range, then the one listed first. q=0 rules a
+// format out, and JSON is the answer when nothing else is acceptable
+WireFormat Wire::negotiate(const string& accept) {
+    static const WireFormat formats[] = {WireFormat::Json, WireFormat::MsgPack, WireFormat::Cbor};
+    struct Preference {
+        int specificity = -1;       // of the range that set q, -1 = not mentioned
+        double q = 0;
+        size_t position = 0;        // that range's index in the header
+    };
+    Preference prefs[3];
+
+    size_t position = 0;
+    for(size_t begin = 0; begin <= accept.size(); position++) {
+        size_t end = accept.find(',', begin);
+        if(end == string::npos) end = accept.size();
+
+        // type/subtype, then ;-separated parameters
+        size_t semi = min(accept.find(';', begin), end);
+        string media = trimLower(accept, begin, semi);
+        double q = 1.0;
+        while(semi < end) {
+            size_t next = min(accept.find(';', semi + 1), end);
+            string param = trimLower(accept, semi + 1, next);
+            if(param.compare(0, 2, "q=") == 0) q = qValue(param.substr(2));
+            semi = next;
+        }
+        begin = end + 1;
+
+        for(size_t i = 0; i < 3; i++) {
+            int specificity = -1;
+            if(media == "*/*") {
+                specificity = 0;
+            } else if(media == "application/*") {
+                specificity = 1;
+            } else if(formats[i] == WireFormat::Json) {
+                if(media == "application/json") specificity = 2;
+            } else if(formats[i] == WireFormat::MsgPack) {
+                if(media == "application/msgpack" || media == "application/x-msgpack") specificity = 2;
+            } else if(media == "application/cbor") {
+                specificity = 2;
+            }
+            if(specificity > prefs[i].specificity) {
+                prefs[i] = {specificity, q, position};
+            }
+        }
+    }
+
+    int best = -1;
+    for(int i = 0; i < 3; i++) {
+        const Preference& p = prefs[i];
+        if(p.specificity < 0 || p.q <= 0) continue;
+        if(best >= 0) {
+            const Preference& b = prefs[best];
+            if(p.q < b.q) continue;
+            if(p.q == b.q && p.specificity < b.specificity) continue;
+            if(p.q == b.q && p.specificity == b.specificity && p.position >= b.position) continue;
+        }
+        best = i;
+    }
+    return best < 0 ? WireFormat::Json : formats[best];
+}
+
+// Format of a request body from its Content-Type
+WireFormat Wire::fromContentType(const string& content_type) {
+    if(content_type.find("msgpack") != string::npos) return WireFormat::MsgPack;
+    if(content_type.find("application/cbor") != string::npos) return WireFormat::Cbor;
+    return WireFormat::Json;
+}
+
+const char* Wire::contentType(WireFormat format) {
+    switch(format) {
+        case WireFormat::MsgPack: return "application/msgpack";
+        case WireFormat::Cbor:    return "application/cbor";
+        default:                  return "application/json";
+    }
+}
+
+// Vault entry with the same fields as the JSON API
+void Wire::appendRecord(WireFormat format, const VaultRecord& record, string& out) {
+    if(format == WireFormat::Json) {
+        out += "{\"id\":\"";
+        out += to_string(record.record_id);
+        out += "\",\"site\":";
+        appendJsonString(record.site_name, out);
+        out += ",\"username\":";
+        appendJsonString(record.username, out);
+        out += ",\"password\":";
+        appendJsonString(record.encrypted_password, out);
+        out += ",\"category\":";
+        appendJsonString(record.category, out);
+        out += ",\"notes\":";
+        appendJsonString(record.notes, out);
+        out += '}';
+        return;
+    }
+
+    appendMapHeader(format, 6, out);
+    appendString(format, "id", out);
+    appendString(format, to_string(record.record_id), out);
+    appendString(format, "site", out);
+    appendString(format, record.site_name, out);
+    appendString(format, "username", out);
+    appendString(format, record.username, out);
+    appendString(format, "password", out);
+    appendString(format, record.encrypted_password, out);
+    appendString(format, "category", out);
+    appendString(format, record.category, out);
+    appendString(format, "notes", out);
+    appendString(format, record.notes, out);
+}
+
+void Wire::appendMapHeader(WireFormat format, uint64_t count, string& out) {
+    if(format == WireFormat::Cbor) {
+        appendCborHead(5, count, out);
+    } else if(count < 16) {
+        out += static_cast<char>(0x80 | count);
+    } else if(count <= 0xffff) {
+        out += static_cast<char>(0xde);
+        appendBigEndian(count, 2, out);
+    } else {
+        out += static_cast<char>(0xdf);
+        appendBigEndian(count, 4, out);
+    }
+}
+
+void Wire::appendArrayHeader(WireFormat format, uint64_t count, string& out) {
+    if(format == WireFormat::Cbor) {
+        appendCborHead(4, count, out);
+    } else if(count < 16) {
+        out += static_cast<char>(0x90 | count);
+    } else if(count <= 0xffff) {
+        out += static_cast<char>(0xdc);
+        appendBigEndian(count, 2, out);
+    } else {
+        out += static_cast<char>(0xdd);
+        appendBigEndian(count, 4, out);
+    }
+}
+
+void Wire::appendString(WireFormat format, const string& value, string& out) {
+    uint64_t len = value.length();
+    if(format == WireFormat::Cbor) {
+        appendCborHead(3, len, out);
+    } else if(len < 32) {
+        out += static_cast<char>(0xa0 | len);
+    } else if(len <= 0xff) {
+        out += static_cast<char>(0xd9);
+        appendBigEndian(len, 1, out);
+    } else if(len <= 0xffff) {
+        out += static_cast<char>(0xda);
+        appendBigEndian(len, 2, out);
+    } else {
+        out += static_cast<char>(0xdb);
+        appendBigEndian(len, 4, out);
+    }
+    out += value;
+}
+
+void Wire::appendUInt(WireFormat format, uint64_t value, string& out) {
+    if(format == WireFormat::Cbor) {
+        appendCborHead(0, value, out);
+    } else if(value < 128) {
+        out += static_cast<char>(value);
+    } else if(value <= 0xff) {
+        out += static_cast<char>(0xcc);
+        appendBigEndian(value, 1, out);
+    } else if(value <= 0xffff) {
+        out += static_cast<char>(0xcd);
+        appendBigEndian(value, 2, out);
+    } else if(value <= 0xffffffffULL) {
+        out += static_cast<char>(0xce);
+        appendBigEndian(value, 4, out);
+    } else {
+        out += static_cast<char>(0xcf);
+        appendBigEndian(value, 8, out);
+    }
+}
+
+void Wire::appendBool(WireFormat format, bool value, string& out) {
+    if(format == WireFormat::Cbor) {
+        out += static_cast<char>(value ? 0xf5 : 0xf4);
+    } else {
+        out += static_cast<char>(value ? 0xc3 : 0xc2);
+    }
+}
+
+void Wire::appendNull(WireFormat format, string& out) {
+    out += static_cast<char>(format == WireFormat::Cbor ? 0xf6 : 0xc0);
+}
+
+void Wire::appendIndefiniteArray(string& out) {
+    out += static_cast<char>(0x9f);
+}
+
+void Wire::appendBreak(string& out) {
+    out += static_cast<char>(0xff);
+}
+
+// Quoted and escaped JSON string
+void Wire::appendJsonString(const string& value, string& out) {
+    static const char hex_digits[] = "0123456789abcdef";
+
+    out += '"';
+    for(unsigned char c : value) {
+        switch(c) {
+            case '"':  out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\n': out += "\\n"; break;
+            case '\r': out += "\\r"; break;
+            case '\t': out += "\\t"; break;
+            case '\b': out += "\\b"; break;
+            case '\f': out += "\\f"; break;
+            default:
+                if(c < 0x20) {
+                    out += "\\u00";
+                    out += hex_digits[c >> 4];
+                    out += hex_digits[c & 0xf];
+                } else {
+                    out += static_cast<char>(c);
+                }
+        }
+    }
+    out += '"';
+}
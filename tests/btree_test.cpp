@@ -0,0 +1,336 @@
+// Correctness checks for the B-Tree storage engine
+//
+// Each case builds a vault in a scratch directory from a fixed seed and
+// compares the tree against a plain map of what it should hold, before
+// and after reopening the files.
+//
+// Usage: vault_btree_test (run through ctest)
+#include "btree.hpp"
+#include "compactor.hpp"
+#include "check.hpp"
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <mutex>
+#include <random>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+static const uint64_t USERS = 4;
+
+// What a record should look like, by id
+using Expected = map<uint64_t, VaultRecord>;
+
+// Site names from a few bytes to a few dozen, so pages hold uneven key counts
+static VaultRecord makeRecord(mt19937_64& rng, uint64_t n) {
+    VaultRecord record{};
+    record.user_id = 1 + rng() % USERS;
+    record.site_name = "site-" + to_string(n) + "-" + string(rng() % 40, 'a' + n % 26);
+    record.username = "user" + to_string(rng() % 1000);
+    record.encrypted_password = "cipher" + to_string(rng());
+    record.iv = "iv" + to_string(n);
+    record.notes = n % 3 == 0 ? "note " + to_string(n) : "";
+    record.category = "cat" + to_string(n % 5);
+    return record;
+}
+
+static string readFile(const string& path) {
+    ifstream file(path, ios::binary);
+    return string(istreambuf_iterator<char>(file), istreambuf_iterator<char>());
+}
+
+static uint64_t usedPages(const BTree& tree) {
+    StorageStats stats = tree.storageStats();
+    return (stats.node_file_bytes - stats.free_node_bytes) / NODE_PAGE_SIZE;
+}
+
+// Every expected record readable by id and found under its name, and the
+// index holding nothing else
+static void checkContents(BTree& tree, const Expected& expected, uint64_t max_id) {
+    for(uint64_t record_id = 1; record_id <= max_id; record_id++) {
+        VaultRecord record;
+        auto it = expected.find(record_id);
+        if(it == expected.end()) {
+            CHECK(!tree.get(record_id, record));
+            continue;
+        }
+        const VaultRecord& want = it->second;
+        CHECK(tree.get(record_id, record));
+        CHECK(record.user_id == want.user_id);
+        CHECK(record.site_name == want.site_name);
+        CHECK(record.username == want.username);
+        CHECK(record.encrypted_password == want.encrypted_password);
+        CHECK(record.category == want.category);
+
+        vector<uint64_t> ids = tree.lookupRecordIds(want.user_id, want.site_name);
+        CHECK(find(ids.begin(), ids.end(), record_id) != ids.end());
+    }
+
+    for(uint64_t user_id = 1; user_id <= USERS; user_id++) {
+        uint64_t want = count_if(expected.begin(), expected.end(),
+                                 [user_id](const pair<const uint64_t, VaultRecord>& e) { return e.second.user_id == user_id; });
+        uint64_t keys = 0;
+        tree.scanPrefix(user_id, "", "", 0, [&](string_view, uint64_t record_id) {
+            CHECK(expected.count(record_id) == 1);
+            keys++;
+            return true;
+        });
+        CHECK(keys == want);
+    }
+}
+
+// Enough deletes to merge leaves, shrink the root and cut freed pages off
+// the end of the node file, then inserts to reuse them. Reopening must
+// find the same tree without rebuilding it
+static void testDeleteAndReopen() {
+    ScratchDir dir("vault_btree_test_delete");
+    string vault = dir.file("vault.dat");
+    mt19937_64 rng(35);
+    Expected expected;
+    uint64_t max_id = 0;
+    uint64_t peak_pages = 0, peak_bytes = 0;
+
+    {
+        BTree tree(vault);
+        for(uint64_t n = 0; n < 6000; n++) {
+            VaultRecord record = makeRecord(rng, n);
+            record.record_id = tree.insert(record);
+            expected[record.record_id] = record;
+            max_id = max(max_id, record.record_id);
+        }
+        peak_pages = usedPages(tree);
+        peak_bytes = tree.storageStats().node_file_bytes;
+        CHECK(peak_pages > 20);     // several levels' worth of pages
+        checkContents(tree, expected, max_id);
+
+        // All but a few, in random order
+        vector<uint64_t> ids;
+        for(const auto& entry : expected) ids.push_back(entry.first);
+        shuffle(ids.begin(), ids.end(), rng);
+        for(size_t i = 0; i < ids.size() - 10; i++) {
+            CHECK(tree.remove(ids[i]));
+            expected.erase(ids[i]);
+        }
+        CHECK(!tree.remove(ids[0]));
+        checkContents(tree, expected, max_id);
+
+        // Merges and root collapses leave a page or two in use, and the
+        // freed tail of the file is given back
+        CHECK(usedPages(tree) <= 2);
+        CHECK(tree.storageStats().node_file_bytes < peak_bytes);
+    }
+
+    // A sound index is used as it is - rebuilding it would rewrite vault.dat
+    string before = readFile(vault);
+    {
+        BTree tree(vault);
+        checkContents(tree, expected, max_id);
+    }
+    CHECK(readFile(vault) == before);
+
+    {
+        BTree tree(vault);
+
+        // Freed pages get reused, renames move keys
+        for(uint64_t n = 6000; n < 7000; n++) {
+            VaultRecord record = makeRecord(rng, n);
+            record.record_id = tree.insert(record);
+            expected[record.record_id] = record;
+            max_id = max(max_id, record.record_id);
+        }
+        for(auto& entry : expected) {
+            if(entry.first % 7 != 0) continue;
+            entry.second.site_name = "renamed-" + to_string(entry.first);
+            CHECK(tree.update(entry.first, entry.second));
+        }
+        checkContents(tree, expected, max_id);
+        CHECK(usedPages(tree) < peak_pages);
+    }
+
+    before = readFile(vault);
+    {
+        BTree tree(vault);
+        checkContents(tree, expected, max_id);
+    }
+    CHECK(readFile(vault) == before);
+}
+
+// A crash between a record write and its index change, played back by
+// pairing an older node file with newer records: open has to notice and
+// rebuild the index from the records
+static void testStaleIndexRebuilt() {
+    ScratchDir dir("vault_btree_test_stale");
+    string vault = dir.file("vault.dat");
+    mt19937_64 rng(3535);
+    Expected expected;
+    uint64_t max_id = 0;
+
+    {
+        BTree tree(vault);
+        for(uint64_t n = 0; n < 500; n++) {
+            VaultRecord record = makeRecord(rng, n);
+            record.record_id = tree.insert(record);
+            expected[record.record_id] = record;
+            max_id = max(max_id, record.record_id);
+        }
+    }
+    string old_nodes = readFile(vault);
+    {
+        BTree tree(vault);
+        CHECK(tree.remove(1));
+        expected.erase(1);
+        expected[2].site_name = "moved";
+        CHECK(tree.update(2, expected[2]));
+        VaultRecord record = makeRecord(rng, 500);
+        record.record_id = tree.insert(record);
+        expected[record.record_id] = record;
+        max_id = record.record_id;
+    }
+    ofstream(vault, ios::binary | ios::trunc) << old_nodes;
+
+    BTree tree(vault);
+    checkContents(tree, expected, max_id);
+}
+
+// One random write: insert, update (sometimes a rename) or delete
+static void randomWrite(BTree& tree, mt19937_64& rng, Expected& expected, uint64_t& max_id, uint64_t n) {
+    uint64_t pick = rng() % 3;
+    if(pick == 0 || expected.empty()) {
+        VaultRecord record = makeRecord(rng, n);
+        record.record_id = tree.insert(record);
+        expected[record.record_id] = record;
+        max_id = max(max_id, record.record_id);
+        return;
+    }
+    auto it = expected.lower_bound(1 + rng() % max_id);
+    if(it == expected.end()) it = expected.begin();
+    if(pick == 1) {
+        it->second.username = "changed" + to_string(n);
+        if(n % 2) it->second.site_name = "renamed-" + to_string(n);
+        CHECK(tree.update(it->first, it->second));
+    } else {
+        CHECK(tree.remove(it->first));
+        expected.erase(it);
+    }
+}
+
+// A fragmented vault with some history: a third updated, a third deleted
+static void fragment(BTree& tree, mt19937_64& rng, Expected& expected, uint64_t& max_id, uint64_t records) {
+    for(uint64_t n = 0; n < records; n++) {
+        VaultRecord record = makeRecord(rng, n);
+        record.record_id = tree.insert(record);
+        expected[record.record_id] = record;
+        max_id = max(max_id, record.record_id);
+    }
+    for(uint64_t record_id = 1; record_id <= max_id; record_id++) {
+        if(record_id % 3 == 1) {
+            expected[record_id].notes = "updated";
+            CHECK(tree.update(record_id, expected[record_id]));
+        } else if(record_id % 3 == 2) {
+            CHECK(tree.remove(record_id));
+            expected.erase(record_id);
+        }
+    }
+}
+
+// Compaction steps with writes between every chunk - to records already
+// copied and ones still ahead - then the swap
+static void testCompactionInterleaved() {
+    ScratchDir dir("vault_btree_test_compact");
+    string vault = dir.file("vault.dat");
+    mt19937_64 rng(37);
+    Expected expected;
+    uint64_t max_id = 0;
+
+    {
+        BTree tree(vault);
+        fragment(tree, rng, expected, max_id, 3000);
+        StorageStats before = tree.storageStats();
+        CHECK(before.dead_record_bytes > 0);
+
+        CompactionState state;
+        tree.beginCompaction(state);
+        uint64_t n = 100000;
+        bool done = false;
+        while(!done) {
+            done = tree.copyLiveRecords(state, 8 * 1024);
+            for(int i = 0; i < 15; i++) {
+                randomWrite(tree, rng, expected, max_id, n++);
+            }
+        }
+        tree.finishCompaction(state);
+        tree.swapCompaction(state);
+
+        checkContents(tree, expected, max_id);
+        StorageStats after = tree.storageStats();
+        CHECK(after.record_file_bytes < before.record_file_bytes);
+        CHECK(after.fragmentation() < before.fragmentation());
+
+        // Carries on as a normal tree
+        for(int i = 0; i < 200; i++) {
+            randomWrite(tree, rng, expected, max_id, n++);
+        }
+        checkContents(tree, expected, max_id);
+    }
+
+    string before = readFile(vault);
+    BTree tree(vault);
+    checkContents(tree, expected, max_id);
+    CHECK(readFile(vault) == before);
+}
+
+// The background compactor under its real locking, with a writer going
+// the whole time it runs
+static void testCompactorWithWriter() {
+    ScratchDir dir("vault_btree_test_compactor");
+    string vault = dir.file("vault.dat");
+    mt19937_64 rng(3737);
+    Expected expected;
+    uint64_t max_id = 0;
+
+    BTree tree(vault);
+    shared_mutex vault_mutex;
+    mutex write_gate;
+    fragment(tree, rng, expected, max_id, 20000);
+
+    {
+        Compactor compactor(tree, vault_mutex, write_gate);
+        CompactionSettings settings;
+        settings.check_interval_sec = 0;            // only when asked
+        settings.rate_bytes_per_sec = 4 * 1024 * 1024;
+        compactor.start(settings);
+        compactor.request();
+
+        uint64_t n = 100000;
+        uint64_t writes = 0;
+        auto deadline = chrono::steady_clock::now() + chrono::seconds(30);
+        while(compactor.status().runs == 0) {
+            CHECK(chrono::steady_clock::now() < deadline);
+            {
+                lock_guard<mutex> gate(write_gate);
+                unique_lock<shared_mutex> lock(vault_mutex);
+                randomWrite(tree, rng, expected, max_id, n++);
+                writes++;
+            }
+            this_thread::yield();   // give the compactor a turn at the locks
+        }
+        CHECK(writes > 0);
+        CHECK(compactor.status().total_reclaimed_bytes > 0);
+    }
+    checkContents(tree, expected, max_id);
+}
+
+int main() {
+    testDeleteAndReopen();
+    testStaleIndexRebuilt();
+    testCompactionInterleaved();
+    testCompactorWithWriter();
+    cout << "btree tests passed" << endl;
+    return 0;
+}
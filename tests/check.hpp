@@ -0,0 +1,38 @@
+#ifndef TESTS_CHECK_HPP
+#define TESTS_CHECK_HPP
+
+#include <filesystem>
+#include <iostream>
+#include <string>
+#include <cstdlib>
+
+using namespace std;
+
+// Stop the whole run on the first failed check - the test binaries are
+// run by ctest, which only looks at the exit code and the output
+#define CHECK(cond) do { \
+    if(!(cond)) { \
+        cerr << __FILE__ << ":" << __LINE__ << ": CHECK failed: " #cond << endl; \
+        exit(1); \
+    } \
+} while(0)
+
+// A fresh directory for one case, removed again afterwards
+class ScratchDir {
+private:
+    string dir;
+
+public:
+    explicit ScratchDir(const string& name) : dir((filesystem::temp_directory_path() / name).string()) {
+        filesystem::remove_all(dir);
+        filesystem::create_directories(dir);
+    }
+    ~ScratchDir() {
+        error_code ec;
+        filesystem::remove_all(dir, ec);
+    }
+
+    string file(const string& name) const { return dir + "/" + name; }
+};
+
+#endif
@@ -0,0 +1,46 @@
+// Converts a Have I Been Pwned SHA-1 dump into the server's breach corpus
+//
+// Input is the "ordered by hash" text file, one "SHA1HEX:count" per line
+// (counts are ignored). Output is the sorted binary file that
+// password_vault_server maps with --breach_corpus.
+//
+// Usage: breach_convert INPUT.txt OUTPUT.bin     (INPUT "-" reads stdin)
+#include "breach_corpus.hpp"
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <string>
+
+using namespace std;
+
+int main(int argc, char* argv[]) {
+    if(argc != 3) {
+        cerr << "Usage: breach_convert INPUT.txt OUTPUT.bin     (INPUT - reads stdin)" << endl;
+        return 1;
+    }
+
+    string input = argv[1];
+    string output = argv[2];
+    auto start = chrono::steady_clock::now();
+
+    try {
+        uint64_t hashes;
+        if(input == "-") {
+            hashes = BreachCorpus::convert(cin, output);
+        } else {
+            ifstream in(input);
+            if(!in.is_open()) {
+                cerr << "Failed to open " << input << endl;
+                return 1;
+            }
+            hashes = BreachCorpus::convert(in, output);
+        }
+
+        double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        cout << "Wrote " << hashes << " hashes to " << output << " in " << elapsed << "s" << endl;
+    } catch(const exception& e) {
+        cerr << "Error: " << e.what() << endl;
+        return 1;
+    }
+    return 0;
+}
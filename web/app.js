@@ -1,5 +1,6 @@
 // API Configuration
 const API_URL = 'http://localhost:8080/api';
+const PAGE_SIZE = 200;  // passwords per request when loading the vault
 
 // Session storage
 let currentSession = {
@@ -131,6 +132,26 @@ function updateStats() {
     document.getElementById('weakPasswords').textContent = weak;
 }
 
+// Reused passwords - the server groups entries by password fingerprint,
+// nothing is decrypted for it
+async function loadReuseAudit() {
+    try {
+        const response = await fetch(`${API_URL}/audit/reuse`, {
+            headers: {
+                'Authorization': currentSession.sessionToken,
+                'X-Username': currentSession.username
+            }
+        });
+        const data = await response.json();
+        if (data.success) {
+            const reused = data.groups.reduce((sum, group) => sum + group.count, 0);
+            document.getElementById('reusedPasswords').textContent = reused;
+        }
+    } catch (error) {
+        // Stat just stays as it was
+    }
+}
+
 // Page Navigation
 function showLoginPage() {
     document.getElementById('loginPage').classList.remove('hidden');
@@ -278,27 +299,110 @@ function logout() {
 
 // Load Passwords
 async function loadPasswords() {
+    loadCategories();
+    loadReuseAudit();
     try {
-        const response = await fetch(`${API_URL}/passwords`, {
-            method: 'GET',
+        // Page through the vault - the first page paints right away and
+        // the rest fill in behind it
+        const loaded = [];
+        let cursor = null;
+        do {
+            let url = `${API_URL}/passwords?limit=${PAGE_SIZE}`;
+            if (cursor) url += `&cursor=${encodeURIComponent(cursor)}`;
+            
+            const response = await fetch(url, {
+                method: 'GET',
+                headers: {
+                    'Authorization': currentSession.sessionToken,
+                    'X-Username': currentSession.username
+                }
+            });
+            
+            const data = await response.json();
+            
+            if (!data.success) {
+                showToast('Failed to load passwords');
+                return;
+            }
+            
+            loaded.push(...(data.passwords || []));
+            allPasswords = loaded;
+            updateStats();
+            if (!document.getElementById('searchInput').value &&
+                !document.getElementById('categoryFilter').value) {
+                renderPasswords(allPasswords);
+            }
+            cursor = data.nextCursor;
+        } while (cursor);
+        
+        if (document.getElementById('categoryFilter').value) {
+            filterCategory();
+        }
+    } catch (error) {
+        showToast('Server connection failed');
+        console.error('Load passwords error:', error);
+    }
+}
+
+// Category filter - counts and members come from the server's category
+// index, so neither needs the rest of the vault
+async function loadCategories() {
+    try {
+        const response = await fetch(`${API_URL}/categories`, {
             headers: {
                 'Authorization': currentSession.sessionToken,
                 'X-Username': currentSession.username
             }
         });
-        
         const data = await response.json();
+        if (!data.success) return;
         
-        if (data.success) {
-            allPasswords = data.passwords || [];
-            updateStats();
-            renderPasswords(allPasswords);
-        } else {
-            showToast('Failed to load passwords');
+        const select = document.getElementById('categoryFilter');
+        const selected = select.value;
+        select.options.length = 1;  // keep "All categories"
+        data.categories.forEach(c => select.add(new Option(`${c.name} (${c.count})`, c.name)));
+        if (data.categories.some(c => c.name === selected)) {
+            select.value = selected;
+        }
+    } catch (error) {
+        // Filter just stays as it was
+    }
+}
+
+async function filterCategory() {
+    const category = document.getElementById('categoryFilter').value;
+    if (!category) {
+        searchPasswords();
+        return;
+    }
+    
+    try {
+        const filtered = [];
+        let cursor = null;
+        do {
+            let url = `${API_URL}/passwords?category=${encodeURIComponent(category)}&limit=${PAGE_SIZE}`;
+            if (cursor) url += `&cursor=${encodeURIComponent(cursor)}`;
+            
+            const response = await fetch(url, {
+                headers: {
+                    'Authorization': currentSession.sessionToken,
+                    'X-Username': currentSession.username
+                }
+            });
+            const data = await response.json();
+            if (!data.success) {
+                showToast('Failed to load passwords');
+                return;
+            }
+            filtered.push(...(data.passwords || []));
+            cursor = data.nextCursor;
+        } while (cursor);
+        
+        if (document.getElementById('categoryFilter').value === category) {
+            renderPasswords(filtered);
         }
     } catch (error) {
         showToast('Server connection failed');
-        console.error('Load passwords error:', error);
     }
 }
 
@@ -346,6 +450,7 @@ function renderPasswords(passwords) {
 // Search Passwords
 function searchPasswords() {
     const query = document.getElementById('searchInput').value.toLowerCase();
+    suggestSites(query);
     
     if (!query) {
         renderPasswords(allPasswords);
@@ -359,6 +464,65 @@ function searchPasswords() {
     );
     
     renderPasswords(filtered);
+    rankedSearch(query);
+}
+
+// Ranked search - the server's trigram index also finds near misses
+// ("githb" -> github). Shows the local filter until it answers
+let searchTimer = null;
+
+function rankedSearch(query) {
+    clearTimeout(searchTimer);
+    if (query.length < 3) return;
+    
+    searchTimer = setTimeout(async () => {
+        try {
+            const response = await fetch(`${API_URL}/passwords/search?q=${encodeURIComponent(query)}&limit=50`, {
+                headers: {
+                    'Authorization': currentSession.sessionToken,
+                    'X-Username': currentSession.username
+                }
+            });
+            const data = await response.json();
+            const current = document.getElementById('searchInput').value.toLowerCase();
+            if (data.success && current === query) {
+                renderPasswords(data.passwords);
+            }
+        } catch (error) {
+            // Keep the local results
+        }
+    }, 250);
+}
+
+// Site name autocomplete - the server walks its index from the prefix,
+// so this stays fast no matter how big the vault is
+let suggestTimer = null;
+
+function suggestSites(prefix) {
+    clearTimeout(suggestTimer);
+    const list = document.getElementById('siteSuggestions');
+    if (!prefix) {
+        list.innerHTML = '';
+        return;
+    }
+    
+    suggestTimer = setTimeout(async () => {
+        try {
+            const response = await fetch(`${API_URL}/passwords/search?prefix=${encodeURIComponent(prefix)}&limit=8`, {
+                headers: {
+                    'Authorization': currentSession.sessionToken,
+                    'X-Username': currentSession.username
+                }
+            });
+            const data = await response.json();
+            if (data.success) {
+                const sites = [...new Set(data.passwords.map(pwd => pwd.site))];
+                list.innerHTML = sites.map(site => `<option value="${escapeHtml(site)}">`).join('');
+            }
+        } catch (error) {
+            // Suggestions are optional - the local filter still works
+        }
+    }, 150);
 }
 
 // Toggle Password Visibility
@@ -440,7 +604,9 @@ async function handlePasswordSubmit(e) {
         const data = await response.json();
         
         if (data.success) {
-            showToast(passwordId ? 'Password updated' : 'Password added');
+            showToast(data.breached
+                ? 'Saved - but this password appears in a known data breach'
+                : (passwordId ? 'Password updated' : 'Password added'));
             closePasswordModal();
             loadPasswords();
         } else {
@@ -452,6 +618,66 @@ async function handlePasswordSubmit(e) {
     }
 }
 
+// Import a CSV or JSON file - the server streams it in, so big files are fine
+async function importVault(input) {
+    const file = input.files[0];
+    input.value = '';
+    if (!file) {
+        return;
+    }
+    
+    const format = file.name.toLowerCase().endsWith('.csv') ? 'csv' : 'json';
+    try {
+        const response = await fetch(`${API_URL}/import?format=${format}`, {
+            method: 'POST',
+            headers: {
+                'Content-Type': format === 'csv' ? 'text/csv' : 'application/json',
+                'Authorization': currentSession.sessionToken,
+                'X-Username': currentSession.username
+            },
+            body: file
+        });
+        
+        const data = await response.json();
+        
+        if (data.success) {
+            showToast(`Imported ${data.imported} passwords` + (data.skipped ? `, skipped ${data.skipped}` : ''));
+            loadPasswords();
+        } else {
+            showToast(data.message || 'Import failed');
+        }
+    } catch (error) {
+        showToast('Server connection failed');
+        console.error('Import error:', error);
+    }
+}
+
+// Export as CSV and hand it to the browser as a download
+async function exportVault() {
+    try {
+        const response = await fetch(`${API_URL}/export?format=csv`, {
+            headers: {
+                'Authorization': currentSession.sessionToken,
+                'X-Username': currentSession.username
+            }
+        });
+        if (!response.ok) {
+            showToast('Export failed');
+            return;
+        }
+        
+        const url = URL.createObjectURL(await response.blob());
+        const link = document.createElement('a');
+        link.href = url;
+        link.download = 'vault.csv';
+        link.click();
+        URL.revokeObjectURL(url);
+    } catch (error) {
+        showToast('Server connection failed');
+        console.error('Export error:', error);
+    }
+}
+
 // Delete Password
 async function deletePassword(id, site) {
     if (!confirm(`Delete password for ${site}?`)) {